@@ -0,0 +1,9 @@
+#!/bin/sh
+# Writes a file of $1 lambda definitions, and a call to one of them, to
+# standard output: the source for the load workloads.
+awk -v n="${1:-40000}" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        printf "(def {f%d} (\\\\ {x y} {if (> x %d) {+ x (* y %d)} {list x y \"s%d\" {a b c}}}))\n", i, i % 7, i % 5, i
+    }
+    print "(print (f12 3 4))"
+}'
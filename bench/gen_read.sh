@@ -0,0 +1,11 @@
+#!/bin/sh
+# Writes about $1 MB of data forms to standard output: the source for the
+# read workloads, which costs little to evaluate, so that its time is
+# mostly the reader's.
+awk -v mb="${1:-100}" 'BEGIN {
+    for (i = 0; size < mb * 1048576; i++) {
+        line = sprintf("{item%d %d \"name %d\" {key-%d value-%d} \"tab\\there\" %d} ; row %d", i, i * 7, i, i % 97, i % 13, i % 1000, i)
+        print line
+        size += length(line) + 1
+    }
+}'
@@ -0,0 +1,91 @@
+#!/bin/sh
+# Runs each workload REPEAT times and writes the best wall time, the
+# allocations and the peak RSS of each to OUT/results.tsv, then prints
+# them next to bench/baseline.tsv. Exits 1 if a workload failed, or if
+# any figure is more than THRESHOLD percent above its baseline (peak RSS
+# also by more than 1 MB, since small processes vary by that much).
+#
+# usage: bench/run.sh MYLISP [OUT]
+# With UPDATE_BASELINE=1, the results become the new baseline instead.
+# READ_MB sets the size of the read workloads' source (100 MB).
+
+MYLISP=$1
+OUT=${2:-bench/out}
+BENCH=$(dirname "$0")
+REPEAT=${REPEAT:-5}
+THRESHOLD=${THRESHOLD:-10}
+READ_MB=${READ_MB:-100}
+
+if [ -z "$MYLISP" ]; then
+    echo "usage: $0 MYLISP [OUT]" >&2
+    exit 2
+fi
+mkdir -p "$OUT"
+sh "$BENCH/gen_load.sh" 40000 > "$OUT/load.mylisp"
+rm -f "$OUT/load.mylispc"
+sh "$BENCH/gen_read.sh" "$READ_MB" > "$OUT/read.mylisp"
+
+RESULTS=$OUT/results.tsv
+printf 'workload\twall_ms\tallocs\tpeak_rss_kb\n' > "$RESULTS"
+failed=0
+
+# name, file, flags, and the file for standard input
+run() {
+    best=
+    for i in $(seq "$REPEAT"); do
+        # The stats line goes to stderr, and errors to stdout.
+        stats=$("$MYLISP" --stats $3 "$2" 2>&1 <"${4:-/dev/null}" >"$OUT/$1.out" | grep '^stats ')
+        if [ -z "$stats" ] || grep -q '^Error' "$OUT/$1.out"; then
+            echo "$1: failed, see $OUT/$1.out" >&2
+            failed=1
+            return
+        fi
+        wall=$(echo "$stats" | sed 's/.*wall_ms=\([^ ]*\).*/\1/')
+        if [ -z "$best" ] || awk "BEGIN { exit !($wall < $best) }"; then
+            best=$wall
+            line=$stats
+        fi
+    done
+    allocs=$(echo "$line" | sed 's/.*allocs=\([^ ]*\).*/\1/')
+    rss=$(echo "$line" | sed 's/.*peak_rss_kb=\([^ ]*\).*/\1/')
+    printf '%s\t%s\t%s\t%s\n' "$1" "$best" "$allocs" "$rss" >> "$RESULTS"
+}
+
+# --no-cache keeps the workloads from leaving caches in the source tree.
+run fib "$BENCH/fib.mylisp" --no-cache
+run lists "$BENCH/lists.mylisp" --no-cache
+run defs "$BENCH/defs.mylisp" --no-cache
+run curry "$BENCH/curry.mylisp" --no-cache
+run load "$OUT/load.mylisp" --no-cache
+# The first run writes the cache, so the best is a cached load.
+run load-cached "$OUT/load.mylisp"
+# A file is mapped and read by scan.c; standard input, by flex and bison.
+run read "$OUT/read.mylisp" --no-cache
+run read-stdin - --no-cache "$OUT/read.mylisp"
+
+if [ "$UPDATE_BASELINE" = 1 ] || [ ! -f "$BENCH/baseline.tsv" ]; then
+    cp "$RESULTS" "$BENCH/baseline.tsv"
+    cat "$RESULTS"
+    exit $failed
+fi
+
+# Each figure, its baseline and the change in percent, flagged when
+# over the threshold.
+awk -F '\t' -v t="$THRESHOLD" '
+    function cmp(now, base, slack) {
+        if (base == "" || base == 0) { return now "\t-\t-" }
+        d = (now - base) * 100 / base
+        bad = d > t && now - base > slack
+        if (bad) { worse = 1 }
+        return sprintf("%s\t%s\t%+.1f%%%s", now, base, d, bad ? "!" : "")
+    }
+    FNR == 1 { next }
+    NR == FNR { w[$1] = $2; a[$1] = $3; r[$1] = $4; next }
+    BEGIN {
+        print "workload\twall_ms\tbase\tchange\tallocs\tbase\tchange\tpeak_rss_kb\tbase\tchange"
+    }
+    { print $1 "\t" cmp($2, w[$1], 0) "\t" cmp($3, a[$1], 0) "\t" cmp($4, r[$1], 1024) }
+    END { exit worse }
+' "$BENCH/baseline.tsv" "$RESULTS" || failed=1
+
+exit $failed
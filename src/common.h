@@ -5,10 +5,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
 #include <math.h>   // For fmod
 
-void yyerror(const char *s);
-
 struct lval;
 struct lenv;
 
@@ -0,0 +1,22 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include "mylisp.h"
+#include "gc.h"
+#include "pmap.h"
+
+// The inside of an interpreter context (see mylisp.h).
+struct mylisp {
+    struct gc_heap* heap;
+    struct lenv* env;          // NULL for a pmap worker between jobs
+    struct pmap_pool* pool;    // made on the first pmap
+    int worker;                // a pmap worker, which maps sequentially
+};
+
+// A context with a heap and nothing else, for a pmap worker.
+struct mylisp* mylisp_new_worker(void);
+
+// The context the calling thread is in, or NULL.
+struct mylisp* mylisp_current(void);
+
+#endif // CONTEXT_H
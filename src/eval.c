@@ -1,9 +1,15 @@
 #include "eval.h"
-#include "parser.tab.h"
-
-extern int yyparse(void);
-extern struct lval* ast_root;
-extern FILE* yyin;
+#include "gc.h"
+#include "map.h"
+#include "memo.h"
+#include "out.h"
+#include "pmap.h"
+#include "pool.h"
+#include "profile.h"
+#include "sample.h"
+#include "str.h"
+#include "vec.h"
+#include "vm.h"
 
 #define LASSERT(args, cond, fmt, ...) \
     if (!(cond)) { \
@@ -13,9 +19,9 @@ extern FILE* yyin;
     }
 
 #define LASSERT_TYPE(func, args, index, expect) \
-    LASSERT(args, args->cell[index]->type == expect, \
+    LASSERT(args, lval_type_of(args->cell[index]) == expect, \
         "Function \'%s\' passed incorrect type for argument %i. Got %s, Expected %s.", \
-        func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+        func, index, ltype_name(lval_type_of(args->cell[index])), ltype_name(expect))
 
 #define LASSERT_NUM_ARGS(func, args, num) \
     LASSERT(args, args->count == num, \
@@ -28,52 +34,242 @@ extern FILE* yyin;
 
 
 struct lval* lval_eval(struct lenv* e, struct lval* v) {
-    if (v->type == LVAL_SYM) {
-        struct lval* x = lenv_get(e, v);
+    gc_maybe_collect();
+    if (lval_type_of(v) == LVAL_SYM) {
+        struct lval* x = lenv_lookup(e, v);
         lval_del(v);
         return x;
     }
-    if (v->type == LVAL_SEXPR) {
+    if (lval_type_of(v) == LVAL_SEXPR) {
         return lval_eval_sexpr(e, v);
     }
     return v;
 }
 
+static struct lval* lval_bind(struct lenv* e, struct lval* f, struct lval* a);
+static struct lval* lval_eval_tail(struct lenv* e, struct lval* v, struct lval* f);
+static struct lval* if_branch(struct lval* a);
+static struct lval* eval_expr(struct lval* a);
+
 struct lval* lval_eval_sexpr(struct lenv* e, struct lval* v) {
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
+    return lval_eval_tail(e, v, NULL);
+}
+
+// While a profiler is running (profile.h, sample.h), each call made is
+// reported to it by the name of the symbol it was made through and the
+// line of the S-Expression that made it. lval_eval_tail keeps in open
+// the OBSERVED_ flags of the profilers that its lambda's call is open in.
+enum { OBSERVED_PROFILE = 1, OBSERVED_SAMPLE = 2 };
+
+static int observe_begin(const char* name, int line) {
+    int open = 0;
+    if (profile_current) { profile_enter(name); open |= OBSERVED_PROFILE; }
+    if (sample_current)  { sample_enter(name, line); open |= OBSERVED_SAMPLE; }
+    return open;
+}
+
+static void observe_end(int open) {
+    if (open & OBSERVED_PROFILE) { profile_exit(); }
+    if (open & OBSERVED_SAMPLE)  { sample_exit(); }
+}
+
+static struct lval* call_builtin(struct lenv* e, lbuiltin builtin, struct lval* a, const char* name, int line) {
+    if (!profile_current && !sample_current) { return builtin(e, a); }
+    int open = observe_begin(name ? name : builtin_name(builtin), line);
+    struct lval* r = builtin(e, a);
+    observe_end(open);
+    return r;
+}
+
+// Evaluates the S-Expression v in e, or with f set, applies f to the
+// arguments in v. Calls in tail position do not nest: the body of a
+// lambda, the chosen branch of if and the argument of eval replace v,
+// and the loop goes round again, as does a tail call that a compiled
+// lambda hands back from vm_call.
+//
+// Once inside a body the loop owns its env e, through frame (the
+// lambda) or owned (a VM frame's env), and drops it on the next tail
+// call.
+static struct lval* lval_eval_tail(struct lenv* e, struct lval* v, struct lval* f) {
+    struct lval* frame = NULL;
+    struct lenv* owned = NULL;
+    struct lval* r;
+    const char* name = NULL;
+    int line = 0;
+    int open = 0;
+
+    if (f) { goto apply; }
+
+    for (;;) {
+        // A lone S-Expression's value is that of its cell.
+        if (v->count == 1 && lval_type_of(v->cell[0]) == LVAL_SEXPR) {
+            struct lval* x = lval_copy(v->cell[0]);
+            lval_del(v);
+            v = x;
+            continue;
+        }
+
+        if (profile_current || sample_current) {
+            name = v->count && lval_type_of(v->cell[0]) == LVAL_SYM ? v->cell[0]->sym : NULL;
+            line = v->line;
+        }
+        v = lval_unshare(v);
+        for (int i = 0; i < v->count; i++) {
+            // Ownership of the cell passes to lval_eval, so don't leave a
+            // stale pointer behind for the collector to follow meanwhile.
+            struct lval* x = v->cell[i];
+            v->cell[i] = NULL;
+            v->cell[i] = lval_eval(e, x);
+        }
+
+        int err = -1;
+        for (int i = 0; i < v->count && err < 0; i++) {
+            if (lval_type_of(v->cell[i]) == LVAL_ERR) { err = i; }
+        }
+        if (err >= 0)      { r = lval_take(v, err); break; }
+        if (v->count == 0) { r = v; break; }
+        if (v->count == 1) { r = lval_take(v, 0); break; }
+
+        f = lval_pop(v, 0);
+        if (lval_type_of(f) != LVAL_FUN) {
+            r = lval_err(
+                "S-Expression starts with incorrect type. "
+                "Got %s, Expected %s.",
+                ltype_name(lval_type_of(f)), ltype_name(LVAL_FUN));
+            lval_del(f); lval_del(v);
+            break;
+        }
+
+    apply: // v now contains only arguments
+        gc_maybe_collect();
+
+        if (f->builtin == builtin_if || f->builtin == builtin_eval) {
+            if (profile_current) {
+                // The branch, or the expression, is evaluated as part
+                // of the caller.
+                profile_enter(name ? name : builtin_name(f->builtin));
+                profile_exit();
+            }
+            v = f->builtin == builtin_if ? if_branch(v) : eval_expr(v);
+            lval_del(f);
+            if (lval_type_of(v) == LVAL_ERR) { r = v; break; }
+            continue;
+        }
+        if (f->builtin) {
+            lbuiltin builtin = f->builtin;
+            lval_del(f);
+            r = call_builtin(e, builtin, v, name, line);
+            break;
+        }
+
+        // A tail call ends the call it replaces.
+        if (open || profile_current || sample_current) {
+            observe_end(open);
+            open = observe_begin(name ? name : "<lambda>", line);
+        }
+
+        struct lenv* next;
+        int handed = vm_can_call(e, f, v->count);
+        if (handed) {
+            struct vm_tail t;
+            r = vm_call(e, f, v, &t);
+            if (r) { break; }
+            // The lambda ended in a call for us to make, in its env.
+            next = t.env;
+            f = t.f;
+            v = t.v;
+            name = NULL;
+            line = 0;
+        } else {
+            f = lval_bind(e, f, v);
+            if (lval_type_of(f) == LVAL_ERR || f->formals->count) { r = f; break; }
+            next = f->env;
+        }
+
+        next->par = lenv_root(e);
+        if (frame) { lval_del(frame); } else if (owned) { lenv_del(owned); }
+        e = next;
+
+        if (handed) {
+            frame = NULL;
+            owned = next;
+            goto apply;
+        }
+        frame = f;
+        owned = NULL;
+        v = lval_unshare(lval_copy(f->body));
+        v->type = LVAL_SEXPR;
     }
-    for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+
+    if (frame) { lval_del(frame); } else if (owned) { lenv_del(owned); }
+    observe_end(open);
+    return r;
+}
+
+// Consumes both f and a.
+struct lval* lval_call(struct lenv* e, struct lval* f, struct lval* a) {
+    if (f->builtin) {
+        lbuiltin builtin = f->builtin;
+        lval_del(f);
+        return call_builtin(e, builtin, a, NULL, 0);
     }
+    return lval_eval_tail(e, a, f);
+}
 
-    if (v->count == 0) { return v; }
-    if (v->count == 1) { return lval_take(v, 0); }
+// Whether the symbol sym occurs anywhere in x.
+static int lval_mentions(struct lval* x, char* sym) {
+    switch (lval_type_of(x)) {
+        case LVAL_SYM: return x->sym == sym;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < x->count; i++) {
+                if (lval_mentions(x->cell[i], sym)) { return 1; }
+            }
+            return 0;
+        default: return 0;
+    }
+}
 
-    struct lval* f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
-        struct lval* err = lval_err(
-            "S-Expression starts with incorrect type. "
-            "Got %s, Expected %s.",
-            ltype_name(f->type), ltype_name(LVAL_FUN));
-        lval_del(f); lval_del(v);
-        return err;
+// Whether v is the value of one of e's own variables, as opposed to
+// having been written where it is used.
+static int lenv_holds(struct lenv* e, struct lval* v) {
+    for (int i = 0; i < e->cap; i++) {
+        if (e->syms[i] && e->vals[i] == v) { return 1; }
     }
+    return 0;
+}
 
-    struct lval* result = lval_call(e, f, v); // v now contains only arguments
-    lval_del(f);
-    return result;
+// Copies into the env of the new lambda f the local variables of e
+// that its body mentions, other than its formals. Nested bodies count
+// too, since the lambdas they make capture from f's env in turn. A body
+// passed in through a local, such as the b of
+// (def {fun} (\\ {f b} {def (head f) (\\ (tail f) b)})), was written
+// elsewhere, so its names aren't e's, and nothing is captured.
+static void lval_capture(struct lval* f, struct lenv* e, int body_local) {
+    if (!e->par || body_local) { return; } // globals are looked up, not captured
+    for (int i = 0; i < e->cap; i++) {
+        char* sym = e->syms[i];
+        if (!sym || lval_mentions(f->formals, sym) || !lval_mentions(f->body, sym)) { continue; }
+        struct lval* k = lval_sym(sym);
+        lenv_put(f->env, k, e->vals[i]);
+        lval_del(k);
+    }
 }
 
-struct lval* lval_call(struct lenv* e, struct lval* f, struct lval* a) {
-    if (f->builtin) { return f->builtin(e, a); }
+// Binds the arguments a to the formals of the lambda f. Returns f with
+// no formals left when it is ready to evaluate, the partially applied
+// function while some remain, or an error. Consumes both f and a.
+static struct lval* lval_bind(struct lenv* e, struct lval* f, struct lval* a) {
+    // Binding mutates formals and env, so work on a private copy of f.
+    f = lval_unshare(f);
+    f->formals = lval_unshare(f->formals);
 
     int given = a->count;
     int total = f->formals->count;
 
     while (a->count) {
         if (f->formals->count == 0) {
-            lval_del(a);
+            lval_del(a); lval_del(f);
             return lval_err("Function passed too many arguments. "
                             "Got %i, Expected %i.", given, total);
         }
@@ -82,7 +278,7 @@ struct lval* lval_call(struct lenv* e, struct lval* f, struct lval* a) {
 
         if (strcmp(sym->sym, "&") == 0) {
             if (f->formals->count != 1) {
-                lval_del(a); lval_del(sym); lval_del(f->formals);
+                lval_del(a); lval_del(sym); lval_del(f);
                 return lval_err("Function format invalid. "
                                 "Symbol '&' not followed by single symbol.");
             }
@@ -102,22 +298,17 @@ struct lval* lval_call(struct lenv* e, struct lval* f, struct lval* a) {
     if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0) {
         // Varargs symbol present, but no more arguments were given. Bind to empty list.
         if (f->formals->count != 2) { // Should be '&' and one symbol name
-             lval_del(f->formals);
+             lval_del(f);
              return lval_err("Function format invalid. Symbol '&' not followed by single symbol for varargs.");
         }
         lval_del(lval_pop(f->formals, 0)); // Pop '&'
         struct lval* sym = lval_pop(f->formals, 0);
-        lenv_put(f->env, sym, lval_qexpr()); // Bind to empty qexpr
-        lval_del(sym);
+        struct lval* empty = lval_qexpr();
+        lenv_put(f->env, sym, empty); // Bind to empty qexpr
+        lval_del(sym); lval_del(empty);
     }
 
-
-    if (f->formals->count == 0) {
-        f->env->par = e; // Set parent env for evaluation context
-        return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-    } else {
-        return lval_copy(f); // Return partially applied function (or error if not all args bound)
-    }
+    return f;
 }
 
 struct lval* builtin_op(struct lenv* e, struct lval* a, char* op) {
@@ -125,35 +316,38 @@ struct lval* builtin_op(struct lenv* e, struct lval* a, char* op) {
         LASSERT_TYPE(op, a, i, LVAL_NUM);
     }
 
-    struct lval* x = lval_pop(a, 0);
+    struct lval* first = lval_pop(a, 0);
+    long x = lval_num_of(first);
+    lval_del(first);
 
     if ((strcmp(op, "-") == 0) && a->count == 0) {
-        x->num = -x->num;
+        x = -x;
     }
 
     while (a->count > 0) {
         struct lval* y = lval_pop(a, 0);
-        if (strcmp(op, "+") == 0) { x->num += y->num; }
-        if (strcmp(op, "-") == 0) { x->num -= y->num; }
-        if (strcmp(op, "*") == 0) { x->num *= y->num; }
+        long n = lval_num_of(y);
+        lval_del(y);
+        if (strcmp(op, "+") == 0) { x += n; }
+        if (strcmp(op, "-") == 0) { x -= n; }
+        if (strcmp(op, "*") == 0) { x *= n; }
         if (strcmp(op, "/") == 0) {
-            if (y->num == 0) {
-                lval_del(x); lval_del(y);
-                x = lval_err("Division By Zero."); break;
+            if (n == 0) {
+                lval_del(a);
+                return lval_err("Division By Zero.");
             }
-            x->num /= y->num;
+            x /= n;
         }
         if (strcmp(op, "%") == 0) {
-            if (y->num == 0) {
-                lval_del(x); lval_del(y);
-                x = lval_err("Division By Zero (Modulo)."); break;
+            if (n == 0) {
+                lval_del(a);
+                return lval_err("Division By Zero (Modulo).");
             }
-            x->num %= y->num;
+            x %= n;
         }
-        lval_del(y);
     }
     lval_del(a);
-    return x;
+    return lval_num(x);
 }
 
 struct lval* builtin_add(struct lenv* e, struct lval* a) { return builtin_op(e, a, "+"); }
@@ -169,8 +363,9 @@ struct lval* builtin_head(struct lenv* e, struct lval* a) {
     LASSERT_NOT_EMPTY("head", a, 0);
 
     struct lval* v = lval_take(a, 0);
-    while (v->count > 1) { lval_del(lval_pop(v, 1)); }
-    return v;
+    struct lval* x = lval_add(lval_qexpr(), lval_copy(v->cell[0]));
+    lval_del(v);
+    return x;
 }
 
 struct lval* builtin_tail(struct lenv* e, struct lval* a) {
@@ -179,8 +374,7 @@ struct lval* builtin_tail(struct lenv* e, struct lval* a) {
     LASSERT_NOT_EMPTY("tail", a, 0);
 
     struct lval* v = lval_take(a, 0);
-    lval_del(lval_pop(v, 0));
-    return v;
+    return lval_slice(v, 1, v->count - 1);
 }
 
 struct lval* builtin_list(struct lenv* e, struct lval* a) {
@@ -188,21 +382,20 @@ struct lval* builtin_list(struct lenv* e, struct lval* a) {
     return a;
 }
 
-struct lval* builtin_eval(struct lenv* e, struct lval* a) {
+// The S-Expression that eval evaluates, or an error.
+static struct lval* eval_expr(struct lval* a) {
     LASSERT_NUM_ARGS("eval", a, 1);
     LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
 
-    struct lval* x = lval_take(a, 0);
+    struct lval* x = lval_unshare(lval_take(a, 0));
     x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
+    return x;
 }
 
-struct lval* lval_join_qexpr(struct lval* x, struct lval* y) {
-    while (y->count) {
-        x = lval_add(x, lval_pop(y, 0));
-    }
-    lval_del(y);
-    return x;
+struct lval* builtin_eval(struct lenv* e, struct lval* a) {
+    struct lval* x = eval_expr(a);
+    if (lval_type_of(x) == LVAL_ERR) { return x; }
+    return lval_eval(e, x);
 }
 
 struct lval* builtin_join(struct lenv* e, struct lval* a) {
@@ -211,7 +404,7 @@ struct lval* builtin_join(struct lenv* e, struct lval* a) {
     }
     struct lval* x = lval_pop(a, 0);
     while (a->count) {
-        x = lval_join_qexpr(x, lval_pop(a, 0));
+        x = lval_join(x, lval_pop(a, 0));
     }
     lval_del(a);
     return x;
@@ -225,14 +418,7 @@ struct lval* builtin_cons(struct lenv* e, struct lval* a) {
     struct lval* q = lval_pop(a, 0);
     lval_del(a);
 
-    struct lval* res = lval_qexpr();
-    res = lval_add(res, x);
-
-    while (q->count) {
-        res = lval_add(res, lval_pop(q, 0));
-    }
-    lval_del(q);
-    return res;
+    return lval_cons(x, q);
 }
 
 struct lval* builtin_len(struct lenv* e, struct lval* a) {
@@ -250,18 +436,343 @@ struct lval* builtin_init(struct lenv* e, struct lval* a) {
     LASSERT_NOT_EMPTY("init", a, 0);
 
     struct lval* v = lval_take(a, 0);
-    lval_del(lval_pop(v, v->count - 1));
+    return lval_slice(v, 0, v->count - 1);
+}
+
+struct lval* builtin_nth(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("nth", a, 2);
+    LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+    LASSERT_TYPE("nth", a, 1, LVAL_QEXPR);
+
+    long n = lval_num_of(a->cell[0]);
+    struct lval* q = a->cell[1];
+    LASSERT(a, n >= 0 && n < q->count,
+        "Function 'nth' passed index %li out of range for list of length %i.", n, q->count);
+
+    struct lval* x = lval_copy(q->cell[n]);
+    lval_del(a);
+    return x;
+}
+
+struct lval* builtin_slice(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("slice", a, 3);
+    LASSERT_TYPE("slice", a, 0, LVAL_NUM);
+    LASSERT_TYPE("slice", a, 1, LVAL_NUM);
+    LASSERT_TYPE("slice", a, 2, LVAL_QEXPR);
+
+    long start = lval_num_of(a->cell[0]);
+    long end = lval_num_of(a->cell[1]);
+    int count = a->cell[2]->count;
+    LASSERT(a, start >= 0 && start <= end && end <= count,
+        "Function 'slice' passed range %li..%li out of range for list of length %i.",
+        start, end, count);
+
+    struct lval* v = lval_take(a, 2);
+    return lval_slice(v, start, end - start);
+}
+
+struct lval* builtin_assoc_at(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("assoc-at", a, 3);
+    LASSERT_TYPE("assoc-at", a, 0, LVAL_NUM);
+    LASSERT_TYPE("assoc-at", a, 2, LVAL_QEXPR);
+
+    long n = lval_num_of(a->cell[0]);
+    int count = a->cell[2]->count;
+    LASSERT(a, n >= 0 && n < count,
+        "Function 'assoc-at' passed index %li out of range for list of length %i.", n, count);
+
+    struct lval* q = lval_unshare(lval_pop(a, 2));
+    struct lval* x = lval_pop(a, 1);
+    lval_del(a);
+
+    lval_del(q->cell[n]);
+    q->cell[n] = x;
+    return q;
+}
+
+// (vec 1 2 3) or (vec {1 2 3}).
+struct lval* builtin_vec(struct lenv* e, struct lval* a) {
+    struct lval* src = a;
+    if (a->count == 1 && lval_type_of(a->cell[0]) == LVAL_QEXPR) { src = a->cell[0]; }
+    for (int i = 0; i < src->count; i++) {
+        LASSERT(a, lval_type_of(src->cell[i]) == LVAL_NUM,
+            "Function 'vec' passed incorrect type for element %i. Got %s, Expected %s.",
+            i, ltype_name(lval_type_of(src->cell[i])), ltype_name(LVAL_NUM));
+    }
+
+    struct lval* v = lval_vec(src->count);
+    for (int i = 0; i < src->count; i++) { v->data[i] = lval_num_of(src->cell[i]); }
+    lval_del(a);
+    return v;
+}
+
+// (vec-range n) is [0 1 ... n-1].
+struct lval* builtin_vec_range(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("vec-range", a, 1);
+    LASSERT_TYPE("vec-range", a, 0, LVAL_NUM);
+    long n = lval_num_of(a->cell[0]);
+    LASSERT(a, n >= 0, "Function 'vec-range' passed negative length %li.", n);
+
+    struct lval* v = lval_vec(n);
+    for (long i = 0; i < n; i++) { v->data[i] = i; }
+    lval_del(a);
+    return v;
+}
+
+struct lval* builtin_vec_list(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("vec-list", a, 1);
+    LASSERT_TYPE("vec-list", a, 0, LVAL_VEC);
+
+    struct lval* v = a->cell[0];
+    struct lval* q = lval_qexpr();
+    for (long i = 0; i < v->len; i++) { lval_add(q, lval_num(v->data[i])); }
+    lval_del(a);
+    return q;
+}
+
+struct lval* builtin_vec_len(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("vec-len", a, 1);
+    LASSERT_TYPE("vec-len", a, 0, LVAL_VEC);
+    long n = a->cell[0]->len;
+    lval_del(a);
+    return lval_num(n);
+}
+
+struct lval* builtin_vec_sum(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("vec-sum", a, 1);
+    LASSERT_TYPE("vec-sum", a, 0, LVAL_VEC);
+    struct lval* v = a->cell[0];
+    long s = vec_kernels()->sum(v->data, v->len);
+    lval_del(a);
+    return lval_num(s);
+}
+
+struct lval* builtin_vec_dot(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("vec-dot", a, 2);
+    LASSERT_TYPE("vec-dot", a, 0, LVAL_VEC);
+    LASSERT_TYPE("vec-dot", a, 1, LVAL_VEC);
+    struct lval* x = a->cell[0];
+    struct lval* y = a->cell[1];
+    LASSERT(a, x->len == y->len,
+        "Function 'vec-dot' passed vectors of different lengths %li and %li.", x->len, y->len);
+
+    long s = vec_kernels()->dot(x->data, y->data, x->len);
+    lval_del(a);
+    return lval_num(s);
+}
+
+struct lval* builtin_vec_extreme(struct lenv* e, struct lval* a, char* func) {
+    LASSERT_NUM_ARGS(func, a, 1);
+    LASSERT_TYPE(func, a, 0, LVAL_VEC);
+    struct lval* v = a->cell[0];
+    LASSERT(a, v->len != 0, "Function '%s' passed [] for argument 0.", func);
+
+    const struct vec_kernels* k = vec_kernels();
+    long m = strcmp(func, "vec-min") == 0 ? k->min(v->data, v->len) : k->max(v->data, v->len);
+    lval_del(a);
+    return lval_num(m);
+}
+
+struct lval* builtin_vec_min(struct lenv* e, struct lval* a) { return builtin_vec_extreme(e, a, "vec-min"); }
+struct lval* builtin_vec_max(struct lenv* e, struct lval* a) { return builtin_vec_extreme(e, a, "vec-max"); }
+
+// Adds k to every element. The vector is updated in place when nothing
+// else holds it.
+struct lval* builtin_vec_map_add(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("vec-map-add", a, 2);
+    LASSERT_TYPE("vec-map-add", a, 0, LVAL_VEC);
+    LASSERT_TYPE("vec-map-add", a, 1, LVAL_NUM);
+
+    long k = lval_num_of(a->cell[1]);
+    struct lval* v = lval_unshare(lval_take(a, 0));
+    vec_kernels()->add(v->data, v->data, k, v->len);
+    return v;
+}
+
+struct lval* builtin_vec_filter_gt(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("vec-filter-gt", a, 2);
+    LASSERT_TYPE("vec-filter-gt", a, 0, LVAL_VEC);
+    LASSERT_TYPE("vec-filter-gt", a, 1, LVAL_NUM);
+
+    struct lval* x = a->cell[0];
+    struct lval* v = lval_vec(x->len);
+    long m = vec_kernels()->filter_gt(v->data, x->data, lval_num_of(a->cell[1]), x->len);
+    if (m != v->len) {
+        v->data = pool_realloc(v->data, sizeof(int64_t) * v->len, sizeof(int64_t) * m);
+        v->len = m;
+    }
+    lval_del(a);
     return v;
 }
 
+struct lval* builtin_str_len(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("str-len", a, 1);
+    LASSERT_TYPE("str-len", a, 0, LVAL_STR);
+
+    long n = a->cell[0]->slen;
+    lval_del(a);
+    return lval_num(n);
+}
+
+// (substr start end s): the bytes of s from start up to end, sharing
+// s's storage. The indexes come first, as for slice.
+struct lval* builtin_substr(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("substr", a, 3);
+    LASSERT_TYPE("substr", a, 0, LVAL_NUM);
+    LASSERT_TYPE("substr", a, 1, LVAL_NUM);
+    LASSERT_TYPE("substr", a, 2, LVAL_STR);
+
+    long start = lval_num_of(a->cell[0]);
+    long end = lval_num_of(a->cell[1]);
+    long n = a->cell[2]->slen;
+    LASSERT(a, start >= 0 && start <= end && end <= n,
+        "Function 'substr' passed range %li..%li out of range for string of length %li.",
+        start, end, n);
+
+    struct lval* x = lval_str_slice(a->cell[2], start, end - start);
+    lval_del(a);
+    return x;
+}
+
+// (str-find s p), or (str-find s p start): the index of the first p in
+// s at or after start, or -1.
+struct lval* builtin_str_find(struct lenv* e, struct lval* a) {
+    LASSERT(a, a->count == 2 || a->count == 3,
+        "Function 'str-find' passed incorrect number of arguments. Got %i, Expected 2 or 3.", a->count);
+    LASSERT_TYPE("str-find", a, 0, LVAL_STR);
+    LASSERT_TYPE("str-find", a, 1, LVAL_STR);
+    if (a->count == 3) { LASSERT_TYPE("str-find", a, 2, LVAL_NUM); }
+
+    struct lval* s = a->cell[0];
+    struct lval* p = a->cell[1];
+    long start = a->count == 3 ? lval_num_of(a->cell[2]) : 0;
+    LASSERT(a, start >= 0 && start <= s->slen,
+        "Function 'str-find' passed start %li out of range for string of length %li.", start, s->slen);
+
+    long i = start;
+    if (p->slen) {
+        i = str_kernels()->find(s->str + start, s->slen - start, p->str, p->slen);
+        if (i >= 0) { i += start; }
+    }
+    lval_del(a);
+    return lval_num(i);
+}
+
+// (str-split s sep): the pieces of s between the occurrences of sep, as
+// slices of s.
+struct lval* builtin_str_split(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("str-split", a, 2);
+    LASSERT_TYPE("str-split", a, 0, LVAL_STR);
+    LASSERT_TYPE("str-split", a, 1, LVAL_STR);
+    LASSERT(a, a->cell[1]->slen, "Function 'str-split' passed an empty separator.");
+
+    struct lval* s = a->cell[0];
+    struct lval* sep = a->cell[1];
+    const struct str_kernels* k = str_kernels();
+    struct lval* x = lval_qexpr();
+    long at[256];
+    long i = 0;
+    for (long n = 256; n == 256; ) {
+        n = k->find_all(s->str + i, s->slen - i, sep->str, sep->slen, at, 256);
+        long base = i;
+        for (long j = 0; j < n; j++) {
+            lval_add(x, lval_str_slice(s, i, base + at[j] - i));
+            i = base + at[j] + sep->slen;
+        }
+    }
+    lval_add(x, lval_str_slice(s, i, s->slen - i));
+    lval_del(a);
+    return x;
+}
+
+// Concatenates the n strings at xs, with sep between them.
+static struct lval* str_join(struct lval** xs, int n, struct lval* sep) {
+    long len = sep && n ? sep->slen * (n - 1) : 0;
+    for (int i = 0; i < n; i++) { len += xs[i]->slen; }
+
+    struct lval* x = lval_str_n(NULL, len);
+    char* p = x->str;
+    for (int i = 0; i < n; i++) {
+        if (i && sep) {
+            memcpy(p, sep->str, sep->slen);
+            p += sep->slen;
+        }
+        memcpy(p, xs[i]->str, xs[i]->slen);
+        p += xs[i]->slen;
+    }
+    return x;
+}
+
+// (str-join {strs} sep)
+struct lval* builtin_str_join(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("str-join", a, 2);
+    LASSERT_TYPE("str-join", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("str-join", a, 1, LVAL_STR);
+
+    struct lval* q = a->cell[0];
+    for (int i = 0; i < q->count; i++) {
+        LASSERT(a, lval_type_of(q->cell[i]) == LVAL_STR,
+            "Function 'str-join' passed a list with a %s in it, Expected only Strings.",
+            ltype_name(lval_type_of(q->cell[i])));
+    }
+
+    struct lval* x = str_join(q->cell, q->count, a->cell[1]);
+    lval_del(a);
+    return x;
+}
+
+struct lval* builtin_str_concat(struct lenv* e, struct lval* a) {
+    for (int i = 0; i < a->count; i++) { LASSERT_TYPE("str-concat", a, i, LVAL_STR); }
+
+    struct lval* x = str_join(a->cell, a->count, NULL);
+    lval_del(a);
+    return x;
+}
+
+// (str->num s): s, which must be a decimal integer, as a number.
+struct lval* builtin_str_to_num(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("str->num", a, 1);
+    LASSERT_TYPE("str->num", a, 0, LVAL_STR);
+
+    struct lval* s = a->cell[0];
+    long i = s->slen && (s->str[0] == '-' || s->str[0] == '+') ? 1 : 0;
+    int neg = i && s->str[0] == '-';
+    unsigned long limit = neg ? -(unsigned long)LONG_MIN : LONG_MAX;
+    unsigned long x = 0;
+    int ok = i < s->slen;
+    for (; i < s->slen && ok; i++) {
+        unsigned d = (unsigned char)s->str[i] - '0';
+        ok = d <= 9 && x <= (limit - d) / 10;
+        x = x * 10 + d;
+    }
+    if (!ok) {
+        s = lval_str_owned(lval_take(a, 0));
+        struct lval* err = lval_err("Function 'str->num' passed \"%s\", which is not a number in range.", s->str);
+        lval_del(s);
+        return err;
+    }
+    lval_del(a);
+    return lval_num(neg ? (long)-x : (long)x);
+}
+
+struct lval* builtin_num_to_str(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("num->str", a, 1);
+    LASSERT_TYPE("num->str", a, 0, LVAL_NUM);
+
+    char buf[24];
+    int n = snprintf(buf, sizeof(buf), "%li", lval_num_of(a->cell[0]));
+    lval_del(a);
+    return lval_str_n(buf, n);
+}
+
 struct lval* builtin_var(struct lenv* e, struct lval* a, char* func) {
     LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
 
     struct lval* syms = a->cell[0];
     for (int i = 0; i < syms->count; i++) {
-        LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+        LASSERT(a, (lval_type_of(syms->cell[i]) == LVAL_SYM),
             "Function \'%s\' cannot define non-symbol. Got %s, Expected %s.", 
-            func, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+            func, ltype_name(lval_type_of(syms->cell[i])), ltype_name(LVAL_SYM));
     }
 
     LASSERT(a, (syms->count == a->count - 1),
@@ -286,16 +797,25 @@ struct lval* builtin_lambda(struct lenv* e, struct lval* a) {
     LASSERT_TYPE("\\\\", a, 1, LVAL_QEXPR);
 
     for (int i = 0; i < a->cell[0]->count; i++) {
-        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+        LASSERT(a, (lval_type_of(a->cell[0]->cell[i]) == LVAL_SYM),
             "Cannot define non-symbol. Got %s, Expected %s.",
-            ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+            ltype_name(lval_type_of(a->cell[0]->cell[i])), ltype_name(LVAL_SYM));
     }
 
     struct lval* formals = lval_pop(a, 0);
     struct lval* body = lval_pop(a, 0);
     lval_del(a);
+    int body_local = e->par && lenv_holds(e, body);
 
-    return lval_lambda(formals, body);
+    if (vm_enabled) {
+        // The bytecode is cached on the body, so give the lambda its own.
+        body = lval_unshare(body);
+    }
+
+    struct lval* f = lval_lambda(formals, body);
+    lval_capture(f, e, body_local);
+    if (vm_enabled) { body->code = vm_compile(formals, body, f->env); }
+    return f;
 }
 
 struct lval* builtin_ord(struct lenv* e, struct lval* a, char* op) {
@@ -304,8 +824,8 @@ struct lval* builtin_ord(struct lenv* e, struct lval* a, char* op) {
     LASSERT_TYPE(op, a, 1, LVAL_NUM);
 
     int r;
-    long n1 = a->cell[0]->num;
-    long n2 = a->cell[1]->num;
+    long n1 = lval_num_of(a->cell[0]);
+    long n2 = lval_num_of(a->cell[1]);
     lval_del(a);
 
     if (strcmp(op, ">") == 0)  { r = (n1 > n2);  }
@@ -322,16 +842,31 @@ struct lval* builtin_lt(struct lenv* e, struct lval* a) { return builtin_ord(e,
 struct lval* builtin_ge(struct lenv* e, struct lval* a) { return builtin_ord(e, a, ">="); }
 struct lval* builtin_le(struct lenv* e, struct lval* a) { return builtin_ord(e, a, "<="); }
 
+// Whether two lambdas' envs, which hold what they captured and the
+// arguments bound so far, bind the same names to equal values.
+static int lenv_eq(struct lenv* x, struct lenv* y) {
+    if (x->count != y->count) { return 0; }
+    for (int i = 0; i < x->cap; i++) {
+        if (!x->syms[i]) { continue; }
+        struct lval* v = lenv_find(y, x->syms[i]);
+        if (!v || !lval_eq(x->vals[i], v)) { return 0; }
+    }
+    return 1;
+}
+
 int lval_eq(struct lval* x, struct lval* y) {
-    if (x->type != y->type) { return 0; }
-    switch (x->type) {
-        case LVAL_NUM: return (x->num == y->num);
+    if (lval_type_of(x) != lval_type_of(y)) { return 0; }
+    switch (lval_type_of(x)) {
+        case LVAL_NUM: return (lval_num_of(x) == lval_num_of(y));
         case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-        case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
-        case LVAL_STR: return (strcmp(x->str, y->str) == 0);
+        case LVAL_SYM: return (x->sym == y->sym);
+        case LVAL_STR: return x->slen == y->slen && memcmp(x->str, y->str, x->slen) == 0;
         case LVAL_FUN:
             if (x->builtin || y->builtin) { return x->builtin == y->builtin; }
-            else { return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body); }
+            // Closures and partial applications of one lambda differ
+            // only in their envs.
+            return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body)
+                && lenv_eq(x->env, y->env);
         case LVAL_QEXPR:
         case LVAL_SEXPR:
             if (x->count != y->count) { return 0; }
@@ -339,11 +874,83 @@ int lval_eq(struct lval* x, struct lval* y) {
                 if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
             }
             return 1;
-        break;
+        case LVAL_VEC:
+            return x->len == y->len
+                && (x->len == 0 || memcmp(x->data, y->data, sizeof(int64_t) * x->len) == 0);
+        case LVAL_MAP:
+            if (x->nkeys != y->nkeys) { return 0; }
+            for (int i = 0; i < x->nentries; i++) {
+                struct map_entry* p = &map_entries(x)[i];
+                if (!p->key) { continue; }
+                struct lval* q = map_get(y, p->key);
+                if (!q || !lval_eq(p->val, q)) { return 0; }
+            }
+            return 1;
+        case LVAL_MEMO: return x == y;
+        case LVAL_BUF: case LVAL_TABLE: break;
     }
     return 0;
 }
 
+static unsigned long hash_mix(unsigned long h, unsigned long x) {
+    h ^= x + 0x9e3779b97f4a7c15UL + (h << 6) + (h >> 2);
+    return h;
+}
+
+static unsigned long hash_bytes(unsigned long h, const void* p, size_t n) {
+    const unsigned char* s = p;
+    for (size_t i = 0; i < n; i++) { h = (h ^ s[i]) * 1099511628211UL; }
+    return h;
+}
+
+// A hash of x's structure: values that lval_eq finds equal hash alike.
+unsigned long lval_hash(struct lval* x) {
+    lval_type t = lval_type_of(x);
+    unsigned long h = hash_mix(14695981039346656037UL, t);
+    switch (t) {
+        case LVAL_NUM: {
+            unsigned long n = lval_num_of(x);
+            n ^= n >> 33;
+            n *= 0xff51afd7ed558ccdUL;
+            n ^= n >> 33;
+            return hash_mix(h, n);
+        }
+        case LVAL_ERR: return hash_bytes(h, x->err, strlen(x->err));
+        case LVAL_SYM: return hash_mix(h, (uintptr_t)x->sym);
+        case LVAL_STR: return hash_bytes(h, x->str, x->slen);
+        case LVAL_FUN: {
+            if (x->builtin) { return hash_mix(h, (uintptr_t)x->builtin); }
+            h = hash_mix(hash_mix(h, lval_hash(x->formals)), lval_hash(x->body));
+            // As for maps, the env's bindings may be in any order.
+            unsigned long sum = 0;
+            for (int i = 0; i < x->env->cap; i++) {
+                char* sym = x->env->syms[i];
+                if (sym) { sum += hash_mix((uintptr_t)sym, lval_hash(x->env->vals[i])); }
+            }
+            return hash_mix(h, sum);
+        }
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            h = hash_mix(h, x->count);
+            for (int i = 0; i < x->count; i++) { h = hash_mix(h, lval_hash(x->cell[i])); }
+            return h;
+        case LVAL_VEC:
+            return x->len ? hash_bytes(h, x->data, sizeof(int64_t) * x->len) : h;
+        case LVAL_MAP: {
+            // Equal maps may hold their entries in any order.
+            unsigned long sum = 0;
+            for (int i = 0; i < x->nentries; i++) {
+                struct map_entry* p = &map_entries(x)[i];
+                if (p->key) { sum += hash_mix(p->hash, lval_hash(p->val)); }
+            }
+            return hash_mix(h, sum);
+        }
+        case LVAL_MEMO: return hash_mix(h, (uintptr_t)x);
+        case LVAL_BUF: case LVAL_TABLE: break;
+    }
+    return h;
+}
+
 struct lval* builtin_cmp(struct lenv* e, struct lval* a, char* op) {
     LASSERT_NUM_ARGS(op, a, 2);
     int r;
@@ -357,111 +964,308 @@ struct lval* builtin_cmp(struct lenv* e, struct lval* a, char* op) {
 struct lval* builtin_eq(struct lenv* e, struct lval* a) { return builtin_cmp(e, a, "=="); }
 struct lval* builtin_ne(struct lenv* e, struct lval* a) { return builtin_cmp(e, a, "!="); }
 
-struct lval* builtin_if(struct lenv* e, struct lval* a) {
+// The branch of if to evaluate, as an S-Expression, or an error.
+static struct lval* if_branch(struct lval* a) {
     LASSERT_NUM_ARGS("if", a, 3);
     LASSERT_TYPE("if", a, 0, LVAL_NUM);
     LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
     LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
 
-    struct lval* cond_val = lval_pop(a, 0);
-    struct lval* true_branch = lval_pop(a, 0);
-    struct lval* false_branch = lval_pop(a, 0);
-    lval_del(a);
+    struct lval* x = lval_take(a, lval_num_of(a->cell[0]) ? 1 : 2);
+    x = lval_unshare(x);
+    x->type = LVAL_SEXPR;
+    return x;
+}
 
-    struct lval* result;
-    true_branch->type = LVAL_SEXPR;
-    false_branch->type = LVAL_SEXPR;
+struct lval* builtin_if(struct lenv* e, struct lval* a) {
+    struct lval* x = if_branch(a);
+    if (lval_type_of(x) == LVAL_ERR) { return x; }
+    return lval_eval(e, x);
+}
 
-    if (cond_val->num) {
-        result = lval_eval(e, true_branch);
-        lval_del(false_branch);
-    } else {
-        result = lval_eval(e, false_branch);
-        lval_del(true_branch);
+struct lval* builtin_pmap(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("pmap", a, 2);
+    LASSERT_TYPE("pmap", a, 0, LVAL_FUN);
+    LASSERT_TYPE("pmap", a, 1, LVAL_QEXPR);
+
+    struct lval* f = lval_pop(a, 0);
+    return lval_pmap(e, f, lval_take(a, 0));
+}
+
+struct lval* builtin_preduce(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("preduce", a, 3);
+    LASSERT_TYPE("preduce", a, 0, LVAL_FUN);
+    LASSERT_TYPE("preduce", a, 2, LVAL_QEXPR);
+
+    struct lval* f = lval_pop(a, 0);
+    struct lval* init = lval_pop(a, 0);
+    return lval_preduce(e, f, init, lval_take(a, 0));
+}
+
+// (memoize f) or (memoize f limit): f, caching up to limit results.
+struct lval* builtin_memoize(struct lenv* e, struct lval* a) {
+    LASSERT(a, a->count == 1 || a->count == 2,
+        "Function 'memoize' passed incorrect number of arguments. Got %i, Expected 1 or 2.", a->count);
+    LASSERT_TYPE("memoize", a, 0, LVAL_FUN);
+    long limit = MEMO_DEFAULT_LIMIT;
+    if (a->count == 2) {
+        LASSERT_TYPE("memoize", a, 1, LVAL_NUM);
+        limit = lval_num_of(a->cell[1]);
+        LASSERT(a, limit > 0 && limit <= INT_MAX,
+            "Function 'memoize' needs a positive limit. Got %li.", limit);
     }
-    lval_del(cond_val);
-    return result;
+
+    struct lval* f = lval_pop(a, 0);
+    lval_del(a);
+    return lval_memoize(f, limit);
 }
 
-struct lval* builtin_load(struct lenv* e, struct lval* a) {
-    LASSERT_NUM_ARGS("load", a, 1);
-    LASSERT_TYPE("load", a, 0, LVAL_STR);
+// The body of a memoized lambda: (memo-call M args).
+struct lval* builtin_memo_call(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("memo-call", a, 2);
+    LASSERT_TYPE("memo-call", a, 0, LVAL_MEMO);
+    LASSERT_TYPE("memo-call", a, 1, LVAL_QEXPR);
 
-    // Store the first argument (filename)
-    char* filename = a->cell[0]->str;
+    struct lval* m = lval_pop(a, 0);
+    struct lval* r = memo_call(e, m->memo, lval_take(a, 0));
+    lval_del(m);
+    return r;
+}
 
-    // Parse File
-    // We need a new ast_root for this parsing instance.
-    // The global ast_root is for the REPL line.
-    struct lval* file_ast_root = lval_sexpr();
-    struct lval* expr = NULL; // To hold individual expressions from the file
+// {hits misses size limit} of a memoized function.
+struct lval* builtin_memo_stats(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("memo-stats", a, 1);
+    struct memo* m = memo_of(a->cell[0]);
+    LASSERT(a, m, "Function 'memo-stats' passed a function that memoize did not make.");
+
+    struct lval* x = lval_qexpr();
+    lval_add(x, lval_num(m->hits));
+    lval_add(x, lval_num(m->misses));
+    lval_add(x, lval_num(m->count));
+    lval_add(x, lval_num(m->limit));
+    lval_del(a);
+    return x;
+}
 
-    FILE* f = fopen(filename, "r");
-    if (!f) {
-        lval_del(a);
-        return lval_err("Could not load file '%s'", filename);
+// (map k v ...), or (map {k v ...}): a map of each key to the value
+// after it.
+struct lval* builtin_map(struct lenv* e, struct lval* a) {
+    if (a->count == 1 && lval_type_of(a->cell[0]) == LVAL_QEXPR) { a = lval_take(a, 0); }
+    LASSERT(a, a->count % 2 == 0,
+        "Function 'map' passed an odd number of keys and values. Got %i.", a->count);
+
+    struct lval* m = lval_map();
+    for (int i = 0; i < a->count; i += 2) {
+        m = map_put(m, lval_copy(a->cell[i]), lval_copy(a->cell[i + 1]));
     }
+    lval_del(a);
+    return m;
+}
 
-    // Store old yyin, set new one
-    FILE* old_yyin = yyin;
-    yyin = f;
-    
-    // Store old ast_root, set new one for this scope
-    struct lval* previous_ast_root_ptr = ast_root; // Save the REPL's ast_root pointer
-    ast_root = file_ast_root; // Point global ast_root to our local one for yyparse
+// (map-get m k), or (map-get m k default) to get default rather than an
+// error when k is not in m.
+struct lval* builtin_map_get(struct lenv* e, struct lval* a) {
+    LASSERT(a, a->count == 2 || a->count == 3,
+        "Function 'map-get' passed incorrect number of arguments. Got %i, Expected 2 or 3.", a->count);
+    LASSERT_TYPE("map-get", a, 0, LVAL_MAP);
 
-    int parse_result = yyparse(); // This will populate our local file_ast_root
+    struct lval* x = map_get(a->cell[0], a->cell[1]);
+    LASSERT(a, x || a->count == 3, "Function 'map-get' passed a key that is not in the map.");
+    x = lval_copy(x ? x : a->cell[2]);
+    lval_del(a);
+    return x;
+}
+
+struct lval* builtin_map_put(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("map-put", a, 3);
+    LASSERT_TYPE("map-put", a, 0, LVAL_MAP);
+
+    struct lval* m = lval_pop(a, 0);
+    struct lval* k = lval_pop(a, 0);
+    return map_put(m, k, lval_take(a, 0));
+}
 
-    fclose(f);
-    yyin = old_yyin; // Restore original yyin
-    ast_root = previous_ast_root_ptr; // Restore original ast_root pointer
+struct lval* builtin_map_del(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("map-del", a, 2);
+    LASSERT_TYPE("map-del", a, 0, LVAL_MAP);
 
-    lval_del(a); // Delete the argument list (filename string)
+    struct lval* m = lval_pop(a, 0);
+    m = map_del(m, a->cell[0]);
+    lval_del(a);
+    return m;
+}
 
-    if (parse_result != 0 || !file_ast_root) {
-        if(file_ast_root) lval_del(file_ast_root);
-        return lval_err("Syntax error in loaded file '%s'.", filename);
+struct lval* builtin_map_keys(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("map-keys", a, 1);
+    LASSERT_TYPE("map-keys", a, 0, LVAL_MAP);
+
+    struct lval* m = a->cell[0];
+    struct lval* x = lval_qexpr();
+    if (m->nkeys) { lval_resize(x, m->nkeys); }
+    for (int i = 0; i < m->nentries; i++) {
+        struct map_entry* p = &map_entries(m)[i];
+        if (p->key) { lval_add(x, lval_copy(p->key)); }
     }
+    lval_del(a);
+    return x;
+}
 
-    lval* result_val = lval_sexpr(); // Default to empty Sexpr if file is empty or only comments
+struct lval* builtin_map_len(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("map-len", a, 1);
+    LASSERT_TYPE("map-len", a, 0, LVAL_MAP);
 
-    // Evaluate each expression in the file
-    while (file_ast_root->count) {
-        expr = lval_pop(file_ast_root, 0);
-        lval* eval_res = lval_eval(e, expr); // expr is consumed by lval_eval
+    long n = a->cell[0]->nkeys;
+    lval_del(a);
+    return lval_num(n);
+}
 
-        if (eval_res->type == LVAL_ERR) {
-            lval_del(result_val); // clean up previous result if any
-            result_val = eval_res; // Store the error
-            break; // Stop on error
+// Evaluates each form as it is read, before reading the next, and
+// returns the last result or the first error, the reader's included.
+struct lval* load_forms(struct lenv* e, struct reader* r) {
+    struct lval* result_val = lval_sexpr(); // Default to empty Sexpr if file is empty or only comments
+
+    struct lval* expr;
+    while ((expr = reader_next(r))) {
+        lval_del(result_val);
+        if (lval_type_of(expr) == LVAL_ERR) {
+            result_val = expr;
+            break;
         }
-        lval_del(result_val); // Delete previous non-error result
-        result_val = eval_res; // Store current result
+        result_val = lval_eval(e, expr); // expr is consumed by lval_eval
+        if (lval_type_of(result_val) == LVAL_ERR) { break; } // Stop on error
     }
+    return result_val;
+}
+
+struct lval* builtin_load(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("load", a, 1);
+    LASSERT_TYPE("load", a, 0, LVAL_STR);
 
-    lval_del(file_ast_root); // Clean up the AST from the file
-    return result_val; // Return the last evaluated expression or error
+    a->cell[0] = lval_str_owned(a->cell[0]);
+    char* filename = a->cell[0]->str;
+    struct reader* r = reader_open_file(filename);
+    if (!r) {
+        struct lval* err = lval_err("Could not load file '%s'", filename);
+        lval_del(a);
+        return err;
+    }
+    lval_del(a);
+
+    struct lval* result_val = load_forms(e, r);
+    reader_close(r);
+    return result_val;
 }
 
+// Renders the whole line first, so that it reaches stdout in one piece
+// even when pmap workers print at the same time.
 struct lval* builtin_print(struct lenv* e, struct lval* a) {
+    struct outbuf b;
+    out_init(&b);
     for (int i = 0; i < a->count; i++) {
-        lval_print(a->cell[i]);
-        if (i < a->count - 1) { putchar(' '); }
+        if (i) { out_char(&b, ' '); }
+        lval_write(&b, a->cell[i]);
     }
-    putchar('\n');
+    out_char(&b, '\n');
+    out_write(b.data, b.len);
+    out_free(&b);
     lval_del(a);
     return lval_sexpr();
 }
 
+// (to-string v): v as print would show it.
+struct lval* builtin_to_string(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("to-string", a, 1);
+
+    struct outbuf b;
+    out_init(&b);
+    lval_write(&b, a->cell[0]);
+    struct lval* x = lval_str_n(b.data, b.len);
+    out_free(&b);
+    lval_del(a);
+    return x;
+}
+
 struct lval* builtin_error(struct lenv* e, struct lval* a) {
     LASSERT_NUM_ARGS("error", a, 1);
     LASSERT_TYPE("error", a, 0, LVAL_STR);
 
+    a->cell[0] = lval_str_owned(a->cell[0]);
     struct lval* err = lval_err(a->cell[0]->str);
     lval_del(a);
     return err;
 }
 
+// (gc ()) and (gc-stats ()) take a dummy argument, since a one-element
+// S-Expression evaluates to its element rather than calling it.
+struct lval* builtin_gc(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("gc", a, 1);
+    lval_del(a);
+    return lval_num(gc_collect());
+}
+
+struct lval* builtin_gc_stats(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("gc-stats", a, 1);
+    lval_del(a);
+
+    struct gc_stats s = gc_get_stats();
+    struct outbuf b;
+    out_init(&b);
+    out_printf(&b, "collections: %li\n", s.collections);
+    out_printf(&b, "allocated objects: %li\n", s.allocated);
+    out_printf(&b, "live objects: %li\n", s.live);
+    out_printf(&b, "reclaimed: %li objects, %li bytes\n", s.objects_reclaimed, s.bytes_reclaimed);
+    out_printf(&b, "pause: last %.3f ms, max %.3f ms, total %.3f ms\n",
+        s.last_pause_ms, s.max_pause_ms, s.total_pause_ms);
+    out_write(b.data, b.len);
+    out_free(&b);
+    return lval_sexpr();
+}
+
+struct lval* builtin_gc_growth(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("gc-growth", a, 1);
+    LASSERT_TYPE("gc-growth", a, 0, LVAL_NUM);
+    long percent = lval_num_of(a->cell[0]);
+    LASSERT(a, percent > 100,
+        "Function 'gc-growth' needs a percentage above 100. Got %li.", percent);
+
+    gc_set_growth(percent);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+// Evaluates the Q-Expression under a fresh profile, prints the report to
+// stderr, and returns the result. A profile already in progress, from
+// --profile or an enclosing call, is suspended meanwhile.
+struct lval* builtin_profile(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("profile", a, 1);
+    LASSERT_TYPE("profile", a, 0, LVAL_QEXPR);
+
+    struct profile* outer = profile_begin();
+    struct lval* x = eval_expr(a);
+    if (lval_type_of(x) != LVAL_ERR) { x = lval_eval(e, x); }
+    profile_end(outer, stderr);
+    return x;
+}
+
+// Evaluates the Q-Expression while sampling its Lisp stacks, writes them
+// to the file in folded form, and returns the result.
+struct lval* builtin_sample_profile(struct lenv* e, struct lval* a) {
+    LASSERT_NUM_ARGS("sample-profile", a, 2);
+    LASSERT_TYPE("sample-profile", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("sample-profile", a, 1, LVAL_STR);
+    LASSERT(a, sample_begin(), "Function 'sample-profile' called while already sampling.");
+
+    struct lval* path = lval_str_owned(lval_pop(a, 1));
+    struct lval* x = eval_expr(a);
+    if (lval_type_of(x) != LVAL_ERR) { x = lval_eval(e, x); }
+    if (!sample_end(path->str) && lval_type_of(x) != LVAL_ERR) {
+        lval_del(x);
+        x = lval_err("Could not write samples to '%s'.", path->str);
+    }
+    lval_del(path);
+    return x;
+}
+
 void lenv_add_builtin(struct lenv* e, char* name, lbuiltin func) {
     struct lval* k = lval_sym(name);
     struct lval* v = lval_builtin(func);
@@ -469,50 +1273,128 @@ void lenv_add_builtin(struct lenv* e, char* name, lbuiltin func) {
     lval_del(k); lval_del(v);
 }
 
-void lenv_add_builtins(struct lenv* e) {
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
-    lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "join", builtin_join);
-    lenv_add_builtin(e, "cons", builtin_cons);
-    lenv_add_builtin(e, "len",  builtin_len);
-    lenv_add_builtin(e, "init", builtin_init);
-
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
-    lenv_add_builtin(e, "%", builtin_mod);
-    lenv_add_builtin(e, "^", builtin_pow);
-
-    lenv_add_builtin(e, "def", builtin_def);
-    lenv_add_builtin(e, "=",   builtin_put);
-    lenv_add_builtin(e, "\\\\",  builtin_lambda);
-
-    lenv_add_builtin(e, ">",  builtin_gt);
-    lenv_add_builtin(e, "<",  builtin_lt);
-    lenv_add_builtin(e, ">=", builtin_ge);
-    lenv_add_builtin(e, "<=", builtin_le);
-    lenv_add_builtin(e, "==", builtin_eq);
-    lenv_add_builtin(e, "!=", builtin_ne);
-
-    lenv_add_builtin(e, "if", builtin_if);
-
-    lenv_add_builtin(e, "load", builtin_load);
-
-    lenv_add_builtin(e, "print", builtin_print);
-    lenv_add_builtin(e, "error", builtin_error);
+// Every builtin, under the name it is bound to globally. Heap images
+// (image.c) refer to builtins by these names.
+static const struct {
+    char* name;
+    lbuiltin func;
+} builtins[] = {
+    { "list", builtin_list },
+    { "head", builtin_head },
+    { "tail", builtin_tail },
+    { "eval", builtin_eval },
+    { "join", builtin_join },
+    { "cons", builtin_cons },
+    { "len", builtin_len },
+    { "init", builtin_init },
+    { "nth", builtin_nth },
+    { "slice", builtin_slice },
+    { "assoc-at", builtin_assoc_at },
+
+    { "vec", builtin_vec },
+    { "vec-range", builtin_vec_range },
+    { "vec-list", builtin_vec_list },
+    { "vec-len", builtin_vec_len },
+    { "vec-sum", builtin_vec_sum },
+    { "vec-dot", builtin_vec_dot },
+    { "vec-min", builtin_vec_min },
+    { "vec-max", builtin_vec_max },
+    { "vec-map-add", builtin_vec_map_add },
+    { "vec-filter-gt", builtin_vec_filter_gt },
+
+    { "str-len", builtin_str_len },
+    { "substr", builtin_substr },
+    { "str-find", builtin_str_find },
+    { "str-split", builtin_str_split },
+    { "str-join", builtin_str_join },
+    { "str-concat", builtin_str_concat },
+    { "str->num", builtin_str_to_num },
+    { "num->str", builtin_num_to_str },
+
+    { "+", builtin_add },
+    { "-", builtin_sub },
+    { "*", builtin_mul },
+    { "/", builtin_div },
+    { "%", builtin_mod },
+    { "^", builtin_pow },
+
+    { "def", builtin_def },
+    { "=", builtin_put },
+    { "\\\\", builtin_lambda },
+
+    { ">", builtin_gt },
+    { "<", builtin_lt },
+    { ">=", builtin_ge },
+    { "<=", builtin_le },
+    { "==", builtin_eq },
+    { "!=", builtin_ne },
+
+    { "if", builtin_if },
+
+    { "pmap", builtin_pmap },
+    { "preduce", builtin_preduce },
+
+    { "memoize", builtin_memoize },
+    { "memo-call", builtin_memo_call },
+    { "memo-stats", builtin_memo_stats },
+
+    { "map", builtin_map },
+    { "map-get", builtin_map_get },
+    { "map-put", builtin_map_put },
+    { "map-del", builtin_map_del },
+    { "map-keys", builtin_map_keys },
+    { "map-len", builtin_map_len },
+
+    { "load", builtin_load },
+
+    { "print", builtin_print },
+    { "to-string", builtin_to_string },
+    { "error", builtin_error },
+
+    { "gc", builtin_gc },
+    { "gc-stats", builtin_gc_stats },
+    { "gc-growth", builtin_gc_growth },
+
+    { "profile", builtin_profile },
+    { "sample-profile", builtin_sample_profile },
+};
+
+#define NBUILTINS (sizeof(builtins) / sizeof(builtins[0]))
 
+void lenv_add_builtins(struct lenv* e) {
+    for (size_t i = 0; i < NBUILTINS; i++) { lenv_add_builtin(e, builtins[i].name, builtins[i].func); }
     // `quote` is a special form handled by parser usually
 }
 
-// Helper to pop an lval from a list
+lbuiltin builtin_lookup(const char* name) {
+    for (size_t i = 0; i < NBUILTINS; i++) {
+        if (strcmp(builtins[i].name, name) == 0) { return builtins[i].func; }
+    }
+    return NULL;
+}
+
+const char* builtin_name(lbuiltin func) {
+    for (size_t i = 0; i < NBUILTINS; i++) {
+        if (builtins[i].func == func) { return builtins[i].name; }
+    }
+    return NULL;
+}
+
+// Helper to pop an lval from a list. The list must own its cells (see
+// lval_unshare).
 struct lval* lval_pop(struct lval* v, int i) {
     struct lval* x = v->cell[i];
-    memmove(&v->cell[i], &v->cell[i+1], sizeof(struct lval*) * (v->count-i-1));
+    if (i == 0) {
+        v->cell++;
+        v->buf->lo++;
+    } else {
+        memmove(&v->cell[i], &v->cell[i+1], sizeof(struct lval*) * (v->count-i-1));
+        v->buf->hi--;
+    }
     v->count--;
-    v->cell = realloc(v->cell, sizeof(struct lval*) * v->count);
+    if (v->count * 4 < v->buf->cap && v->buf->cap > 8) {
+        lval_resize(v, v->count * 2);
+    }
     return x;
 }
 
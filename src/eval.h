@@ -2,10 +2,14 @@
 #define EVAL_H
 
 #include "types.h"
+#include "reader.h"
 
 struct lval* lval_eval_sexpr(struct lenv* e, struct lval* v);
 struct lval* lval_eval(struct lenv* e, struct lval* v);
 
+struct lval* lval_pop(struct lval* v, int i);
+struct lval* lval_take(struct lval* v, int i);
+
 struct lval* builtin_op(struct lenv* e, struct lval* a, char* op);
 struct lval* builtin_add(struct lenv* e, struct lval* a);
 struct lval* builtin_sub(struct lenv* e, struct lval* a);
@@ -22,6 +26,30 @@ struct lval* builtin_join(struct lenv* e, struct lval* a);
 struct lval* builtin_cons(struct lenv* e, struct lval* a);
 struct lval* builtin_len(struct lenv* e, struct lval* a);
 struct lval* builtin_init(struct lenv* e, struct lval* a);
+struct lval* builtin_nth(struct lenv* e, struct lval* a);
+struct lval* builtin_slice(struct lenv* e, struct lval* a);
+struct lval* builtin_assoc_at(struct lenv* e, struct lval* a);
+
+struct lval* builtin_vec(struct lenv* e, struct lval* a);
+struct lval* builtin_vec_range(struct lenv* e, struct lval* a);
+struct lval* builtin_vec_list(struct lenv* e, struct lval* a);
+struct lval* builtin_vec_len(struct lenv* e, struct lval* a);
+struct lval* builtin_vec_sum(struct lenv* e, struct lval* a);
+struct lval* builtin_vec_dot(struct lenv* e, struct lval* a);
+struct lval* builtin_vec_extreme(struct lenv* e, struct lval* a, char* func);
+struct lval* builtin_vec_min(struct lenv* e, struct lval* a);
+struct lval* builtin_vec_max(struct lenv* e, struct lval* a);
+struct lval* builtin_vec_map_add(struct lenv* e, struct lval* a);
+struct lval* builtin_vec_filter_gt(struct lenv* e, struct lval* a);
+
+struct lval* builtin_str_len(struct lenv* e, struct lval* a);
+struct lval* builtin_substr(struct lenv* e, struct lval* a);
+struct lval* builtin_str_find(struct lenv* e, struct lval* a);
+struct lval* builtin_str_split(struct lenv* e, struct lval* a);
+struct lval* builtin_str_join(struct lenv* e, struct lval* a);
+struct lval* builtin_str_concat(struct lenv* e, struct lval* a);
+struct lval* builtin_str_to_num(struct lenv* e, struct lval* a);
+struct lval* builtin_num_to_str(struct lenv* e, struct lval* a);
 
 struct lval* builtin_def(struct lenv* e, struct lval* a);
 struct lval* builtin_put(struct lenv* e, struct lval* a);
@@ -31,19 +59,46 @@ struct lval* builtin_gt(struct lenv* e, struct lval* a);
 struct lval* builtin_lt(struct lenv* e, struct lval* a);
 struct lval* builtin_ge(struct lenv* e, struct lval* a);
 struct lval* builtin_le(struct lenv* e, struct lval* a);
+int lval_eq(struct lval* x, struct lval* y);
+unsigned long lval_hash(struct lval* x);
 struct lval* builtin_eq(struct lenv* e, struct lval* a);
 struct lval* builtin_ne(struct lenv* e, struct lval* a);
 
 struct lval* builtin_if(struct lenv* e, struct lval* a);
 
+struct lval* builtin_pmap(struct lenv* e, struct lval* a);
+struct lval* builtin_preduce(struct lenv* e, struct lval* a);
+
+struct lval* builtin_memoize(struct lenv* e, struct lval* a);
+struct lval* builtin_memo_call(struct lenv* e, struct lval* a);
+struct lval* builtin_memo_stats(struct lenv* e, struct lval* a);
+
+struct lval* builtin_map(struct lenv* e, struct lval* a);
+struct lval* builtin_map_get(struct lenv* e, struct lval* a);
+struct lval* builtin_map_put(struct lenv* e, struct lval* a);
+struct lval* builtin_map_del(struct lenv* e, struct lval* a);
+struct lval* builtin_map_keys(struct lenv* e, struct lval* a);
+struct lval* builtin_map_len(struct lenv* e, struct lval* a);
+
+struct lval* load_forms(struct lenv* e, struct reader* r);
 struct lval* builtin_load(struct lenv* e, struct lval* a);
 
 struct lval* builtin_print(struct lenv* e, struct lval* a);
+struct lval* builtin_to_string(struct lenv* e, struct lval* a);
 struct lval* builtin_error(struct lenv* e, struct lval* a);
 
+struct lval* builtin_gc(struct lenv* e, struct lval* a);
+struct lval* builtin_gc_stats(struct lenv* e, struct lval* a);
+struct lval* builtin_gc_growth(struct lenv* e, struct lval* a);
+
+struct lval* builtin_profile(struct lenv* e, struct lval* a);
+struct lval* builtin_sample_profile(struct lenv* e, struct lval* a);
+
 struct lval* lval_call(struct lenv* e, struct lval* f, struct lval* a);
 
 void lenv_add_builtin(struct lenv* e, char* name, lbuiltin func);
 void lenv_add_builtins(struct lenv* e);
+lbuiltin builtin_lookup(const char* name);
+const char* builtin_name(lbuiltin func);
 
 #endif // EVAL_H
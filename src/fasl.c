@@ -0,0 +1,394 @@
+#define _POSIX_C_SOURCE 200809L // st_mtim
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "fasl.h"
+
+#define FASL_VERSION 2
+#define FASL_ORDER 0x01020304u
+
+// Lists nested deeper than this make a cache invalid, as they are a
+// syntax error in source (scan.c), and recursing on would risk the C
+// stack on a corrupt cache.
+#define FASL_MAX_DEPTH 10000
+
+int fasl_enabled = 1;
+int fasl_rebuild = 0;
+
+enum { FASL_NUM = 1, FASL_SYM, FASL_STR, FASL_SEXPR, FASL_QEXPR };
+
+// The file starts with this header, in the writer's byte order (which
+// order records). The nsyms symbol names follow, each NUL-terminated,
+// then the nexprs expressions in prefix form: a tag byte, then a
+// number's value, a symbol's index in the names, a string's length and
+// NUL-terminated bytes, or a list's length, source line and cells.
+// Lengths, lines, indices and numbers are LEB128 varints, numbers
+// zigzag-encoded first.
+struct fasl_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t order;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t hash;
+    uint32_t nsyms;
+    uint32_t nexprs;
+};
+
+static const char fasl_magic[8] = "MYLISPC";
+
+// foo.mylisp caches to foo.mylispc; any other name gets .mylispc added.
+static char* fasl_path(const char* path) {
+    size_t n = strlen(path);
+    const char* ext = ".mylisp";
+    size_t e = strlen(ext);
+    int swap = n >= e && strcmp(path + n - e, ext) == 0;
+    char* p = malloc(n + e + 2);
+    sprintf(p, swap ? "%sc" : "%s.mylispc", path);
+    return p;
+}
+
+int fasl_stat(const char* path, struct fasl_src* s) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) { return 0; }
+    s->size = st.st_size;
+    s->mtime_sec = st.st_mtim.tv_sec;
+    s->mtime_nsec = st.st_mtim.tv_nsec;
+    s->hashed = 0;
+    s->hash = 0;
+    return 1;
+}
+
+// FNV-1a over the whole source.
+static int fasl_hash(const char* path, struct fasl_src* s) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    if (s->size > 0) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) { return 0; }
+        unsigned char* p = mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) { return 0; }
+        for (long long i = 0; i < s->size; i++) {
+            h = (h ^ p[i]) * 0x100000001b3ull;
+        }
+        munmap(p, s->size);
+    }
+    s->hash = h;
+    s->hashed = 1;
+    return 1;
+}
+
+static int fasl_same_file(struct fasl_src* a, struct fasl_src* b) {
+    return a->size == b->size && a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+/* Reading */
+
+// Each symbol is decoded once, and every use of it shares that lval.
+struct fasl_reader {
+    const char* p;
+    const char* end;
+    struct lval** syms;
+    uint32_t nsyms;
+};
+
+static int fasl_get(struct fasl_reader* r, void* out, size_t n) {
+    if ((size_t)(r->end - r->p) < n) { return 0; }
+    memcpy(out, r->p, n);
+    r->p += n;
+    return 1;
+}
+
+static int fasl_get_varint(struct fasl_reader* r, uint64_t* out) {
+    uint64_t x = 0;
+    for (int shift = 0; shift < 64 && r->p < r->end; shift += 7) {
+        uint8_t b = *r->p++;
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) { *out = x; return 1; }
+    }
+    return 0;
+}
+
+static int fasl_get_len(struct fasl_reader* r, uint32_t* out) {
+    uint64_t x;
+    if (!fasl_get_varint(r, &x) || x > INT_MAX) { return 0; }
+    *out = x;
+    return 1;
+}
+
+// The next expression, at the given depth of lists, or NULL if the file
+// is truncated or corrupt.
+static struct lval* fasl_decode(struct fasl_reader* r, int depth) {
+    uint8_t tag;
+    uint32_t n, line;
+    uint64_t x;
+    if (!fasl_get(r, &tag, 1)) { return NULL; }
+    switch (tag) {
+        case FASL_NUM:
+            if (!fasl_get_varint(r, &x)) { return NULL; }
+            return lval_num((long)(x >> 1) ^ -(long)(x & 1));
+        case FASL_SYM:
+            if (!fasl_get_len(r, &n) || n >= r->nsyms) { return NULL; }
+            return lval_copy(r->syms[n]);
+        case FASL_STR: {
+            if (!fasl_get_len(r, &n)) { return NULL; }
+            if ((size_t)(r->end - r->p) <= n || r->p[n] != '\0') { return NULL; }
+            struct lval* v = lval_str_n((char*)r->p, n);
+            r->p += n + 1;
+            return v;
+        }
+        case FASL_SEXPR:
+        case FASL_QEXPR: {
+            if (depth == FASL_MAX_DEPTH) { return NULL; }
+            // Every cell takes at least a byte, which bounds n.
+            if (!fasl_get_len(r, &n) || n > (size_t)(r->end - r->p)) { return NULL; }
+            struct lval* v = tag == FASL_SEXPR ? lval_sexpr() : lval_qexpr();
+            if (!fasl_get_len(r, &line)) { lval_del(v); return NULL; }
+            v->line = line;
+            if (n) { lval_resize(v, n); }
+            for (uint32_t i = 0; i < n; i++) {
+                struct lval* c = fasl_decode(r, depth + 1);
+                if (!c) { lval_del(v); return NULL; }
+                lval_add(v, c);
+            }
+            return v;
+        }
+        default: return NULL;
+    }
+}
+
+static int fasl_header_ok(struct fasl_header* h, const char* path, struct fasl_src* s) {
+    if (memcmp(h->magic, fasl_magic, sizeof(fasl_magic)) != 0) { return 0; }
+    if (h->version != FASL_VERSION || h->order != FASL_ORDER) { return 0; }
+    if (h->size != s->size) { return 0; }
+    if (h->mtime_sec == s->mtime_sec && h->mtime_nsec == s->mtime_nsec) { return 1; }
+    // Touched but perhaps not changed.
+    if (!s->hashed && !fasl_hash(path, s)) { return 0; }
+    return h->hash == s->hash;
+}
+
+struct lval* fasl_read(const char* path, struct fasl_src* s) {
+    char* cpath = fasl_path(path);
+    int fd = open(cpath, O_RDONLY);
+    free(cpath);
+    if (fd < 0) { return NULL; }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct fasl_header)) {
+        close(fd);
+        return NULL;
+    }
+    char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { return NULL; }
+
+    struct fasl_header h;
+    memcpy(&h, map, sizeof(h));
+    struct lval* exprs = NULL;
+    struct fasl_reader r = { map + sizeof(h), map + st.st_size, NULL, h.nsyms };
+    uint32_t nsyms = 0;
+
+    if (!fasl_header_ok(&h, path, s) || h.nsyms > (size_t)(r.end - r.p)) { goto done; }
+
+    r.syms = malloc(sizeof(struct lval*) * (h.nsyms + 1));
+    for (; nsyms < h.nsyms; nsyms++) {
+        const char* nul = memchr(r.p, '\0', r.end - r.p);
+        if (!nul) { goto done; }
+        r.syms[nsyms] = lval_sym((char*)r.p);
+        r.p = nul + 1;
+    }
+
+    exprs = lval_sexpr();
+    for (uint32_t i = 0; i < h.nexprs; i++) {
+        struct lval* x = fasl_decode(&r, 0);
+        if (!x) { lval_del(exprs); exprs = NULL; break; }
+        lval_add(exprs, x);
+    }
+
+done:
+    if (r.syms) {
+        for (uint32_t i = 0; i < nsyms; i++) { lval_del(r.syms[i]); }
+        free(r.syms);
+    }
+    munmap(map, st.st_size);
+    return exprs;
+}
+
+/* Writing */
+
+struct fasl_buf {
+    char* data;
+    size_t len;
+    size_t cap;
+};
+
+static void fasl_put(struct fasl_buf* b, const void* p, size_t n) {
+    if (b->len + n > b->cap) {
+        while (b->len + n > b->cap) { b->cap = b->cap ? b->cap * 2 : 4096; }
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void fasl_put_varint(struct fasl_buf* b, uint64_t x) {
+    uint8_t bytes[10];
+    int n = 0;
+    do {
+        bytes[n] = x & 0x7f;
+        x >>= 7;
+        if (x) { bytes[n] |= 0x80; }
+        n++;
+    } while (x);
+    fasl_put(b, bytes, n);
+}
+
+static void fasl_put_tag(struct fasl_buf* b, uint8_t tag, uint64_t x) {
+    fasl_put(b, &tag, 1);
+    fasl_put_varint(b, x);
+}
+
+// Numbers the symbols in order of first use. Keys are interned names,
+// so they hash and compare by pointer.
+struct fasl_writer {
+    char* path;
+    struct fasl_src src;
+    int ok;
+    uint32_t nexprs;
+    struct fasl_buf names;
+    struct fasl_buf body;
+    uint32_t nsyms;
+    uint32_t cap;
+    char** keys;
+    uint32_t* index;
+};
+
+static uint32_t fasl_slot(struct fasl_writer* w, char* sym) {
+    uint32_t i = (uint32_t)(((uintptr_t)sym >> 4) * 2654435761u) & (w->cap - 1);
+    while (w->keys[i] && w->keys[i] != sym) { i = (i + 1) & (w->cap - 1); }
+    return i;
+}
+
+static uint32_t fasl_sym_index(struct fasl_writer* w, char* sym) {
+    if ((w->nsyms + 1) * 2 > w->cap) {
+        uint32_t old_cap = w->cap;
+        char** old_keys = w->keys;
+        uint32_t* old_index = w->index;
+        w->cap = old_cap ? old_cap * 2 : 64;
+        w->keys = calloc(w->cap, sizeof(char*));
+        w->index = malloc(sizeof(uint32_t) * w->cap);
+        for (uint32_t i = 0; i < old_cap; i++) {
+            if (!old_keys[i]) { continue; }
+            uint32_t j = fasl_slot(w, old_keys[i]);
+            w->keys[j] = old_keys[i];
+            w->index[j] = old_index[i];
+        }
+        free(old_keys);
+        free(old_index);
+    }
+    uint32_t i = fasl_slot(w, sym);
+    if (!w->keys[i]) {
+        w->keys[i] = sym;
+        w->index[i] = w->nsyms++;
+        fasl_put(&w->names, sym, strlen(sym) + 1);
+    }
+    return w->index[i];
+}
+
+// Returns 0 if x holds something a source file can't, such as a function.
+static int fasl_encode(struct fasl_writer* w, struct lval* x) {
+    struct fasl_buf* b = &w->body;
+    switch (lval_type_of(x)) {
+        case LVAL_NUM: {
+            long n = lval_num_of(x);
+            fasl_put_tag(b, FASL_NUM, ((uint64_t)n << 1) ^ (uint64_t)(n >> 63));
+            return 1;
+        }
+        case LVAL_SYM:
+            fasl_put_tag(b, FASL_SYM, fasl_sym_index(w, x->sym));
+            return 1;
+        case LVAL_STR: {
+            fasl_put_tag(b, FASL_STR, x->slen);
+            fasl_put(b, x->str, x->slen);
+            fasl_put(b, "", 1);
+            return 1;
+        }
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            fasl_put_tag(b, x->type == LVAL_SEXPR ? FASL_SEXPR : FASL_QEXPR, x->count);
+            fasl_put_varint(b, x->line);
+            for (int i = 0; i < x->count; i++) {
+                if (!fasl_encode(w, x->cell[i])) { return 0; }
+            }
+            return 1;
+        default: return 0;
+    }
+}
+
+struct fasl_writer* fasl_begin(const char* path, struct fasl_src* s) {
+    struct fasl_writer* w = calloc(1, sizeof(struct fasl_writer));
+    w->path = strdup(path);
+    w->src = *s;
+    w->ok = 1;
+    return w;
+}
+
+void fasl_add(struct fasl_writer* w, struct lval* x) {
+    if (w->ok) { w->ok = w->nexprs++ < UINT32_MAX && fasl_encode(w, x); }
+}
+
+static void fasl_free(struct fasl_writer* w) {
+    free(w->path);
+    free(w->names.data);
+    free(w->body.data);
+    free(w->keys);
+    free(w->index);
+    free(w);
+}
+
+void fasl_abort(struct fasl_writer* w) {
+    fasl_free(w);
+}
+
+void fasl_commit(struct fasl_writer* w) {
+    // Don't cache a parse of a file that changed under us.
+    struct fasl_src* s = &w->src;
+    struct fasl_src now;
+    if (!w->ok || !fasl_stat(w->path, &now) || !fasl_same_file(s, &now)
+        || (!s->hashed && !fasl_hash(w->path, s))) {
+        fasl_free(w);
+        return;
+    }
+
+    struct fasl_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, fasl_magic, sizeof(fasl_magic));
+    h.version = FASL_VERSION;
+    h.order = FASL_ORDER;
+    h.size = s->size;
+    h.mtime_sec = s->mtime_sec;
+    h.mtime_nsec = s->mtime_nsec;
+    h.hash = s->hash;
+    h.nsyms = w->nsyms;
+    h.nexprs = w->nexprs;
+
+    // Write to a temporary name and rename, so that a reader never
+    // maps a half-written cache.
+    char* cpath = fasl_path(w->path);
+    char* tmp = malloc(strlen(cpath) + 32);
+    sprintf(tmp, "%s.%ld", cpath, (long)getpid());
+    FILE* f = fopen(tmp, "wb");
+    if (f) {
+        int written = fwrite(&h, sizeof(h), 1, f) == 1
+            && (!w->names.len || fwrite(w->names.data, w->names.len, 1, f) == 1)
+            && (!w->body.len || fwrite(w->body.data, w->body.len, 1, f) == 1);
+        if (fclose(f) != 0) { written = 0; }
+        if (!written || rename(tmp, cpath) != 0) { remove(tmp); }
+    }
+    free(tmp);
+    free(cpath);
+    fasl_free(w);
+}
@@ -0,0 +1,45 @@
+#ifndef FASL_H
+#define FASL_H
+
+#include <time.h>
+#include "types.h"
+
+// Compiled-file cache for load. After parsing foo.mylisp, load writes
+// foo.mylispc next to it: the parsed expressions in a compact binary
+// form, which later loads map in and decode straight into lvals. A
+// cache is used while the source has the same size and either the same
+// mtime or, failing that, the same content hash. A cache that can't be
+// written (a read-only directory, say) is simply not kept.
+//
+// A cache is decoded whole, so sources bigger than FASL_MAX_SOURCE are
+// not cached: load streams them, one form at a time, every time.
+#define FASL_MAX_SOURCE (16L << 20)
+
+extern int fasl_enabled;  // --no-cache clears this
+extern int fasl_rebuild;  // --recompile: parse anyway and rewrite the cache
+
+// What a cache is keyed on. hash is only computed when needed.
+struct fasl_src {
+    long long size;
+    time_t mtime_sec;
+    long mtime_nsec;
+    int hashed;
+    uint64_t hash;
+};
+
+int fasl_stat(const char* path, struct fasl_src* s);
+
+// The expressions cached for the source at path, as an S-Expression, or
+// NULL when there is no usable cache.
+struct lval* fasl_read(const char* path, struct fasl_src* s);
+
+// Writes a cache for the source at path as it is read: each form is
+// added before it is evaluated, and the cache is written by fasl_commit
+// once the whole file has been read, or dropped by fasl_abort.
+struct fasl_writer;
+struct fasl_writer* fasl_begin(const char* path, struct fasl_src* s);
+void fasl_add(struct fasl_writer* w, struct lval* x);
+void fasl_commit(struct fasl_writer* w);
+void fasl_abort(struct fasl_writer* w);
+
+#endif // FASL_H
@@ -0,0 +1,247 @@
+#include <time.h>
+#include "gc.h"
+#include "map.h"
+#include "memo.h"
+#include "vm.h"
+
+#define GC_MIN_HEAP 4096
+#define GC_LIVE -1
+
+struct gc_heap {
+    struct lval* objs;
+    long next;   // collect once more than this many objects are live
+    int growth;
+    struct gc_stats stats;
+};
+
+static __thread struct gc_heap* heap = NULL;
+static __thread struct gc_batch* batch = NULL;
+
+struct gc_heap* gc_heap_new(void) {
+    struct gc_heap* h = calloc(1, sizeof(struct gc_heap));
+    h->next = GC_MIN_HEAP;
+    h->growth = 200;
+    return h;
+}
+
+struct gc_heap* gc_enter(struct gc_heap* h) {
+    struct gc_heap* prev = heap;
+    heap = h;
+    return prev;
+}
+
+void gc_track(struct lval* v) {
+    v->gc_prev = NULL;
+    if (batch) {
+        v->gc_next = batch->head;
+        if (batch->head) { batch->head->gc_prev = v; } else { batch->tail = v; }
+        batch->head = v;
+        batch->count++;
+        batch->allocated++;
+        return;
+    }
+    v->gc_next = heap->objs;
+    if (heap->objs) { heap->objs->gc_prev = v; }
+    heap->objs = v;
+    heap->stats.allocated++;
+    heap->stats.live++;
+}
+
+void gc_untrack(struct lval* v) {
+    if (batch) {
+        if (v->gc_prev) { v->gc_prev->gc_next = v->gc_next; } else { batch->head = v->gc_next; }
+        if (v->gc_next) { v->gc_next->gc_prev = v->gc_prev; } else { batch->tail = v->gc_prev; }
+        batch->count--;
+        return;
+    }
+    if (v->gc_prev) { v->gc_prev->gc_next = v->gc_next; } else { heap->objs = v->gc_next; }
+    if (v->gc_next) { v->gc_next->gc_prev = v->gc_prev; }
+    heap->stats.live--;
+}
+
+void gc_batch_begin(struct gc_batch* b) {
+    b->head = NULL;
+    b->tail = NULL;
+    b->count = 0;
+    b->allocated = 0;
+    batch = b;
+}
+
+void gc_batch_end(void) {
+    batch = NULL;
+}
+
+// Counts everything the batch allocated, not just what is still live
+// on it, so that the allocated stat doesn't depend on which thread
+// parsed a file.
+void gc_adopt(struct gc_batch* b) {
+    heap->stats.allocated += b->allocated;
+    b->allocated = 0;
+    if (!b->head) { return; }
+    b->tail->gc_next = heap->objs;
+    if (heap->objs) { heap->objs->gc_prev = b->tail; }
+    heap->objs = b->head;
+    heap->stats.live += b->count;
+    b->head = NULL;
+    b->tail = NULL;
+    b->count = 0;
+}
+
+static long lval_bytes(struct lval* v) {
+    long n = sizeof(struct lval);
+    switch (v->type) {
+        case LVAL_ERR: n += strlen(v->err) + 1; break;
+        case LVAL_STR:
+            if (!v->sbase) { n += v->slen + 1; }
+            break;
+        case LVAL_FUN:
+            if (!v->builtin) {
+                n += sizeof(struct lenv) + v->env->cap * (sizeof(char*) + sizeof(struct lval*));
+            }
+            break;
+        case LVAL_BUF: n += v->cap * sizeof(struct lval*); break;
+        case LVAL_VEC: n += v->len * sizeof(int64_t); break;
+        case LVAL_TABLE:
+            n += sizeof(struct map) + v->map->cap * sizeof(struct map_entry) + v->map->nslots * sizeof(int);
+            break;
+        default: break;
+    }
+    return n;
+}
+
+// Calls visit on every lval that v holds a reference to.
+// Fixnums are not heap objects and are skipped.
+static void lval_children(struct lval* v, void (*visit)(struct lval*, void*), void* ctx) {
+    switch (v->type) {
+        case LVAL_SYM:
+            if (v->ic && !lval_is_fixnum(v->ic)) { visit(v->ic, ctx); }
+            break;
+        case LVAL_STR:
+            if (v->sbase) { visit(v->sbase, ctx); }
+            break;
+        case LVAL_FUN:
+            if (v->builtin) { break; }
+            visit(v->formals, ctx);
+            visit(v->body, ctx);
+            for (int i = 0; i < v->env->cap; i++) {
+                struct lval* c = v->env->vals[i];
+                if (v->env->syms[i] && !lval_is_fixnum(c)) { visit(c, ctx); }
+            }
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (v->buf) { visit(v->buf, ctx); }
+            if (v->code) { vm_children(v->code, visit, ctx); }
+            break;
+        case LVAL_MAP:
+            if (v->tab) { visit(v->tab, ctx); }
+            break;
+        case LVAL_TABLE:
+            map_children(v->map, visit, ctx);
+            break;
+        case LVAL_MEMO:
+            memo_children(v->memo, visit, ctx);
+            break;
+        case LVAL_BUF:
+            for (int i = v->lo; i < v->hi; i++) {
+                // A cell is NULL while lval_eval_sexpr is evaluating it.
+                struct lval* c = v->items[i];
+                if (c && !lval_is_fixnum(c)) { visit(c, ctx); }
+            }
+            break;
+        default: break;
+    }
+}
+
+static void subtract_internal(struct lval* c, void* ctx) {
+    c->gc_refs--;
+}
+
+struct mark_stack {
+    int count;
+    int cap;
+    struct lval** items;
+};
+
+static void mark_push(struct lval* c, void* ctx) {
+    struct mark_stack* s = ctx;
+    if (c->gc_refs == GC_LIVE) { return; }
+    c->gc_refs = GC_LIVE;
+    if (s->count == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 256;
+        s->items = realloc(s->items, sizeof(struct lval*) * s->cap);
+    }
+    s->items[s->count++] = c;
+}
+
+// Drops a garbage object's references to live objects. References to
+// other garbage are left alone, since those objects are freed directly.
+static void release_live(struct lval* c, void* ctx) {
+    if (c->gc_refs == GC_LIVE) { lval_del(c); }
+}
+
+long gc_collect(void) {
+    clock_t start = clock();
+    struct gc_stats* stats = &heap->stats;
+
+    for (struct lval* v = heap->objs; v; v = v->gc_next) { v->gc_refs = v->refs; }
+    for (struct lval* v = heap->objs; v; v = v->gc_next) { lval_children(v, subtract_internal, NULL); }
+
+    struct mark_stack stack = { 0, 0, NULL };
+    for (struct lval* v = heap->objs; v; v = v->gc_next) {
+        if (v->gc_refs > 0) { mark_push(v, &stack); }
+    }
+    while (stack.count) {
+        lval_children(stack.items[--stack.count], mark_push, &stack);
+    }
+
+    long n = 0;
+    for (struct lval* v = heap->objs; v; v = v->gc_next) {
+        if (v->gc_refs != GC_LIVE) { mark_push(v, &stack); n++; }
+    }
+    // mark_push flagged the garbage as GC_LIVE; flag it back so that
+    // release_live only drops references that leave the garbage set.
+    for (int i = 0; i < stack.count; i++) { stack.items[i]->gc_refs = 0; }
+    for (int i = 0; i < stack.count; i++) { lval_children(stack.items[i], release_live, NULL); }
+    for (int i = 0; i < stack.count; i++) {
+        stats->bytes_reclaimed += lval_bytes(stack.items[i]);
+        lval_free(stack.items[i]);
+    }
+    free(stack.items);
+
+    heap->next = stats->live * heap->growth / 100;
+    if (heap->next < GC_MIN_HEAP) { heap->next = GC_MIN_HEAP; }
+
+    double pause = (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+    stats->collections++;
+    stats->objects_reclaimed += n;
+    stats->total_pause_ms += pause;
+    stats->last_pause_ms = pause;
+    if (pause > stats->max_pause_ms) { stats->max_pause_ms = pause; }
+    return n;
+}
+
+void gc_maybe_collect(void) {
+    if (heap->stats.live > heap->next) { gc_collect(); }
+}
+
+void gc_set_growth(int percent) {
+    heap->growth = percent;
+    heap->next = heap->stats.live * heap->growth / 100;
+    if (heap->next < GC_MIN_HEAP) { heap->next = GC_MIN_HEAP; }
+}
+
+struct gc_stats gc_get_stats(void) {
+    return heap->stats;
+}
+
+long gc_allocated(void) {
+    return heap->stats.allocated;
+}
+
+void gc_heap_del(struct gc_heap* h) {
+    struct gc_heap* prev = gc_enter(h);
+    gc_collect();
+    gc_enter(prev);
+    free(h);
+}
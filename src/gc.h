@@ -0,0 +1,63 @@
+#ifndef GC_H
+#define GC_H
+
+#include "types.h"
+
+// Every lval is tracked on a heap list from allocation to free.
+// Reference counting frees most values as soon as they die; the
+// collector exists for the ones reference counting cannot free, namely
+// cycles, and runs by trial deletion: an object whose refs exceed the
+// references held by other heap objects is held from outside the heap
+// (the global env, or a C local on the evaluator stack) and is a root.
+// Everything not reachable from a root is garbage.
+
+struct gc_stats {
+    long collections;
+    long allocated;
+    long live;
+    long objects_reclaimed;
+    long bytes_reclaimed;
+    double total_pause_ms;
+    double max_pause_ms;
+    double last_pause_ms;
+};
+
+// Each interpreter context (see mylisp.h) has a heap of its own, and a
+// thread allocates on, and collects, the heap it has entered last.
+// Values never refer across heaps.
+struct gc_heap;
+
+struct gc_heap* gc_heap_new(void);
+// Returns the heap the thread was on before.
+struct gc_heap* gc_enter(struct gc_heap* h);
+// Collects what is left of h, which must be only garbage, and frees h.
+void gc_heap_del(struct gc_heap* h);
+
+void gc_track(struct lval* v);
+void gc_untrack(struct lval* v);
+
+// A heap belongs to the thread that evaluates on it. Another thread (one
+// parsing ahead, say) first calls gc_batch_begin, and what it allocates
+// is then tracked on the batch instead, until gc_batch_end. The batch's
+// objects may be handed to the evaluating thread, which must gc_adopt
+// the batch before it touches any of them.
+struct gc_batch {
+    struct lval* head;
+    struct lval* tail;
+    long count;      // live on the batch
+    long allocated;  // ever tracked on it, for the heap's stats
+};
+
+void gc_batch_begin(struct gc_batch* b);
+void gc_batch_end(void);
+void gc_adopt(struct gc_batch* b);
+
+long gc_collect(void);
+void gc_maybe_collect(void);
+
+void gc_set_growth(int percent);
+struct gc_stats gc_get_stats(void);
+// The allocated count of gc_get_stats, cheaply.
+long gc_allocated(void);
+
+#endif // GC_H
@@ -0,0 +1,577 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "image.h"
+#include "eval.h"
+#include "map.h"
+#include "memo.h"
+#include "vm.h"
+
+#define IMAGE_VERSION 2
+#define IMAGE_ORDER 0x01020304u
+
+enum {
+    IMG_NUM = 1, IMG_ERR, IMG_SYM, IMG_STR, IMG_BUILTIN, IMG_LAMBDA,
+    IMG_SEXPR, IMG_QEXPR, IMG_VEC, IMG_MEMO, IMG_MAP
+};
+
+// The file starts with this header, in the writer's byte order (which
+// order records). Then come nnames NUL-terminated names (of symbols and
+// builtins), nobjs object records and nglobals bindings. A record is a
+// tag byte and its fields:
+//
+//   IMG_NUM             value, outside the fixnum range
+//   IMG_ERR, IMG_STR    length, bytes, NUL
+//   IMG_SYM             name
+//   IMG_BUILTIN         name it is registered under
+//   IMG_LAMBDA          formals, body, count, then count (name, value)
+//   IMG_SEXPR/QEXPR     count, source line, then count values
+//   IMG_VEC             length, then that many raw int64s
+//   IMG_MEMO            function, limit (the cached results are left out)
+//   IMG_MAP             count, then count (key, value) in order
+//
+// and a binding is a name and a value. Everything but the raw vector
+// data is a LEB128 varint. A name is an index into the names; a value
+// is an object number times two, or a fixnum zigzag-encoded, times two,
+// plus one. Objects only refer to earlier ones, so the loader can make
+// each in turn, and a damaged image can't tie values into cycles.
+struct image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t order;
+    uint32_t nnames;
+    uint32_t nobjs;
+    uint32_t nglobals;
+    uint32_t reserved;
+};
+
+static const char image_magic[8] = "MYLISPI";
+
+static uint64_t zigzag(long n) {
+    return ((uint64_t)n << 1) ^ (uint64_t)(n >> 63);
+}
+
+static long unzigzag(uint64_t x) {
+    return (long)(x >> 1) ^ -(long)(x & 1);
+}
+
+// Maps pointers to numbers, for the writer.
+struct ptr_map {
+    void** keys;
+    uint32_t* vals;
+    uint32_t count;
+    uint32_t cap;
+};
+
+static uint32_t ptr_map_slot(struct ptr_map* m, void* key) {
+    uint32_t i = (uint32_t)(((uintptr_t)key >> 4) * 2654435761u) & (m->cap - 1);
+    while (m->keys[i] && m->keys[i] != key) { i = (i + 1) & (m->cap - 1); }
+    return i;
+}
+
+static int ptr_map_get(struct ptr_map* m, void* key, uint32_t* val) {
+    if (!m->cap) { return 0; }
+    uint32_t i = ptr_map_slot(m, key);
+    if (!m->keys[i]) { return 0; }
+    *val = m->vals[i];
+    return 1;
+}
+
+static void ptr_map_put(struct ptr_map* m, void* key, uint32_t val) {
+    if ((m->count + 1) * 2 > m->cap) {
+        struct ptr_map old = *m;
+        m->cap = old.cap ? old.cap * 2 : 256;
+        m->keys = calloc(m->cap, sizeof(void*));
+        m->vals = malloc(sizeof(uint32_t) * m->cap);
+        for (uint32_t i = 0; i < old.cap; i++) {
+            if (!old.keys[i]) { continue; }
+            uint32_t j = ptr_map_slot(m, old.keys[i]);
+            m->keys[j] = old.keys[i];
+            m->vals[j] = old.vals[i];
+        }
+        free(old.keys);
+        free(old.vals);
+    }
+    uint32_t i = ptr_map_slot(m, key);
+    m->keys[i] = key;
+    m->vals[i] = val;
+    m->count++;
+}
+
+static void ptr_map_free(struct ptr_map* m) {
+    free(m->keys);
+    free(m->vals);
+}
+
+/* Saving */
+
+struct image_writer {
+    FILE* f;
+    struct ptr_map obj_index;
+    struct lval** objs;
+    uint32_t nobjs;
+    uint32_t objs_cap;
+    struct ptr_map name_index; // keyed on interned names
+    char** names;
+    uint32_t nnames;
+    uint32_t names_cap;
+};
+
+static uint32_t image_name(struct image_writer* w, const char* s) {
+    char* name = sym_intern(s);
+    uint32_t i;
+    if (ptr_map_get(&w->name_index, name, &i)) { return i; }
+    if (w->nnames == w->names_cap) {
+        w->names_cap = w->names_cap ? w->names_cap * 2 : 256;
+        w->names = realloc(w->names, sizeof(char*) * w->names_cap);
+    }
+    w->names[w->nnames] = name;
+    ptr_map_put(&w->name_index, name, w->nnames);
+    return w->nnames++;
+}
+
+#define IMAGE_VISITING UINT32_MAX
+
+// Symbols are numbered by name, so that every use of one shares a
+// single lval once loaded.
+static void* image_key(struct lval* v) {
+    return v->type == LVAL_SYM ? (void*)v->sym : (void*)v;
+}
+
+// Numbers v after everything it reaches, and names every symbol and
+// builtin met on the way. Returns 0 for values an image can't hold,
+// which include cycles; the language has no way to make those from
+// values an image can hold, short of the symbol caches, which are left
+// out.
+static int image_visit(struct image_writer* w, struct lval* v) {
+    uint32_t i;
+    if (lval_is_fixnum(v)) { return 1; }
+    if (ptr_map_get(&w->obj_index, image_key(v), &i)) { return i != IMAGE_VISITING; }
+    ptr_map_put(&w->obj_index, image_key(v), IMAGE_VISITING);
+
+    int ok = 1;
+    switch (v->type) {
+        case LVAL_NUM: case LVAL_ERR: case LVAL_STR: case LVAL_VEC:
+            break;
+        case LVAL_SYM:
+            image_name(w, v->sym);
+            break;
+        case LVAL_FUN:
+            if (v->builtin) {
+                const char* name = builtin_name(v->builtin);
+                if (name) { image_name(w, name); } else { ok = 0; }
+                break;
+            }
+            ok = image_visit(w, v->formals) && image_visit(w, v->body);
+            for (int j = 0; j < v->env->cap && ok; j++) {
+                if (!v->env->syms[j]) { continue; }
+                image_name(w, v->env->syms[j]);
+                ok = image_visit(w, v->env->vals[j]);
+            }
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int j = 0; j < v->count && ok; j++) { ok = image_visit(w, v->cell[j]); }
+            break;
+        case LVAL_MAP:
+            for (int j = 0; j < v->nentries && ok; j++) {
+                struct map_entry* x = &map_entries(v)[j];
+                if (x->key) { ok = image_visit(w, x->key) && image_visit(w, x->val); }
+            }
+            break;
+        case LVAL_MEMO:
+            ok = image_visit(w, v->memo->f);
+            break;
+        default: ok = 0; break;
+    }
+    if (!ok) { return 0; }
+
+    if (w->nobjs == w->objs_cap) {
+        w->objs_cap = w->objs_cap ? w->objs_cap * 2 : 256;
+        w->objs = realloc(w->objs, sizeof(struct lval*) * w->objs_cap);
+    }
+    w->objs[w->nobjs] = v;
+    ptr_map_put(&w->obj_index, image_key(v), w->nobjs++);
+    return 1;
+}
+
+static void put_varint(FILE* f, uint64_t x) {
+    do {
+        int b = x & 0x7f;
+        x >>= 7;
+        fputc(x ? b | 0x80 : b, f);
+    } while (x);
+}
+
+static void put_bytes(FILE* f, const char* s, size_t n) {
+    put_varint(f, n);
+    fwrite(s, 1, n, f);
+    fputc('\0', f);
+}
+
+static void put_string(FILE* f, const char* s) {
+    put_bytes(f, s, strlen(s));
+}
+
+static void put_name(struct image_writer* w, const char* s) {
+    put_varint(w->f, image_name(w, s));
+}
+
+static void put_ref(struct image_writer* w, struct lval* v) {
+    if (lval_is_fixnum(v)) {
+        put_varint(w->f, zigzag(lval_num_of(v)) << 1 | 1);
+    } else {
+        uint32_t i = 0;
+        ptr_map_get(&w->obj_index, image_key(v), &i);
+        put_varint(w->f, (uint64_t)i << 1);
+    }
+}
+
+static void put_object(struct image_writer* w, struct lval* v) {
+    FILE* f = w->f;
+    switch (v->type) {
+        case LVAL_NUM:
+            fputc(IMG_NUM, f);
+            put_varint(f, zigzag(v->num));
+            break;
+        case LVAL_ERR: fputc(IMG_ERR, f); put_string(f, v->err); break;
+        case LVAL_STR: fputc(IMG_STR, f); put_bytes(f, v->str, v->slen); break;
+        case LVAL_SYM: fputc(IMG_SYM, f); put_name(w, v->sym); break;
+        case LVAL_FUN:
+            if (v->builtin) {
+                fputc(IMG_BUILTIN, f);
+                put_name(w, builtin_name(v->builtin));
+                break;
+            }
+            fputc(IMG_LAMBDA, f);
+            put_ref(w, v->formals);
+            put_ref(w, v->body);
+            put_varint(f, v->env->count);
+            for (int i = 0; i < v->env->cap; i++) {
+                if (!v->env->syms[i]) { continue; }
+                put_name(w, v->env->syms[i]);
+                put_ref(w, v->env->vals[i]);
+            }
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            fputc(v->type == LVAL_SEXPR ? IMG_SEXPR : IMG_QEXPR, f);
+            put_varint(f, v->count);
+            put_varint(f, v->line);
+            for (int i = 0; i < v->count; i++) { put_ref(w, v->cell[i]); }
+            break;
+        case LVAL_VEC:
+            fputc(IMG_VEC, f);
+            put_varint(f, v->len);
+            if (v->len) { fwrite(v->data, sizeof(int64_t), v->len, f); }
+            break;
+        case LVAL_MAP:
+            fputc(IMG_MAP, f);
+            put_varint(f, v->nkeys);
+            for (int i = 0; i < v->nentries; i++) {
+                struct map_entry* x = &map_entries(v)[i];
+                if (!x->key) { continue; }
+                put_ref(w, x->key);
+                put_ref(w, x->val);
+            }
+            break;
+        case LVAL_MEMO:
+            fputc(IMG_MEMO, f);
+            put_ref(w, v->memo->f);
+            put_varint(f, v->memo->limit);
+            break;
+        default: break;
+    }
+}
+
+int image_save(struct lenv* e, const char* path) {
+    e = lenv_root(e);
+    struct image_writer w;
+    memset(&w, 0, sizeof(w));
+
+    uint32_t nglobals = 0;
+    int ok = 1;
+    for (int i = 0; i < e->cap && ok; i++) {
+        if (!e->syms[i]) { continue; }
+        image_name(&w, e->syms[i]);
+        ok = image_visit(&w, e->vals[i]);
+        if (!ok) { fprintf(stderr, "Cannot save '%s' in an image.\n", e->syms[i]); }
+        nglobals++;
+    }
+
+    if (ok) {
+        char* tmp = malloc(strlen(path) + 32);
+        sprintf(tmp, "%s.%ld", path, (long)getpid());
+        w.f = fopen(tmp, "wb");
+        if (!w.f) {
+            fprintf(stderr, "Could not write image '%s'.\n", path);
+            ok = 0;
+        } else {
+            struct image_header h;
+            memset(&h, 0, sizeof(h));
+            memcpy(h.magic, image_magic, sizeof(image_magic));
+            h.version = IMAGE_VERSION;
+            h.order = IMAGE_ORDER;
+            h.nnames = w.nnames;
+            h.nobjs = w.nobjs;
+            h.nglobals = nglobals;
+            fwrite(&h, sizeof(h), 1, w.f);
+            for (uint32_t i = 0; i < w.nnames; i++) { fwrite(w.names[i], 1, strlen(w.names[i]) + 1, w.f); }
+            for (uint32_t i = 0; i < w.nobjs; i++) { put_object(&w, w.objs[i]); }
+            for (int i = 0; i < e->cap; i++) {
+                if (!e->syms[i]) { continue; }
+                put_name(&w, e->syms[i]);
+                put_ref(&w, e->vals[i]);
+            }
+            ok = !ferror(w.f);
+            if (fclose(w.f) != 0) { ok = 0; }
+            if (!ok || rename(tmp, path) != 0) {
+                fprintf(stderr, "Could not write image '%s'.\n", path);
+                remove(tmp);
+                ok = 0;
+            }
+        }
+        free(tmp);
+    }
+
+    ptr_map_free(&w.obj_index);
+    ptr_map_free(&w.name_index);
+    free(w.objs);
+    free(w.names);
+    return ok;
+}
+
+/* Loading */
+
+struct image_reader {
+    const char* p;
+    const char* end;
+    char** names;
+    uint32_t nnames;
+    struct lval** objs;
+    uint32_t nobjs; // made so far
+};
+
+static int get_varint(struct image_reader* r, uint64_t* out) {
+    uint64_t x = 0;
+    for (int shift = 0; shift < 64 && r->p < r->end; shift += 7) {
+        uint8_t b = *r->p++;
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) { *out = x; return 1; }
+    }
+    return 0;
+}
+
+// Every item takes at least a byte, which bounds counts.
+static int get_count(struct image_reader* r, uint32_t* out) {
+    uint64_t x;
+    if (!get_varint(r, &x) || x > (uint64_t)(r->end - r->p) || x > INT_MAX) { return 0; }
+    *out = x;
+    return 1;
+}
+
+static char* get_name(struct image_reader* r) {
+    uint64_t x;
+    if (!get_varint(r, &x) || x >= r->nnames) { return NULL; }
+    return r->names[x];
+}
+
+static const char* get_string(struct image_reader* r) {
+    uint32_t n;
+    if (!get_count(r, &n) || (size_t)(r->end - r->p) <= n || r->p[n] != '\0') { return NULL; }
+    const char* s = r->p;
+    r->p += n + 1;
+    return s;
+}
+
+// A value, as a new reference, or NULL if it names no earlier object.
+static struct lval* get_ref(struct image_reader* r) {
+    uint64_t x;
+    if (!get_varint(r, &x)) { return NULL; }
+    if (x & 1) { return lval_num(unzigzag(x >> 1)); }
+    if ((x >> 1) >= r->nobjs) { return NULL; }
+    return lval_copy(r->objs[x >> 1]);
+}
+
+static int is_formals(struct lval* x) {
+    if (lval_type_of(x) != LVAL_QEXPR && lval_type_of(x) != LVAL_SEXPR) { return 0; }
+    for (int i = 0; i < x->count; i++) {
+        if (lval_type_of(x->cell[i]) != LVAL_SYM) { return 0; }
+    }
+    return 1;
+}
+
+static struct lval* get_lambda(struct image_reader* r) {
+    struct lval* formals = get_ref(r);
+    if (!formals) { return NULL; }
+    struct lval* body = get_ref(r);
+    uint32_t n;
+    if (!body || !is_formals(formals) || !get_count(r, &n)
+        || (lval_type_of(body) != LVAL_QEXPR && lval_type_of(body) != LVAL_SEXPR)) {
+        lval_del(formals);
+        if (body) { lval_del(body); }
+        return NULL;
+    }
+
+    struct lval* f = lval_lambda(formals, body);
+    for (uint32_t i = 0; i < n; i++) {
+        char* name = get_name(r);
+        struct lval* x = name ? get_ref(r) : NULL;
+        if (!x) { lval_del(f); return NULL; }
+        struct lval* k = lval_sym(name);
+        lenv_put(f->env, k, x);
+        lval_del(k); lval_del(x);
+    }
+    return f;
+}
+
+// The next object, or NULL if the image is damaged.
+static struct lval* get_object(struct image_reader* r) {
+    uint64_t x;
+    uint32_t n;
+    const char* s;
+    char* name;
+    if (r->p == r->end) { return NULL; }
+    int tag = *r->p++;
+    switch (tag) {
+        case IMG_NUM: {
+            // Fixnums are written inline in references, never as objects,
+            // and lval_num would give one that the object table can't hold.
+            if (!get_varint(r, &x)) { return NULL; }
+            long v = unzigzag(x);
+            if (v >= LVAL_FIXNUM_MIN && v <= LVAL_FIXNUM_MAX) { return NULL; }
+            return lval_num(v);
+        }
+        case IMG_ERR:
+            return (s = get_string(r)) ? lval_err("%s", s) : NULL;
+        case IMG_STR:
+            return (s = get_string(r)) ? lval_str((char*)s) : NULL;
+        case IMG_SYM:
+            return (name = get_name(r)) ? lval_sym(name) : NULL;
+        case IMG_BUILTIN: {
+            // A builtin this binary doesn't have can't be linked.
+            lbuiltin func = (name = get_name(r)) ? builtin_lookup(name) : NULL;
+            return func ? lval_builtin(func) : NULL;
+        }
+        case IMG_LAMBDA:
+            return get_lambda(r);
+        case IMG_SEXPR:
+        case IMG_QEXPR: {
+            if (!get_count(r, &n) || !get_varint(r, &x) || x > INT_MAX) { return NULL; }
+            struct lval* v = tag == IMG_SEXPR ? lval_sexpr() : lval_qexpr();
+            v->line = x;
+            if (n) { lval_resize(v, n); }
+            for (uint32_t i = 0; i < n; i++) {
+                struct lval* c = get_ref(r);
+                if (!c) { lval_del(v); return NULL; }
+                lval_add(v, c);
+            }
+            return v;
+        }
+        case IMG_VEC: {
+            if (!get_varint(r, &x) || x > (uint64_t)(r->end - r->p) / sizeof(int64_t)) { return NULL; }
+            struct lval* v = lval_vec(x);
+            if (x) { memcpy(v->data, r->p, sizeof(int64_t) * x); }
+            r->p += sizeof(int64_t) * x;
+            return v;
+        }
+        case IMG_MEMO: {
+            struct lval* f = get_ref(r);
+            if (!f) { return NULL; }
+            if (lval_type_of(f) != LVAL_FUN || !get_varint(r, &x) || x < 1 || x > INT_MAX) {
+                lval_del(f);
+                return NULL;
+            }
+            return lval_memo(f, x);
+        }
+        case IMG_MAP: {
+            if (!get_count(r, &n)) { return NULL; }
+            struct lval* v = lval_map();
+            for (uint32_t i = 0; i < n; i++) {
+                struct lval* k = get_ref(r);
+                struct lval* x = k ? get_ref(r) : NULL;
+                if (!x) {
+                    if (k) { lval_del(k); }
+                    lval_del(v);
+                    return NULL;
+                }
+                v = map_put(v, k, x);
+            }
+            return v;
+        }
+        default: return NULL;
+    }
+}
+
+struct lenv* image_load(const char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct image_header)) {
+        if (fd >= 0) { close(fd); }
+        fprintf(stderr, "Could not read image '%s'.\n", path);
+        return NULL;
+    }
+    char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not read image '%s'.\n", path);
+        return NULL;
+    }
+
+    struct image_header h;
+    memcpy(&h, map, sizeof(h));
+    struct image_reader r = { map + sizeof(h), map + st.st_size, NULL, h.nnames, NULL, 0 };
+    struct lenv* e = NULL;
+
+    size_t room = r.end - r.p;
+    if (memcmp(h.magic, image_magic, sizeof(image_magic)) != 0
+        || h.version != IMAGE_VERSION || h.order != IMAGE_ORDER
+        || h.nnames > room || h.nobjs > room || h.nglobals > room) {
+        goto done;
+    }
+
+    r.names = malloc(sizeof(char*) * (h.nnames + 1));
+    for (uint32_t i = 0; i < h.nnames; i++) {
+        const char* nul = memchr(r.p, '\0', r.end - r.p);
+        if (!nul) { goto done; }
+        r.names[i] = sym_intern(r.p);
+        r.p = nul + 1;
+    }
+
+    r.objs = malloc(sizeof(struct lval*) * (h.nobjs + 1));
+    for (; r.nobjs < h.nobjs; r.nobjs++) {
+        struct lval* v = get_object(&r);
+        if (!v) { goto done; }
+        r.objs[r.nobjs] = v;
+    }
+
+    e = lenv_new();
+    lenv_add_builtins(e);
+    for (uint32_t i = 0; i < h.nglobals; i++) {
+        char* name = get_name(&r);
+        struct lval* v = name ? get_ref(&r) : NULL;
+        if (!v) { lenv_del(e); e = NULL; goto done; }
+        struct lval* k = lval_sym(name);
+        lenv_put(e, k, v);
+        lval_del(k); lval_del(v);
+    }
+
+done:
+    // Drop the table's references. With the VM on, compile each lambda
+    // that is still alive first; the bytecode is cached on the body, so
+    // give each its own, as builtin_lambda does.
+    for (uint32_t i = 0; i < r.nobjs; i++) {
+        struct lval* f = r.objs[i];
+        if (e && vm_enabled && f->type == LVAL_FUN && !f->builtin && f->refs > 1) {
+            f->body = lval_unshare(f->body);
+            f->body->code = vm_compile(f->formals, f->body, f->env);
+        }
+        lval_del(f);
+    }
+    if (!e) { fprintf(stderr, "Image '%s' is damaged or from another version.\n", path); }
+    free(r.names);
+    free(r.objs);
+    munmap(map, st.st_size);
+    return e;
+}
@@ -0,0 +1,20 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "types.h"
+
+// Heap images: a snapshot of the global env, with every value reachable
+// from it (lambdas with their formals, bodies and captured envs
+// included), so that a process can start from a loaded prelude without
+// loading it again. Builtins are stored by name and re-linked on load.
+// Symbol lookup caches and compiled bytecode are not saved; with
+// vm_enabled, image_load compiles the lambdas afresh.
+
+// Returns 0, having printed why, if the image could not be written.
+int image_save(struct lenv* e, const char* path);
+
+// A new global env holding the builtins and then the image's bindings,
+// or NULL, having printed why, if the image could not be read.
+struct lenv* image_load(const char* path);
+
+#endif // IMAGE_H
@@ -1,5 +1,9 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
 
 #ifdef USE_READLINE
 #include <readline/readline.h>
@@ -9,36 +13,81 @@
 #include "common.h"
 #include "types.h"
 #include "eval.h"
-#include "parser.tab.h"
+#include "fasl.h"
+#include "gc.h"
+#include "image.h"
+#include "mylisp.h"
+#include "out.h"
+#include "profile.h"
+#include "reader.h"
+#include "sample.h"
+#include "vm.h"
 
-extern FILE *yyin;
-extern int yyparse(void);
-extern struct lval* ast_root;
+static double now_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1e6;
+}
+
+// One line on stderr, for bench/run.sh.
+static void print_stats(double start_ms) {
+    struct gc_stats s = gc_get_stats();
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(stderr, "stats wall_ms=%.1f allocs=%li peak_rss_kb=%li gc_collections=%li\n",
+        now_ms() - start_ms, s.allocated, ru.ru_maxrss, s.collections);
+}
 
 int main(int argc, char** argv) {
-    printf("MyLisp Version 0.0.1\n");
-    printf("Press Ctrl+c or type \"quit\" to Exit\n\n");
+    double start_ms = now_ms();
+    out_print("MyLisp Version 0.0.1\n");
+    out_print("Press Ctrl+c or type \"quit\" to Exit\n\n");
 
-    struct lenv* env = lenv_new();
-    lenv_add_builtins(env);
+    char** files = malloc(sizeof(char*) * argc);
+    int nfiles = 0;
+    char* image = NULL;
+    char* save_image = NULL;
+    int stats = 0;
+    int profile = 0;
+    char* samples = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--vm") == 0) { vm_enabled = 1; }
+        else if (strcmp(argv[i], "--no-cache") == 0) { fasl_enabled = 0; }
+        else if (strcmp(argv[i], "--recompile") == 0) { fasl_rebuild = 1; }
+        else if (strcmp(argv[i], "--stats") == 0) { stats = 1; }
+        else if (strcmp(argv[i], "--profile") == 0) { profile = 1; }
+        else if (strncmp(argv[i], "--sample-profile=", 17) == 0) { samples = argv[i] + 17; }
+        else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) { image = argv[++i]; }
+        else if (strcmp(argv[i], "--save-image") == 0 && i + 1 < argc) { save_image = argv[++i]; }
+        else { files[nfiles++] = argv[i]; }
+    }
 
-    if (argc == 1) {
+    struct mylisp* m = image ? mylisp_new_from_image(image) : mylisp_new();
+    if (!m) { free(files); return 1; }
+    mylisp_enter(m);
+    struct lenv* env = mylisp_env(m);
+    if (profile) { profile_begin(); }
+    if (samples) { sample_begin(); }
+
+    if (nfiles == 0) {
+        out_line_buffered = 1;
         while (1) {
             char* input = NULL;
 
 #ifdef USE_READLINE
+            out_flush();
             input = readline("mylisp> ");
             if (!input) {
-                printf("Exiting.\n");
+                out_print("Exiting.\n");
                 break;
             }
             add_history(input);
 #else
             char buffer[2048];
-            printf("mylisp> ");
-            fflush(stdout);
+            out_print("mylisp> ");
+            out_flush();
             if (!fgets(buffer, sizeof(buffer), stdin)) {
-                printf("Exiting.\n");
+                out_print("Exiting.\n");
                 break;
             }
             buffer[strcspn(buffer, "\n")] = 0;
@@ -47,7 +96,7 @@ int main(int argc, char** argv) {
 #endif
 
             if (strcmp(input, "quit") == 0 || strcmp(input, "exit") == 0) {
-                printf("Exiting.\n");
+                out_print("Exiting.\n");
                 free(input);
                 break;
             }
@@ -60,57 +109,64 @@ int main(int argc, char** argv) {
             char* input_with_newline = malloc(strlen(input) + 2);
             sprintf(input_with_newline, "%s\n", input);
 
-            yyin = fmemopen(input_with_newline, strlen(input_with_newline), "r");
-            if (!yyin) {
-                perror("fmemopen failed");
-                free(input);
-                free(input_with_newline);
-                continue;
+            // Evaluate each expression on the line, printing the last
+            // result, or the syntax error that ended the line.
+            struct reader* r = reader_open_mem(input_with_newline, strlen(input_with_newline));
+            struct lval* eval_result = NULL;
+            struct lval* expr;
+            while ((expr = reader_next(r))) {
+                if (eval_result) { lval_del(eval_result); }
+                if (lval_type_of(expr) == LVAL_ERR) {
+                    eval_result = expr;
+                    break;
+                }
+                eval_result = lval_eval(env, expr);
             }
-
-            ast_root = lval_sexpr();
-            int parse_result = yyparse();
-            fclose(yyin);
-            yyin = stdin;
-
+            reader_close(r);
             free(input_with_newline);
 
-            if (parse_result == 0 && ast_root && ast_root->count > 0) {
-                struct lval* eval_result = NULL;
-                for (int i = 0; i < ast_root->count; i++) {
-                    struct lval* expr_to_eval = lval_copy(ast_root->cell[i]);
-                    if (eval_result) { lval_del(eval_result); }
-                    eval_result = lval_eval(env, expr_to_eval);
-                    
-                    if (i == ast_root->count -1) {
-                         lval_println(eval_result);
-                    }
-                    lval_del(eval_result);
-                }
-            } else if (parse_result != 0) {
-                // yyerror already printed a message
-            } else {
-                // No input or parse did not produce a result.
-            }
-            
-            if (ast_root) {
-                lval_del(ast_root);
-                ast_root = NULL;
+            if (eval_result) {
+                lval_println(eval_result);
+                lval_del(eval_result);
             }
             free(input);
         }
+    } else if (nfiles == 1) {
+        struct lval* args = lval_add(lval_sexpr(), lval_str(files[0]));
+        struct lval* result = builtin_load(env, args);
+        if (lval_type_of(result) == LVAL_ERR) {
+            lval_println(result);
+        }
+        lval_del(result);
     } else {
-        for (int i = 1; i < argc; i++) {
-            struct lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
-            struct lval* result = builtin_load(env, args);
-            if (result->type == LVAL_ERR) {
+        // Later files are parsed on other threads while earlier ones run.
+        struct prefetch* p = prefetch_open(files, nfiles);
+        for (int i = 0; i < nfiles; i++) {
+            struct reader* r = prefetch_reader(p, i);
+            struct lval* result = load_forms(env, r);
+            reader_close(r);
+            if (lval_type_of(result) == LVAL_ERR) {
                 lval_println(result);
             }
             lval_del(result);
         }
+        prefetch_close(p);
+    }
+
+    out_flush();
+    if (profile) { profile_end(NULL, stderr); }
+
+    int status = 0;
+    if (samples && !sample_end(samples)) {
+        fprintf(stderr, "Could not write samples to '%s'.\n", samples);
+        status = 1;
     }
+    if (save_image && !image_save(env, save_image)) { status = 1; }
+    if (stats) { print_stats(start_ms); }
 
-    lenv_del(env);
+    mylisp_enter(NULL);
+    mylisp_del(m);
+    free(files);
 
-    return 0;
+    return status;
 }
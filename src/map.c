@@ -0,0 +1,172 @@
+#include "map.h"
+#include "eval.h"
+
+struct map* map_new(void) {
+    return calloc(1, sizeof(struct map));
+}
+
+void map_release(struct map* t) {
+    for (int i = 0; i < t->used; i++) {
+        if (!t->entries[i].key) { continue; }
+        lval_del(t->entries[i].key);
+        lval_del(t->entries[i].val);
+    }
+}
+
+void map_free(struct map* t) {
+    free(t->entries);
+    free(t->slots);
+    free(t);
+}
+
+void map_children(struct map* t, void (*visit)(struct lval*, void*), void* ctx) {
+    for (int i = 0; i < t->used; i++) {
+        struct map_entry* x = &t->entries[i];
+        if (!x->key) { continue; }
+        if (!lval_is_fixnum(x->key)) { visit(x->key, ctx); }
+        if (!lval_is_fixnum(x->val)) { visit(x->val, ctx); }
+    }
+}
+
+struct map_entry* map_entries(struct lval* m) {
+    return m->tab ? m->tab->map->entries : NULL;
+}
+
+// The slot indexing k, or the empty slot where it would go.
+static int map_slot(struct map* t, struct lval* k, unsigned long hash) {
+    int mask = t->nslots - 1;
+    int i = hash & mask;
+    while (t->slots[i] >= 0) {
+        struct map_entry* x = &t->entries[t->slots[i]];
+        if (x->hash == hash && lval_eq(x->key, k)) { break; }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// The index of k among m's entries, or -1. A table holds each key at
+// most once, so an entry past m's end is one m doesn't have.
+static int map_find(struct lval* m, struct lval* k, unsigned long hash) {
+    if (!m->nkeys) { return -1; }
+    int i = m->tab->map->slots[map_slot(m->tab->map, k, hash)];
+    return i < m->nentries ? i : -1;
+}
+
+// Indexes the live entries afresh, in twice as many slots as there is
+// room for entries.
+static void map_reindex(struct map* t) {
+    free(t->slots);
+    t->nslots = 8;
+    while (t->nslots < t->cap * 2) { t->nslots *= 2; }
+    t->slots = malloc(sizeof(int) * t->nslots);
+    memset(t->slots, -1, sizeof(int) * t->nslots);
+    int mask = t->nslots - 1;
+    for (int i = 0; i < t->used; i++) {
+        if (!t->entries[i].key) { continue; }
+        int j = t->entries[i].hash & mask;
+        while (t->slots[j] >= 0) { j = (j + 1) & mask; }
+        t->slots[j] = i;
+    }
+}
+
+// Makes room for a new entry at the end of t. Entries keep their
+// indexes, as the maps sharing t depend on them, unless t is m's alone:
+// then the deleted ones are packed out first.
+static void map_grow(struct lval* m) {
+    struct map* t = m->tab->map;
+    if (m->tab->refs == 1 && m->nkeys < t->used) {
+        int n = 0;
+        for (int i = 0; i < t->used; i++) {
+            if (t->entries[i].key) { t->entries[n++] = t->entries[i]; }
+        }
+        t->used = m->nentries = n;
+        if (n < t->cap) {
+            map_reindex(t);
+            return;
+        }
+    }
+    t->cap = t->cap ? t->cap * 2 : 8;
+    t->entries = realloc(t->entries, sizeof(struct map_entry) * t->cap);
+    map_reindex(t);
+}
+
+// Gives m a table of its own holding just its entries, unless it has
+// one already.
+static void map_own(struct lval* m) {
+    struct lval* old = m->tab;
+    if (old->refs == 1 && m->nentries == old->map->used) { return; }
+
+    struct lval* tab = lval_table();
+    struct map* t = tab->map;
+    t->cap = m->nkeys < 4 ? 8 : m->nkeys * 2;
+    t->entries = malloc(sizeof(struct map_entry) * t->cap);
+    for (int i = 0; i < m->nentries; i++) {
+        struct map_entry* x = &old->map->entries[i];
+        if (!x->key) { continue; }
+        t->entries[t->used++] = (struct map_entry){ lval_copy(x->key), lval_copy(x->val), x->hash };
+    }
+    map_reindex(t);
+    m->tab = tab;
+    m->nentries = t->used;
+    lval_del(old);
+}
+
+struct lval* map_get(struct lval* m, struct lval* k) {
+    int i = map_find(m, k, lval_hash(k));
+    return i >= 0 ? m->tab->map->entries[i].val : NULL;
+}
+
+struct lval* map_put(struct lval* m, struct lval* k, struct lval* v) {
+    m = lval_unshare(m);
+    unsigned long hash = lval_hash(k);
+    if (map_find(m, k, hash) >= 0) {
+        map_own(m);
+        struct map_entry* x = &m->tab->map->entries[map_find(m, k, hash)];
+        lval_del(k);
+        lval_del(x->val);
+        x->val = v;
+        return m;
+    }
+
+    if (!m->tab) { m->tab = lval_table(); }
+    // Only m sees past its end, so it can claim the next entry in place.
+    if (m->nentries != m->tab->map->used) { map_own(m); }
+    struct map* t = m->tab->map;
+    if (t->used == t->cap) { map_grow(m); }
+    int i = t->used++;
+    t->entries[i] = (struct map_entry){ k, v, hash };
+    t->slots[map_slot(t, k, hash)] = i;
+    m->nentries = t->used;
+    m->nkeys++;
+    return m;
+}
+
+struct lval* map_del(struct lval* m, struct lval* k) {
+    unsigned long hash = lval_hash(k);
+    if (map_find(m, k, hash) < 0) { return m; }
+    m = lval_unshare(m);
+    map_own(m);
+
+    struct map* t = m->tab->map;
+    int mask = t->nslots - 1;
+    int s = map_slot(t, k, hash);
+    int i = t->slots[s];
+    lval_del(t->entries[i].key);
+    lval_del(t->entries[i].val);
+    t->entries[i].key = NULL;
+    t->entries[i].val = NULL;
+    m->nkeys--;
+
+    // Move later entries of the probe run back into the gap, so that
+    // lookups need no tombstones. One stays put if its home slot is
+    // cyclically in (s, j].
+    for (int j = (s + 1) & mask; t->slots[j] >= 0; j = (j + 1) & mask) {
+        int home = t->entries[t->slots[j]].hash & mask;
+        int stays = s <= j ? (s < home && home <= j) : (s < home || home <= j);
+        if (stays) { continue; }
+        t->slots[s] = t->slots[j];
+        s = j;
+    }
+    t->slots[s] = -1;
+    return m;
+}
@@ -0,0 +1,48 @@
+#ifndef MAP_H
+#define MAP_H
+
+#include "types.h"
+
+// Hash maps. Keys may be of any type, compared with lval_eq and hashed
+// with lval_hash.
+//
+// An LVAL_MAP is a view of the first nentries entries of a table, an
+// LVAL_TABLE that other maps may share, holding nkeys keys. Entries are
+// kept in the order they were put, and a deleted entry has a NULL key;
+// slots is an open-addressed index of the live entries, -1 when empty.
+// Like lists, maps are values: map_put and map_del take a private copy
+// of a shared map first. A put of a new key into a map that ends at the
+// end of its table appends in place, though, as the maps sharing the
+// table don't see past their own ends; so building a map up one key at
+// a time is not quadratic.
+struct map_entry {
+    struct lval* key;
+    struct lval* val;
+    unsigned long hash;
+};
+
+struct map {
+    struct map_entry* entries;
+    int used;
+    int cap;
+    int* slots;
+    int nslots;
+};
+
+struct map* map_new(void);
+// Drops the references the table holds; map_free frees its storage.
+void map_release(struct map* t);
+void map_free(struct map* t);
+void map_children(struct map* t, void (*visit)(struct lval*, void*), void* ctx);
+
+// The first of m's entries; those up to m->nentries with a key are live.
+struct map_entry* map_entries(struct lval* m);
+
+// The value of k in m, still owned by m, or NULL.
+struct lval* map_get(struct lval* m, struct lval* k);
+// m with k bound to v, replacing any value it had. Consumes m, k and v.
+struct lval* map_put(struct lval* m, struct lval* k, struct lval* v);
+// m without k. Consumes m.
+struct lval* map_del(struct lval* m, struct lval* k);
+
+#endif // MAP_H
@@ -0,0 +1,178 @@
+#include "memo.h"
+#include "eval.h"
+
+struct memo* memo_new(struct lval* f, int limit) {
+    struct memo* m = calloc(1, sizeof(struct memo));
+    m->f = f;
+    m->limit = limit;
+    m->nslots = 16;
+    m->slots = malloc(sizeof(int) * m->nslots);
+    memset(m->slots, -1, sizeof(int) * m->nslots);
+    m->head = m->tail = -1;
+    return m;
+}
+
+void memo_release(struct memo* m) {
+    lval_del(m->f);
+    for (int i = 0; i < m->count; i++) {
+        lval_del(m->entries[i].args);
+        lval_del(m->entries[i].result);
+    }
+}
+
+void memo_free(struct memo* m) {
+    free(m->entries);
+    free(m->slots);
+    free(m);
+}
+
+void memo_children(struct memo* m, void (*visit)(struct lval*, void*), void* ctx) {
+    if (!lval_is_fixnum(m->f)) { visit(m->f, ctx); }
+    for (int i = 0; i < m->count; i++) {
+        visit(m->entries[i].args, ctx);
+        if (!lval_is_fixnum(m->entries[i].result)) { visit(m->entries[i].result, ctx); }
+    }
+}
+
+// The slot holding the entry for args, or the empty slot where it goes.
+static int memo_slot(struct memo* m, struct lval* args, unsigned long hash) {
+    int mask = m->nslots - 1;
+    int i = hash & mask;
+    while (m->slots[i] >= 0) {
+        struct memo_entry* x = &m->entries[m->slots[i]];
+        if (x->hash == hash && lval_eq(x->args, args)) { break; }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static int memo_slot_of(struct memo* m, int entry) {
+    int mask = m->nslots - 1;
+    int i = m->entries[entry].hash & mask;
+    while (m->slots[i] != entry) { i = (i + 1) & mask; }
+    return i;
+}
+
+// Empties slot i, moving later entries of its probe run back into the
+// gap, so that lookups need no tombstones.
+static void memo_unslot(struct memo* m, int i) {
+    int mask = m->nslots - 1;
+    for (int j = (i + 1) & mask; m->slots[j] >= 0; j = (j + 1) & mask) {
+        int home = m->entries[m->slots[j]].hash & mask;
+        // An entry stays put if its home is cyclically in (i, j].
+        int stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (stays) { continue; }
+        m->slots[i] = m->slots[j];
+        i = j;
+    }
+    m->slots[i] = -1;
+}
+
+static void memo_unlink(struct memo* m, int i) {
+    struct memo_entry* x = &m->entries[i];
+    if (x->prev >= 0) { m->entries[x->prev].next = x->next; } else { m->head = x->next; }
+    if (x->next >= 0) { m->entries[x->next].prev = x->prev; } else { m->tail = x->prev; }
+}
+
+static void memo_push_front(struct memo* m, int i) {
+    struct memo_entry* x = &m->entries[i];
+    x->prev = -1;
+    x->next = m->head;
+    if (m->head >= 0) { m->entries[m->head].prev = i; } else { m->tail = i; }
+    m->head = i;
+}
+
+// Frees up the least recently used entry, and returns its index.
+static int memo_evict(struct memo* m) {
+    int i = m->tail;
+    memo_unslot(m, memo_slot_of(m, i));
+    memo_unlink(m, i);
+    lval_del(m->entries[i].args);
+    lval_del(m->entries[i].result);
+    return i;
+}
+
+static void memo_grow_slots(struct memo* m) {
+    free(m->slots);
+    m->nslots *= 2;
+    m->slots = malloc(sizeof(int) * m->nslots);
+    memset(m->slots, -1, sizeof(int) * m->nslots);
+    for (int i = 0; i < m->count; i++) {
+        m->slots[memo_slot(m, m->entries[i].args, m->entries[i].hash)] = i;
+    }
+}
+
+// Caches result for args, which must not be in the cache. Consumes both.
+static void memo_add(struct memo* m, struct lval* args, unsigned long hash, struct lval* result) {
+    int i;
+    if (m->count == m->limit) {
+        i = memo_evict(m);
+    } else {
+        if (m->count == m->cap) {
+            m->cap = m->cap ? m->cap * 2 : 16;
+            if (m->cap > m->limit) { m->cap = m->limit; }
+            m->entries = realloc(m->entries, sizeof(struct memo_entry) * m->cap);
+        }
+        i = m->count++;
+        if (m->count * 2 > m->nslots) { memo_grow_slots(m); }
+    }
+    m->entries[i].args = args;
+    m->entries[i].result = result;
+    m->entries[i].hash = hash;
+    m->slots[memo_slot(m, args, hash)] = i;
+    memo_push_front(m, i);
+}
+
+struct lval* lval_memoize(struct lval* f, int limit) {
+    struct lval* formals = lval_qexpr();
+    lval_add(formals, lval_sym("&"));
+    lval_add(formals, lval_sym("args"));
+
+    struct lval* body = lval_qexpr();
+    lval_add(body, lval_builtin(builtin_memo_call));
+    lval_add(body, lval_memo(f, limit));
+    lval_add(body, lval_sym("args"));
+    return lval_lambda(formals, body);
+}
+
+struct memo* memo_of(struct lval* f) {
+    if (lval_type_of(f) != LVAL_FUN || f->builtin) { return NULL; }
+    struct lval* b = f->body;
+    if (b->count != 3 || lval_type_of(b->cell[0]) != LVAL_FUN || b->cell[0]->builtin != builtin_memo_call
+        || lval_type_of(b->cell[1]) != LVAL_MEMO) {
+        return NULL;
+    }
+    return b->cell[1]->memo;
+}
+
+struct lval* memo_call(struct lenv* e, struct memo* m, struct lval* args) {
+    unsigned long hash = lval_hash(args);
+    int i = m->slots[memo_slot(m, args, hash)];
+    if (i >= 0) {
+        m->hits++;
+        if (m->head != i) {
+            memo_unlink(m, i);
+            memo_push_front(m, i);
+        }
+        lval_del(args);
+        return lval_copy(m->entries[i].result);
+    }
+
+    m->misses++;
+    struct lval* r = lval_call(e, lval_copy(m->f), lval_unshare(lval_copy(args)));
+    if (lval_type_of(r) == LVAL_ERR) {
+        lval_del(args);
+        return r;
+    }
+    // The call may have filled the cache meanwhile, this entry included
+    // if f is not pure.
+    i = m->slots[memo_slot(m, args, hash)];
+    if (i >= 0) {
+        lval_del(m->entries[i].result);
+        m->entries[i].result = lval_copy(r);
+        lval_del(args);
+    } else {
+        memo_add(m, args, hash, lval_copy(r));
+    }
+    return r;
+}
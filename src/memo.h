@@ -0,0 +1,56 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include "types.h"
+
+#define MEMO_DEFAULT_LIMIT 1024
+
+// The cache of a memoized function: the results f has returned, keyed
+// on the argument lists it was called with (compared with lval_eq, and
+// hashed with lval_hash), holding at most limit of them. Once full, the
+// least recently used entry makes room for a new one. Errors are not
+// cached.
+//
+// (memoize f) is a lambda of any number of arguments whose body is
+// (memo-call M args), with the LVAL_MEMO M in the body itself, so it
+// runs, prints and is copied like any other lambda.
+struct memo_entry {
+    struct lval* args;
+    struct lval* result;
+    unsigned long hash;
+    int prev;  // towards the most recently used, or -1
+    int next;  // towards the least recently used, or -1
+};
+
+struct memo {
+    struct lval* f;
+    int limit;
+    long hits;
+    long misses;
+
+    struct memo_entry* entries;
+    int count;
+    int cap;
+    int* slots;  // open-addressed indexes into entries, -1 when empty
+    int nslots;
+    int head;    // most recently used, or -1
+    int tail;    // least recently used, or -1
+};
+
+struct memo* memo_new(struct lval* f, int limit);
+// Drops the references the cache holds; memo_free frees its storage.
+void memo_release(struct memo* m);
+void memo_free(struct memo* m);
+void memo_children(struct memo* m, void (*visit)(struct lval*, void*), void* ctx);
+
+// A memoized lambda of f. Consumes f.
+struct lval* lval_memoize(struct lval* f, int limit);
+
+// The cache of f, if f is a lambda that lval_memoize made.
+struct memo* memo_of(struct lval* f);
+
+// The result of m's function on the arguments in the Q-Expression args,
+// from the cache or by calling it in e. Consumes args.
+struct lval* memo_call(struct lenv* e, struct memo* m, struct lval* args);
+
+#endif // MEMO_H
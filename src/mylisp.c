@@ -0,0 +1,88 @@
+#include "context.h"
+#include "eval.h"
+#include "image.h"
+#include "reader.h"
+
+static __thread struct mylisp* current = NULL;
+
+static struct mylisp* mylisp_alloc(void) {
+    struct mylisp* m = calloc(1, sizeof(struct mylisp));
+    m->heap = gc_heap_new();
+    return m;
+}
+
+struct mylisp* mylisp_new(void) {
+    struct mylisp* m = mylisp_alloc();
+    struct mylisp* prev = mylisp_enter(m);
+    m->env = lenv_new();
+    lenv_add_builtins(m->env);
+    mylisp_enter(prev);
+    return m;
+}
+
+struct mylisp* mylisp_new_from_image(const char* path) {
+    struct mylisp* m = mylisp_alloc();
+    struct mylisp* prev = mylisp_enter(m);
+    m->env = image_load(path);
+    mylisp_enter(prev);
+    if (!m->env) {
+        mylisp_del(m);
+        return NULL;
+    }
+    return m;
+}
+
+struct mylisp* mylisp_new_worker(void) {
+    struct mylisp* m = mylisp_alloc();
+    m->worker = 1;
+    return m;
+}
+
+void mylisp_del(struct mylisp* m) {
+    // The pool's workers are contexts of their own, with nothing left
+    // on their heaps between jobs.
+    if (m->pool) { pmap_pool_del(m->pool); }
+
+    struct mylisp* prev = mylisp_enter(m);
+    if (m->env) { lenv_del(m->env); }
+    mylisp_enter(prev == m ? NULL : prev);
+    gc_heap_del(m->heap);
+    free(m);
+}
+
+struct mylisp* mylisp_enter(struct mylisp* m) {
+    struct mylisp* prev = current;
+    current = m;
+    gc_enter(m ? m->heap : NULL);
+    return prev;
+}
+
+struct mylisp* mylisp_current(void) {
+    return current;
+}
+
+struct lenv* mylisp_env(struct mylisp* m) {
+    return m->env;
+}
+
+struct lval* mylisp_eval_string(struct mylisp* m, const char* src) {
+    struct mylisp* prev = mylisp_enter(m);
+    struct reader* r = reader_open_mem(src, strlen(src));
+    struct lval* result = load_forms(m->env, r);
+    reader_close(r);
+    mylisp_enter(prev);
+    return result;
+}
+
+struct lval* mylisp_eval_file(struct mylisp* m, const char* path) {
+    struct mylisp* prev = mylisp_enter(m);
+    struct lval* result = builtin_load(m->env, lval_add(lval_sexpr(), lval_str((char*)path)));
+    mylisp_enter(prev);
+    return result;
+}
+
+void mylisp_release(struct mylisp* m, struct lval* v) {
+    struct mylisp* prev = mylisp_enter(m);
+    lval_del(v);
+    mylisp_enter(prev);
+}
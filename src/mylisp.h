@@ -0,0 +1,44 @@
+#ifndef MYLISP_H
+#define MYLISP_H
+
+#include "types.h"
+
+// The embedding API, built as libmylisp (make lib).
+//
+// An interpreter context owns a global env and the heap its values live
+// on; contexts share nothing but the symbol table, so each can run on a
+// thread of its own. A thread evaluates in the context it has entered,
+// and a context must not be entered on two threads at once. Values
+// belong to the context that made them: pass them to another only by
+// printing them or reading them back in.
+//
+// The process-wide switches (vm_enabled, fasl_enabled, fasl_rebuild)
+// apply to every context, and are meant to be set before the first is
+// made.
+struct mylisp;
+
+// A context with the builtins bound, or with a heap image (see image.h)
+// loaded on top of them. NULL, having printed why, if the image could
+// not be read.
+struct mylisp* mylisp_new(void);
+struct mylisp* mylisp_new_from_image(const char* path);
+
+// Frees m and all its values. m must not be entered on another thread.
+void mylisp_del(struct mylisp* m);
+
+// Makes m (or no context, for NULL) the one the calling thread
+// evaluates in, and returns the one it was in before. Needed only to
+// work on m's values directly; the calls below enter m themselves.
+struct mylisp* mylisp_enter(struct mylisp* m);
+
+struct lenv* mylisp_env(struct mylisp* m);
+
+// Evaluates each form of src, or of the file at path, as load does,
+// and returns the last result or the first error. The result belongs
+// to m; free it with mylisp_release.
+struct lval* mylisp_eval_string(struct mylisp* m, const char* src);
+struct lval* mylisp_eval_file(struct mylisp* m, const char* path);
+
+void mylisp_release(struct mylisp* m, struct lval* v);
+
+#endif // MYLISP_H
@@ -0,0 +1,128 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "out.h"
+
+// Standard output is written out once this much has built up.
+#define OUT_BLOCK (64 * 1024)
+
+void out_init(struct outbuf* b) {
+    b->data = b->small;
+    b->len = 0;
+    b->cap = OUT_SMALL;
+}
+
+void out_free(struct outbuf* b) {
+    if (b->data != b->small) { free(b->data); }
+    out_init(b);
+}
+
+void out_reserve(struct outbuf* b, size_t n) {
+    if (b->len + n <= b->cap) { return; }
+    size_t cap = b->cap * 2;
+    while (cap < b->len + n) { cap *= 2; }
+    if (b->data == b->small) {
+        b->data = malloc(cap);
+        memcpy(b->data, b->small, b->len);
+    } else {
+        b->data = realloc(b->data, cap);
+    }
+    b->cap = cap;
+}
+
+void out_bytes(struct outbuf* b, const char* s, size_t n) {
+    out_reserve(b, n);
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+void out_cstr(struct outbuf* b, const char* s) {
+    out_bytes(b, s, strlen(s));
+}
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Two digits per division, from the right.
+void out_long(struct outbuf* b, long x) {
+    char tmp[24];
+    char* p = tmp + sizeof(tmp);
+    unsigned long u = x < 0 ? -(unsigned long)x : (unsigned long)x;
+    while (u >= 100) {
+        const char* d = &digit_pairs[(u % 100) * 2];
+        u /= 100;
+        *--p = d[1];
+        *--p = d[0];
+    }
+    if (u >= 10) {
+        *--p = digit_pairs[u * 2 + 1];
+        *--p = digit_pairs[u * 2];
+    } else {
+        *--p = '0' + u;
+    }
+    if (x < 0) { *--p = '-'; }
+    out_bytes(b, p, tmp + sizeof(tmp) - p);
+}
+
+void out_printf(struct outbuf* b, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) { return; }
+    if ((size_t)n >= b->cap - b->len) {
+        out_reserve(b, n + 1);
+        va_start(ap, fmt);
+        vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+        va_end(ap);
+    }
+    b->len += n;
+}
+
+/* Standard output */
+
+// -1 until the first write decides it.
+int out_line_buffered = -1;
+
+static struct outbuf out_stdout;
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t out_once = PTHREAD_ONCE_INIT;
+
+static void out_stdout_init(void) {
+    out_init(&out_stdout);
+    if (out_line_buffered < 0) { out_line_buffered = isatty(STDOUT_FILENO); }
+    atexit(out_flush);
+}
+
+static void out_flush_locked(void) {
+    if (!out_stdout.len) { return; }
+    fwrite(out_stdout.data, 1, out_stdout.len, stdout);
+    fflush(stdout);
+    out_stdout.len = 0;
+}
+
+void out_write(const char* s, size_t n) {
+    pthread_once(&out_once, out_stdout_init);
+    pthread_mutex_lock(&out_lock);
+    out_bytes(&out_stdout, s, n);
+    if (out_stdout.len >= OUT_BLOCK || (out_line_buffered > 0 && memchr(s, '\n', n))) {
+        out_flush_locked();
+    }
+    pthread_mutex_unlock(&out_lock);
+}
+
+void out_print(const char* s) {
+    out_write(s, strlen(s));
+}
+
+void out_flush(void) {
+    pthread_once(&out_once, out_stdout_init);
+    pthread_mutex_lock(&out_lock);
+    out_flush_locked();
+    pthread_mutex_unlock(&out_lock);
+}
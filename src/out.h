@@ -0,0 +1,49 @@
+#ifndef OUT_H
+#define OUT_H
+
+#include <stddef.h>
+
+// Output buffers. lval_write renders values into a struct outbuf, which
+// starts in the bytes inside it and grows on the heap; print renders a
+// whole line that way, then hands it to the standard output buffer in
+// one piece.
+//
+// Standard output is buffered here rather than by stdio, and written
+// out in large blocks: when the buffer fills, at exit, and by out_flush.
+// When it is line buffered (the REPL, or a terminal), it is also
+// written out at the end of each line. Anything else that writes to
+// stdout must go through out_write, or call out_flush first.
+
+#define OUT_SMALL 256
+
+struct outbuf {
+    char* data;
+    size_t len;
+    size_t cap;
+    char small[OUT_SMALL];
+};
+
+void out_init(struct outbuf* b);
+void out_free(struct outbuf* b);
+// Makes room for n more bytes.
+void out_reserve(struct outbuf* b, size_t n);
+
+static inline void out_char(struct outbuf* b, char c) {
+    if (b->len == b->cap) { out_reserve(b, 1); }
+    b->data[b->len++] = c;
+}
+
+void out_bytes(struct outbuf* b, const char* s, size_t n);
+void out_cstr(struct outbuf* b, const char* s);
+void out_long(struct outbuf* b, long x);
+void out_printf(struct outbuf* b, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Set by main for the REPL; otherwise, whether stdout is a terminal.
+extern int out_line_buffered;
+
+// Appends n bytes to standard output. Safe to call from any thread.
+void out_write(const char* s, size_t n);
+void out_print(const char* s);
+void out_flush(void);
+
+#endif // OUT_H
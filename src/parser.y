@@ -1,19 +1,36 @@
-%{
-#include <stdio.h>
-#include <stdlib.h>
+%code requires {
 #include "types.h"
 
-int yylex(void);
-void yyerror(const char *s);
-extern int yylineno;
-extern char* yytext;
+// The scanner's state, as flex's reentrant scanner declares it.
+#ifndef YY_TYPEDEF_YY_SCANNER_T
+#define YY_TYPEDEF_YY_SCANNER_T
+typedef void* yyscan_t;
+#endif
+}
+
+%code provides {
+void yyerror(yyscan_t scanner, struct lval** form, const char* s);
+}
+
+%code {
+#include <stdio.h>
+#include <stdlib.h>
 
-struct lval* ast_root = NULL;
+int yylex(YYSTYPE* lvalp, yyscan_t scanner);
+int yyget_lineno(yyscan_t scanner);
+char* yyget_text(yyscan_t scanner);
+}
 
-%}
+// Pure: all of a parse's state is in its scanner and the caller's form,
+// so any number of parses can be in progress at once, on any threads.
+%define api.pure full
+%lex-param {yyscan_t scanner}
+%parse-param {yyscan_t scanner} {struct lval** form}
 
 %union {
     struct lval* val;
+    long num;
+    char* sym;
     char* str;
 }
 
@@ -23,18 +40,28 @@ struct lval* ast_root = NULL;
 %token LPAREN RPAREN LBRACE RBRACE QUOTE
 %token NEWLINE UNKNOWN_TOKEN YYEOF
 
-%type <val> program expr sexpr qexpr list items item
+%type <val> expr sexpr qexpr list items item
+
+%destructor { lval_del($$); } <val>
+%destructor { free($$); } <sym> <str>
 
 // %left '+' '-'
 // %left '*' '/'
 
 %%
 
-program:
-    /* empty */         { $$ = lval_sexpr(); ast_root = $$; } 
-    | program expr NEWLINE { ast_root = lval_add($1, $2); $$ = ast_root; }
-    | program expr YYEOF  { ast_root = lval_add($1, $2); $$ = ast_root; }
-    | program NEWLINE   { $$ = $1; }
+// A parse reads one top-level form and stops, leaving it in *form, or
+// NULL at the end of the input, so that a reader can evaluate each
+// form before reading the next.
+form:
+    blank expr NEWLINE  { *form = $2; YYACCEPT; }
+    | blank expr YYEOF  { *form = $2; YYACCEPT; }
+    | blank YYEOF       { *form = NULL; YYACCEPT; }
+    ;
+
+blank:
+    /* empty */
+    | blank NEWLINE
     ;
 
 expr:
@@ -46,16 +73,17 @@ expr:
                           struct lval* s = lval_sexpr();
                           s = lval_add(s, q);
                           s = lval_add(s, $2);
+                          s->line = yyget_lineno(scanner);
                           $$ = s;
                         }
     ;
 
 sexpr: 
-    LPAREN list RPAREN  { $$ = $2; $$->type = LVAL_SEXPR; } 
+    LPAREN list RPAREN  { $$ = $2; $$->type = LVAL_SEXPR; $$->line = yyget_lineno(scanner); }
     ;
 
 qexpr:
-    LBRACE list RBRACE  { $$ = $2; $$->type = LVAL_QEXPR; }
+    LBRACE list RBRACE  { $$ = $2; $$->type = LVAL_QEXPR; $$->line = yyget_lineno(scanner); }
     ;
 
 list:
@@ -76,6 +104,10 @@ item:
 
 %%
 
-void yyerror(const char *s) {
-    fprintf(stderr, "Parse Error (line %d near '%s'): %s\n", yylineno, yytext, s);
+// Leaves the first error in *form rather than printing it, so that
+// whoever reads the form reports it, in order with the rest of the
+// output, even when the parse ran ahead on another thread.
+void yyerror(yyscan_t scanner, struct lval** form, const char* s) {
+    if (*form) { return; }
+    *form = lval_err("line %d near '%s': %s", yyget_lineno(scanner), yyget_text(scanner), s);
 }
@@ -0,0 +1,599 @@
+#define _POSIX_C_SOURCE 200809L // sysconf
+
+#include <pthread.h>
+#include <unistd.h>
+#include "pmap.h"
+#include "context.h"
+#include "eval.h"
+#include "map.h"
+#include "memo.h"
+#include "vm.h"
+
+/* Copying between contexts */
+
+// Maps values to their copies, holding a reference to each copy, so
+// that structure shared within a value is copied once, and a lambda
+// that reaches itself through its env is copied as such. With NULL
+// copies it serves as a set.
+struct copy_map {
+    const void** keys;
+    struct lval** vals;
+    int count;
+    int cap;
+};
+
+static int copy_map_slot(struct copy_map* m, const void* key) {
+    unsigned long h = (unsigned long)(uintptr_t)key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    int i = h & (m->cap - 1);
+    while (m->keys[i] && m->keys[i] != key) { i = (i + 1) & (m->cap - 1); }
+    return i;
+}
+
+static int copy_map_get(struct copy_map* m, const void* key, struct lval** val) {
+    if (!m->count) { return 0; }
+    int i = copy_map_slot(m, key);
+    if (!m->keys[i]) { return 0; }
+    if (val) { *val = m->vals[i]; }
+    return 1;
+}
+
+static void copy_map_put(struct copy_map* m, const void* key, struct lval* val) {
+    if ((m->count + 1) * 2 > m->cap) {
+        struct copy_map old = *m;
+        m->cap = old.cap ? old.cap * 2 : 16;
+        m->keys = calloc(m->cap, sizeof(void*));
+        m->vals = malloc(sizeof(struct lval*) * m->cap);
+        for (int i = 0; i < old.cap; i++) {
+            if (!old.keys[i]) { continue; }
+            int j = copy_map_slot(m, old.keys[i]);
+            m->keys[j] = old.keys[i];
+            m->vals[j] = old.vals[i];
+        }
+        free(old.keys);
+        free(old.vals);
+    }
+    int i = copy_map_slot(m, key);
+    m->keys[i] = key;
+    m->vals[i] = val;
+    m->count++;
+}
+
+// Drops the copies, on the heap they were made on.
+static void copy_map_clear(struct copy_map* m) {
+    if (!m->count) { return; }
+    for (int i = 0; i < m->cap; i++) {
+        if (m->keys[i] && m->vals[i]) { lval_del(m->vals[i]); }
+    }
+    if (m->cap > 64) {
+        free(m->keys);
+        free(m->vals);
+        m->keys = NULL;
+        m->vals = NULL;
+        m->cap = 0;
+    } else {
+        memset(m->keys, 0, sizeof(void*) * m->cap);
+    }
+    m->count = 0;
+}
+
+// Copies v, a value of another context that is not running, onto the
+// current heap. v is only read, never so much as referenced, so any
+// number of threads may copy from it at once.
+static struct lval* lval_copy_across(struct lval* v, struct copy_map* m) {
+    if (lval_is_fixnum(v)) { return v; }
+    switch (v->type) {
+        case LVAL_NUM: return lval_num(v->num);
+        case LVAL_ERR: return lval_err("%s", v->err);
+        case LVAL_SYM: return lval_sym(v->sym);
+        case LVAL_STR: return lval_str_n(v->str, v->slen);
+        default: break;
+    }
+
+    struct lval* x;
+    if (copy_map_get(m, v, &x)) { return lval_copy(x); }
+    switch (v->type) {
+        case LVAL_FUN:
+            if (v->builtin) {
+                x = lval_builtin(v->builtin);
+                break;
+            }
+            x = lval_lambda(NULL, NULL);
+            copy_map_put(m, v, lval_copy(x));
+            x->formals = lval_copy_across(v->formals, m);
+            // The bytecode is cached on the body, so give the lambda its
+            // own, as builtin_lambda does.
+            x->body = lval_unshare(lval_copy_across(v->body, m));
+            for (int i = 0; i < v->env->cap; i++) {
+                if (!v->env->syms[i]) { continue; }
+                struct lval* k = lval_sym(v->env->syms[i]);
+                struct lval* c = lval_copy_across(v->env->vals[i], m);
+                lenv_put(x->env, k, c);
+                lval_del(k);
+                lval_del(c);
+            }
+            if (vm_enabled) { x->body->code = vm_compile(x->formals, x->body, x->env); }
+            return x;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            x = v->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+            x->line = v->line;
+            for (int i = 0; i < v->count; i++) { lval_add(x, lval_copy_across(v->cell[i], m)); }
+            break;
+        case LVAL_VEC:
+            x = lval_vec(v->len);
+            if (v->len) { memcpy(x->data, v->data, sizeof(int64_t) * v->len); }
+            break;
+        case LVAL_MAP:
+            x = lval_map();
+            for (int i = 0; i < v->nentries; i++) {
+                struct map_entry* y = &map_entries(v)[i];
+                if (y->key) { x = map_put(x, lval_copy_across(y->key, m), lval_copy_across(y->val, m)); }
+            }
+            break;
+        case LVAL_MEMO:
+            // Each context caches on its own.
+            x = lval_memo(lval_copy_across(v->memo->f, m), v->memo->limit);
+            break;
+        default:
+            return lval_err("Cannot copy a %s between contexts", ltype_name(v->type));
+    }
+    copy_map_put(m, v, lval_copy(x));
+    return x;
+}
+
+/* Pool */
+
+// A run of consecutive elements that one worker has folded.
+struct pmap_run {
+    long start;
+    long end;
+    struct lval* acc;
+};
+
+struct pmap_job {
+    struct lval* f;
+    struct lval* q;
+    int reduce;
+
+    // The caller's globals that f and q mention, transitively.
+    char** syms;
+    struct lval** vals;
+    int nglobals;
+    int globals_cap;
+
+    struct lval** results;  // pmap: each element's, on its worker's heap
+    long err_at;            // the first element f failed on, or q->count
+};
+
+struct pmap_worker {
+    struct pmap_pool* pool;
+    struct mylisp* ctx;
+    pthread_t thread;
+
+    // The elements [lo, hi) still to be taken: by this worker from the
+    // bottom, and by others from the top.
+    pthread_mutex_t lock;
+    long lo;
+    long hi;
+
+    // Held on ctx's heap until the caller has copied the results.
+    struct lval* f;
+    struct lval** held;
+    long nheld;
+    long held_cap;
+    struct pmap_run* runs;
+    long nruns;
+    long runs_cap;
+};
+
+// The workers wait on cond for a job, the caller for them to finish it
+// (done), and the workers again for the caller to release their results.
+struct pmap_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct pmap_worker* workers;
+    int nworkers;
+    struct pmap_job* job;
+    unsigned long job_id;
+    unsigned long released;
+    int done;
+    int quit;
+};
+
+// The next element for w, or -1 once every range is empty.
+static long pmap_take(struct pmap_pool* p, struct pmap_worker* w) {
+    pthread_mutex_lock(&w->lock);
+    if (w->lo < w->hi) {
+        long i = w->lo++;
+        pthread_mutex_unlock(&w->lock);
+        return i;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    int self = w - p->workers;
+    for (int k = 1; k < p->nworkers; k++) {
+        struct pmap_worker* v = &p->workers[(self + k) % p->nworkers];
+        pthread_mutex_lock(&v->lock);
+        long lo = v->lo;
+        long hi = v->hi;
+        if (lo < hi) {
+            long mid = lo + (hi - lo) / 2;
+            v->hi = mid;
+            pthread_mutex_unlock(&v->lock);
+            pthread_mutex_lock(&w->lock);
+            w->lo = mid + 1;
+            w->hi = hi;
+            pthread_mutex_unlock(&w->lock);
+            return mid;
+        }
+        pthread_mutex_unlock(&v->lock);
+    }
+    return -1;
+}
+
+static void pmap_fail(struct pmap_pool* p, struct pmap_job* job, long i) {
+    pthread_mutex_lock(&p->lock);
+    if (i < job->err_at) { __atomic_store_n(&job->err_at, i, __ATOMIC_RELAXED); }
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void pmap_hold(struct pmap_worker* w, struct lval* v) {
+    if (w->nheld == w->held_cap) {
+        w->held_cap = w->held_cap ? w->held_cap * 2 : 64;
+        w->held = realloc(w->held, sizeof(struct lval*) * w->held_cap);
+    }
+    w->held[w->nheld++] = v;
+}
+
+static void pmap_work(struct pmap_worker* w, struct pmap_job* job) {
+    struct pmap_pool* p = w->pool;
+    struct lenv* env = lenv_new();
+    lenv_add_builtins(env);
+    w->ctx->env = env;
+
+    struct copy_map m = { 0 };
+    for (int i = 0; i < job->nglobals; i++) {
+        struct lval* k = lval_sym(job->syms[i]);
+        struct lval* v = lval_copy_across(job->vals[i], &m);
+        lenv_put(env, k, v);
+        lval_del(k);
+        lval_del(v);
+    }
+    w->f = lval_copy_across(job->f, &m);
+    copy_map_clear(&m);
+
+    long i;
+    while ((i = pmap_take(p, w)) >= 0) {
+        // Elements after one that failed are not needed.
+        if (i > __atomic_load_n(&job->err_at, __ATOMIC_RELAXED)) { continue; }
+        struct lval* x = lval_copy_across(job->q->cell[i], &m);
+        copy_map_clear(&m);
+
+        struct lval* r;
+        if (!job->reduce) {
+            r = lval_call(env, lval_copy(w->f), lval_add(lval_sexpr(), x));
+            job->results[i] = r;
+            pmap_hold(w, r);
+        } else if (w->nruns && w->runs[w->nruns - 1].end == i) {
+            struct pmap_run* run = &w->runs[w->nruns - 1];
+            struct lval* a = lval_add(lval_add(lval_sexpr(), run->acc), x);
+            run->acc = NULL;
+            r = run->acc = lval_call(env, lval_copy(w->f), a);
+            run->end++;
+        } else {
+            if (w->nruns == w->runs_cap) {
+                w->runs_cap = w->runs_cap ? w->runs_cap * 2 : 16;
+                w->runs = realloc(w->runs, sizeof(struct pmap_run) * w->runs_cap);
+            }
+            w->runs[w->nruns++] = (struct pmap_run){ i, i + 1, x };
+            r = x;
+        }
+        if (lval_type_of(r) == LVAL_ERR) { pmap_fail(p, job, i); }
+    }
+    free(m.keys);
+    free(m.vals);
+}
+
+// Frees what w made for the job, once the caller has copied it.
+static void pmap_release(struct pmap_worker* w) {
+    for (long i = 0; i < w->nheld; i++) { lval_del(w->held[i]); }
+    for (long i = 0; i < w->nruns; i++) { lval_del(w->runs[i].acc); }
+    w->nheld = 0;
+    w->nruns = 0;
+    lval_del(w->f);
+    w->f = NULL;
+    lenv_del(w->ctx->env);
+    w->ctx->env = NULL;
+}
+
+static void* pmap_thread(void* arg) {
+    struct pmap_worker* w = arg;
+    struct pmap_pool* p = w->pool;
+    mylisp_enter(w->ctx);
+
+    unsigned long seen = 0;
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (p->job_id == seen && !p->quit) { pthread_cond_wait(&p->cond, &p->lock); }
+        if (p->quit) { break; }
+        seen = p->job_id;
+        struct pmap_job* job = p->job;
+        pthread_mutex_unlock(&p->lock);
+
+        pmap_work(w, job);
+
+        pthread_mutex_lock(&p->lock);
+        p->done++;
+        pthread_cond_broadcast(&p->cond);
+        while (p->released != seen) { pthread_cond_wait(&p->cond, &p->lock); }
+        pthread_mutex_unlock(&p->lock);
+
+        pmap_release(w);
+        pthread_mutex_lock(&p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    mylisp_enter(NULL);
+    return NULL;
+}
+
+static struct pmap_pool* pmap_pool_new(void) {
+    struct pmap_pool* p = calloc(1, sizeof(struct pmap_pool));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    // One core gains nothing from a worker.
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = cpus > 1 ? cpus : 0;
+    p->workers = calloc(n ? n : 1, sizeof(struct pmap_worker));
+    for (int i = 0; i < n; i++) {
+        struct pmap_worker* w = &p->workers[i];
+        w->pool = p;
+        w->ctx = mylisp_new_worker();
+        pthread_mutex_init(&w->lock, NULL);
+        if (pthread_create(&w->thread, NULL, pmap_thread, w) != 0) {
+            mylisp_del(w->ctx);
+            pthread_mutex_destroy(&w->lock);
+            break;
+        }
+        p->nworkers++;
+    }
+    return p;
+}
+
+void pmap_pool_del(struct pmap_pool* p) {
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    for (int i = 0; i < p->nworkers; i++) {
+        struct pmap_worker* w = &p->workers[i];
+        pthread_join(w->thread, NULL);
+        mylisp_del(w->ctx);
+        pthread_mutex_destroy(&w->lock);
+        free(w->held);
+        free(w->runs);
+    }
+    free(p->workers);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+// The calling context's pool, or NULL to run sequentially.
+static struct pmap_pool* pmap_pool_get(void) {
+    struct mylisp* m = mylisp_current();
+    if (!m || m->worker) { return NULL; }
+    if (!m->pool) { m->pool = pmap_pool_new(); }
+    return m->pool->nworkers ? m->pool : NULL;
+}
+
+// Adds the globals of e that v mentions, and those that they mention,
+// to the job. The builtins are bound in every worker already.
+static void pmap_find_globals(struct lenv* e, struct lval* v, struct copy_map* seen, struct pmap_job* job) {
+    if (lval_is_fixnum(v)) { return; }
+    switch (v->type) {
+        case LVAL_SYM: {
+            if (copy_map_get(seen, v->sym, NULL)) { return; }
+            copy_map_put(seen, v->sym, NULL);
+            struct lval* x = lenv_get(e, v);
+            if (lval_type_of(x) == LVAL_ERR
+                || (lval_type_of(x) == LVAL_FUN && x->builtin && builtin_lookup(v->sym) == x->builtin)) {
+                lval_del(x);
+                return;
+            }
+            if (job->nglobals == job->globals_cap) {
+                job->globals_cap = job->globals_cap ? job->globals_cap * 2 : 16;
+                job->syms = realloc(job->syms, sizeof(char*) * job->globals_cap);
+                job->vals = realloc(job->vals, sizeof(struct lval*) * job->globals_cap);
+            }
+            job->syms[job->nglobals] = v->sym;
+            job->vals[job->nglobals++] = x;
+            pmap_find_globals(e, x, seen, job);
+            return;
+        }
+        case LVAL_FUN:
+            if (v->builtin || copy_map_get(seen, v, NULL)) { return; }
+            copy_map_put(seen, v, NULL);
+            pmap_find_globals(e, v->body, seen, job);
+            for (int i = 0; i < v->env->cap; i++) {
+                if (v->env->syms[i]) { pmap_find_globals(e, v->env->vals[i], seen, job); }
+            }
+            return;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (copy_map_get(seen, v, NULL)) { return; }
+            copy_map_put(seen, v, NULL);
+            for (int i = 0; i < v->count; i++) { pmap_find_globals(e, v->cell[i], seen, job); }
+            return;
+        case LVAL_MAP:
+            if (copy_map_get(seen, v, NULL)) { return; }
+            copy_map_put(seen, v, NULL);
+            for (int i = 0; i < v->nentries; i++) {
+                struct map_entry* y = &map_entries(v)[i];
+                if (y->key) {
+                    pmap_find_globals(e, y->key, seen, job);
+                    pmap_find_globals(e, y->val, seen, job);
+                }
+            }
+            return;
+        case LVAL_MEMO:
+            pmap_find_globals(e, v->memo->f, seen, job);
+            return;
+        default:
+            return;
+    }
+}
+
+// Runs job on the workers and returns once they have all finished it.
+// Their results stay valid until pmap_finish.
+static void pmap_start(struct pmap_pool* p, struct lenv* e, struct pmap_job* job) {
+    struct copy_map seen = { 0 };
+    struct lenv* root = lenv_root(e);
+    pmap_find_globals(root, job->f, &seen, job);
+    pmap_find_globals(root, job->q, &seen, job);
+    free(seen.keys);
+    free(seen.vals);
+
+    long n = job->q->count;
+    job->err_at = n;
+    for (int k = 0; k < p->nworkers; k++) {
+        struct pmap_worker* w = &p->workers[k];
+        pthread_mutex_lock(&w->lock);
+        w->lo = n * k / p->nworkers;
+        w->hi = n * (k + 1) / p->nworkers;
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->job = job;
+    p->done = 0;
+    p->job_id++;
+    pthread_cond_broadcast(&p->cond);
+    while (p->done < p->nworkers) { pthread_cond_wait(&p->cond, &p->lock); }
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void pmap_finish(struct pmap_pool* p, struct pmap_job* job) {
+    pthread_mutex_lock(&p->lock);
+    p->released = p->job_id;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    for (int i = 0; i < job->nglobals; i++) { lval_del(job->vals[i]); }
+    free(job->syms);
+    free(job->vals);
+    free(job->results);
+    lval_del(job->f);
+    lval_del(job->q);
+}
+
+struct lval* lval_pmap(struct lenv* e, struct lval* f, struct lval* q) {
+    struct pmap_pool* p = q->count > 1 ? pmap_pool_get() : NULL;
+    if (!p) {
+        struct lval* r = lval_qexpr();
+        for (int i = 0; i < q->count; i++) {
+            struct lval* x = lval_call(e, lval_copy(f), lval_add(lval_sexpr(), lval_copy(q->cell[i])));
+            if (lval_type_of(x) == LVAL_ERR) {
+                lval_del(r);
+                r = x;
+                break;
+            }
+            lval_add(r, x);
+        }
+        lval_del(f);
+        lval_del(q);
+        return r;
+    }
+
+    struct pmap_job job = { 0 };
+    job.f = f;
+    job.q = q;
+    job.results = calloc(q->count, sizeof(struct lval*));
+    pmap_start(p, e, &job);
+
+    struct lval* r;
+    struct copy_map m = { 0 };
+    if (job.err_at < q->count) {
+        r = lval_copy_across(job.results[job.err_at], &m);
+    } else {
+        r = lval_qexpr();
+        for (int i = 0; i < q->count; i++) {
+            lval_add(r, lval_copy_across(job.results[i], &m));
+            copy_map_clear(&m);
+        }
+    }
+    copy_map_clear(&m);
+    free(m.keys);
+    free(m.vals);
+
+    pmap_finish(p, &job);
+    return r;
+}
+
+static int pmap_run_cmp(const void* a, const void* b) {
+    long x = ((const struct pmap_run*)a)->start;
+    long y = ((const struct pmap_run*)b)->start;
+    return (x > y) - (x < y);
+}
+
+struct lval* lval_preduce(struct lenv* e, struct lval* f, struct lval* init, struct lval* q) {
+    struct pmap_pool* p = q->count > 1 ? pmap_pool_get() : NULL;
+    if (!p) {
+        struct lval* acc = init;
+        for (int i = 0; i < q->count && lval_type_of(acc) != LVAL_ERR; i++) {
+            struct lval* a = lval_add(lval_add(lval_sexpr(), acc), lval_copy(q->cell[i]));
+            acc = lval_call(e, lval_copy(f), a);
+        }
+        lval_del(f);
+        lval_del(q);
+        return acc;
+    }
+
+    struct pmap_job job = { 0 };
+    job.f = lval_copy(f);
+    job.q = q;
+    job.reduce = 1;
+    pmap_start(p, e, &job);
+
+    // Copy the runs over before releasing the workers, since f may
+    // pmap again while the caller folds them.
+    long nruns = 0;
+    for (int k = 0; k < p->nworkers; k++) { nruns += p->workers[k].nruns; }
+    struct pmap_run* runs = malloc(sizeof(struct pmap_run) * (nruns ? nruns : 1));
+    struct copy_map m = { 0 };
+    nruns = 0;
+    for (int k = 0; k < p->nworkers; k++) {
+        struct pmap_worker* w = &p->workers[k];
+        for (long i = 0; i < w->nruns; i++) {
+            runs[nruns] = w->runs[i];
+            runs[nruns++].acc = lval_copy_across(w->runs[i].acc, &m);
+            copy_map_clear(&m);
+        }
+    }
+    free(m.keys);
+    free(m.vals);
+    pmap_finish(p, &job);
+
+    qsort(runs, nruns, sizeof(struct pmap_run), pmap_run_cmp);
+    struct lval* acc = init;
+    for (long i = 0; i < nruns; i++) {
+        struct lval* x = runs[i].acc;
+        runs[i].acc = NULL;
+        if (lval_type_of(acc) == LVAL_ERR) {
+            lval_del(x);
+        } else if (lval_type_of(x) == LVAL_ERR) {
+            lval_del(acc);
+            acc = x;
+        } else {
+            acc = lval_call(e, lval_copy(f), lval_add(lval_add(lval_sexpr(), acc), x));
+        }
+    }
+    free(runs);
+    lval_del(f);
+    return acc;
+}
@@ -0,0 +1,35 @@
+#ifndef PMAP_H
+#define PMAP_H
+
+#include "types.h"
+
+// Parallel map and reduce over the elements of a Q-expression, on a
+// pool of worker threads, each an interpreter context of its own (see
+// mylisp.h). A context makes its pool on its first pmap, with a worker
+// per core.
+//
+// Values can't be shared between contexts, so each worker evaluates on
+// its own copies: of f, of the globals f (or an element) mentions by
+// name, transitively, and of each element it takes. The results are
+// copied back. Globals are bound afresh for every call, so a worker
+// sees the caller's env as it was when pmap was called; what f defines
+// while it runs is lost.
+//
+// Elements are dealt to the workers in contiguous ranges, and a worker
+// that runs out steals the upper half of another's. With one core, or
+// inside a worker, both run sequentially in the caller.
+struct pmap_pool;
+
+void pmap_pool_del(struct pmap_pool* p);
+
+// A Q-expression of f applied to each element of q, or the error of the
+// first element (in order) that f failed on. Consumes f and q.
+struct lval* lval_pmap(struct lenv* e, struct lval* f, struct lval* q);
+
+// Folds f over init and the elements of q, from the left. Each worker
+// folds the runs of consecutive elements it takes, and the caller then
+// folds init and the runs' results in order, so f must be associative.
+// Consumes f, init and q.
+struct lval* lval_preduce(struct lenv* e, struct lval* f, struct lval* init, struct lval* q);
+
+#endif // PMAP_H
@@ -0,0 +1,185 @@
+#include <pthread.h>
+#include "common.h"
+#include "pool.h"
+
+#define POOL_GRAIN 16
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRAIN)
+#define POOL_SLAB_SIZE (64 * 1024)
+
+#ifdef POOL_SYSTEM_MALLOC
+
+void* pool_alloc(size_t size) {
+    return size ? malloc(size) : NULL;
+}
+
+void* pool_realloc(void* p, size_t old_size, size_t new_size) {
+    if (new_size == 0) { free(p); return NULL; }
+    return realloc(p, new_size);
+}
+
+void pool_free(void* p, size_t size) {
+    free(p);
+}
+
+#else
+
+struct pool_block {
+    struct pool_block* next;
+};
+
+// A thread's free blocks of one class.
+struct pool_cache {
+    struct pool_block* head;
+    int count;
+};
+
+static __thread struct pool_cache caches[POOL_CLASSES];
+
+// Blocks freed on one thread are often allocated on another: the forms
+// a prefetch thread parses are freed by the evaluator, and pmap results
+// by the caller. So a thread holding more than 2 * POOL_BATCH free
+// blocks of a class hands POOL_BATCH of them to the depot, and a thread
+// that runs out takes a batch from there before carving a new slab. A
+// thread's blocks go to the depot when it exits, too.
+#define POOL_BATCH 256
+
+struct pool_batch {
+    struct pool_block* head;
+    int count;
+};
+
+struct pool_depot {
+    struct pool_batch* batches;
+    int n;
+    int cap;
+};
+
+static struct pool_depot depot[POOL_CLASSES];
+static pthread_mutex_t depot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+static __thread int pool_registered;
+
+static int pool_class(size_t size) {
+    return (size + POOL_GRAIN - 1) / POOL_GRAIN - 1;
+}
+
+static void depot_put(int c, struct pool_block* head, int count) {
+    pthread_mutex_lock(&depot_lock);
+    struct pool_depot* d = &depot[c];
+    if (d->n == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 16;
+        d->batches = realloc(d->batches, sizeof(struct pool_batch) * d->cap);
+    }
+    d->batches[d->n++] = (struct pool_batch){head, count};
+    pthread_mutex_unlock(&depot_lock);
+}
+
+static int depot_take(int c, struct pool_cache* pc) {
+    pthread_mutex_lock(&depot_lock);
+    struct pool_depot* d = &depot[c];
+    int took = d->n > 0;
+    if (took) {
+        struct pool_batch b = d->batches[--d->n];
+        pc->head = b.head;
+        pc->count = b.count;
+    }
+    pthread_mutex_unlock(&depot_lock);
+    return took;
+}
+
+// Run as a thread exits.
+static void pool_thread_exit(void* unused) {
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        if (caches[c].count) { depot_put(c, caches[c].head, caches[c].count); }
+        caches[c].head = NULL;
+        caches[c].count = 0;
+    }
+}
+
+static void pool_key_init(void) {
+    pthread_key_create(&pool_key, pool_thread_exit);
+}
+
+static void pool_register(void) {
+    pthread_once(&pool_key_once, pool_key_init);
+    pthread_setspecific(pool_key, caches);
+    pool_registered = 1;
+}
+
+static void pool_refill(int c) {
+    if (!pool_registered) { pool_register(); }
+    struct pool_cache* pc = &caches[c];
+    if (depot_take(c, pc)) { return; }
+
+    size_t block = (c + 1) * POOL_GRAIN;
+    char* slab = malloc(POOL_SLAB_SIZE);
+    if (!slab) { return; }
+    for (size_t off = 0; off + block <= POOL_SLAB_SIZE; off += block) {
+        struct pool_block* b = (struct pool_block*)(slab + off);
+        b->next = pc->head;
+        pc->head = b;
+        pc->count++;
+    }
+}
+
+// Hands the first POOL_BATCH blocks of c's free list to the depot.
+static void pool_spill(int c) {
+    if (!pool_registered) { pool_register(); }
+    struct pool_cache* pc = &caches[c];
+    struct pool_block* head = pc->head;
+    struct pool_block* last = head;
+    for (int i = 1; i < POOL_BATCH; i++) { last = last->next; }
+    pc->head = last->next;
+    pc->count -= POOL_BATCH;
+    last->next = NULL;
+    depot_put(c, head, POOL_BATCH);
+}
+
+void* pool_alloc(size_t size) {
+    if (size == 0) { return NULL; }
+    if (size > POOL_MAX_SIZE) { return malloc(size); }
+
+    int c = pool_class(size);
+    struct pool_cache* pc = &caches[c];
+    if (!pc->head) {
+        pool_refill(c);
+        if (!pc->head) { return NULL; }
+    }
+    struct pool_block* b = pc->head;
+    pc->head = b->next;
+    pc->count--;
+    return b;
+}
+
+void pool_free(void* p, size_t size) {
+    if (!p) { return; }
+    if (size > POOL_MAX_SIZE) { free(p); return; }
+
+    int c = pool_class(size);
+    struct pool_cache* pc = &caches[c];
+    struct pool_block* b = p;
+    b->next = pc->head;
+    pc->head = b;
+    if (++pc->count > 2 * POOL_BATCH) { pool_spill(c); }
+}
+
+void* pool_realloc(void* p, size_t old_size, size_t new_size) {
+    if (!p) { return pool_alloc(new_size); }
+    if (new_size == 0) { pool_free(p, old_size); return NULL; }
+    if (old_size > POOL_MAX_SIZE && new_size > POOL_MAX_SIZE) {
+        return realloc(p, new_size);
+    }
+    if (old_size <= POOL_MAX_SIZE && new_size <= POOL_MAX_SIZE
+        && pool_class(old_size) == pool_class(new_size)) {
+        return p;
+    }
+
+    void* n = pool_alloc(new_size);
+    memcpy(n, p, old_size < new_size ? old_size : new_size);
+    pool_free(p, old_size);
+    return n;
+}
+
+#endif // POOL_SYSTEM_MALLOC
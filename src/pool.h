@@ -0,0 +1,24 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+// Size-class slab allocator for lvals, lenvs and small cell arrays.
+// Each class keeps a per-thread free list threaded through the freed
+// blocks, and a thread with many spare blocks passes them in batches,
+// through a shared depot, to threads that need them, since blocks are
+// often freed on another thread than the one that allocated them.
+// Slabs are carved on demand and never returned to the system.
+// Requests larger than POOL_MAX_SIZE fall through to malloc. Callers
+// pass the allocation's size back on free, so blocks carry no header.
+//
+// Build with -DPOOL_SYSTEM_MALLOC to route everything to malloc/free,
+// e.g. so that AddressSanitizer sees each object individually.
+
+#define POOL_MAX_SIZE 256
+
+void* pool_alloc(size_t size);
+void* pool_realloc(void* p, size_t old_size, size_t new_size);
+void pool_free(void* p, size_t size);
+
+#endif // POOL_H
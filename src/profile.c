@@ -0,0 +1,180 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+
+#include <time.h>
+#include "profile.h"
+#include "gc.h"
+
+__thread struct profile* profile_current = NULL;
+
+struct profile_entry {
+    const char* name;
+    long calls;
+    int active;  // calls in progress; a recursive call's time is in its caller's already
+    long incl_ns;
+    long excl_ns;
+    long incl_allocs;
+    long excl_allocs;
+};
+
+struct profile_frame {
+    int entry;
+    long start_ns;
+    long start_allocs;
+    long child_ns;
+    long child_allocs;
+};
+
+// Entries are found by name pointer, through an open-addressed table
+// of indexes. The same name may come as a symbol and as a builtin's
+// registered name; the report merges the two.
+struct profile {
+    struct profile_entry* entries;
+    int count;
+    int cap;
+    int* slots;  // -1 when empty
+    int nslots;
+
+    struct profile_frame* stack;
+    int depth;
+    int stack_cap;
+
+    long start_ns;
+    long start_allocs;
+};
+
+static long now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+static int profile_slot(struct profile* p, const char* name) {
+    unsigned long h = (unsigned long)(uintptr_t)name;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    int i = h & (p->nslots - 1);
+    while (p->slots[i] >= 0 && p->entries[p->slots[i]].name != name) { i = (i + 1) & (p->nslots - 1); }
+    return i;
+}
+
+static int profile_entry(struct profile* p, const char* name) {
+    int i = profile_slot(p, name);
+    if (p->slots[i] >= 0) { return p->slots[i]; }
+
+    if (p->count == p->cap) {
+        p->cap *= 2;
+        p->entries = realloc(p->entries, sizeof(struct profile_entry) * p->cap);
+    }
+    struct profile_entry* x = &p->entries[p->count];
+    memset(x, 0, sizeof(struct profile_entry));
+    x->name = name;
+    p->slots[i] = p->count++;
+
+    if (p->count * 2 > p->nslots) {
+        free(p->slots);
+        p->nslots *= 2;
+        p->slots = malloc(sizeof(int) * p->nslots);
+        memset(p->slots, -1, sizeof(int) * p->nslots);
+        for (int j = 0; j < p->count; j++) { p->slots[profile_slot(p, p->entries[j].name)] = j; }
+    }
+    return p->count - 1;
+}
+
+struct profile* profile_begin(void) {
+    struct profile* p = calloc(1, sizeof(struct profile));
+    p->cap = 64;
+    p->entries = malloc(sizeof(struct profile_entry) * p->cap);
+    p->nslots = 128;
+    p->slots = malloc(sizeof(int) * p->nslots);
+    memset(p->slots, -1, sizeof(int) * p->nslots);
+    p->stack_cap = 64;
+    p->stack = malloc(sizeof(struct profile_frame) * p->stack_cap);
+    p->start_ns = now_ns();
+    p->start_allocs = gc_allocated();
+
+    struct profile* outer = profile_current;
+    profile_current = p;
+    return outer;
+}
+
+void profile_enter(const char* name) {
+    struct profile* p = profile_current;
+    int i = profile_entry(p, name);
+    p->entries[i].calls++;
+    p->entries[i].active++;
+
+    if (p->depth == p->stack_cap) {
+        p->stack_cap *= 2;
+        p->stack = realloc(p->stack, sizeof(struct profile_frame) * p->stack_cap);
+    }
+    p->stack[p->depth++] = (struct profile_frame){ i, now_ns(), gc_allocated(), 0, 0 };
+}
+
+void profile_exit(void) {
+    struct profile* p = profile_current;
+    struct profile_frame f = p->stack[--p->depth];
+    long ns = now_ns() - f.start_ns;
+    long allocs = gc_allocated() - f.start_allocs;
+
+    struct profile_entry* x = &p->entries[f.entry];
+    if (--x->active == 0) {
+        x->incl_ns += ns;
+        x->incl_allocs += allocs;
+    }
+    x->excl_ns += ns - f.child_ns;
+    x->excl_allocs += allocs - f.child_allocs;
+    if (p->depth) {
+        p->stack[p->depth - 1].child_ns += ns;
+        p->stack[p->depth - 1].child_allocs += allocs;
+    }
+}
+
+static int by_name(const void* a, const void* b) {
+    return strcmp(((const struct profile_entry*)a)->name, ((const struct profile_entry*)b)->name);
+}
+
+static int by_excl_time(const void* a, const void* b) {
+    long x = ((const struct profile_entry*)a)->excl_ns;
+    long y = ((const struct profile_entry*)b)->excl_ns;
+    return (x < y) - (x > y);
+}
+
+void profile_end(struct profile* outer, FILE* out) {
+    struct profile* p = profile_current;
+    long total_ns = now_ns() - p->start_ns;
+    long total_allocs = gc_allocated() - p->start_allocs;
+
+    qsort(p->entries, p->count, sizeof(struct profile_entry), by_name);
+    int n = 0;
+    for (int i = 0; i < p->count; i++) {
+        struct profile_entry* x = &p->entries[i];
+        if (n && strcmp(p->entries[n - 1].name, x->name) == 0) {
+            struct profile_entry* y = &p->entries[n - 1];
+            y->calls += x->calls;
+            y->incl_ns += x->incl_ns;
+            y->excl_ns += x->excl_ns;
+            y->incl_allocs += x->incl_allocs;
+            y->excl_allocs += x->excl_allocs;
+        } else {
+            p->entries[n++] = *x;
+        }
+    }
+    qsort(p->entries, n, sizeof(struct profile_entry), by_excl_time);
+
+    fprintf(out, "Profile: %.3f ms, %li allocations\n", total_ns / 1e6, total_allocs);
+    fprintf(out, "%-24s %10s %12s %12s %7s %12s %12s\n",
+        "function", "calls", "total ms", "self ms", "self %", "allocs", "self allocs");
+    for (int i = 0; i < n; i++) {
+        struct profile_entry* x = &p->entries[i];
+        fprintf(out, "%-24s %10li %12.3f %12.3f %6.1f%% %12li %12li\n",
+            x->name, x->calls, x->incl_ns / 1e6, x->excl_ns / 1e6,
+            total_ns ? x->excl_ns * 100.0 / total_ns : 0.0, x->incl_allocs, x->excl_allocs);
+    }
+
+    free(p->entries);
+    free(p->slots);
+    free(p->stack);
+    free(p);
+    profile_current = outer;
+}
@@ -0,0 +1,34 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "types.h"
+
+// Function-level profiler (--profile, and the profile builtin). While a
+// thread is profiling, the evaluator brackets each call it makes with
+// profile_enter and profile_exit, naming it by the symbol at the call
+// site, or by the builtin's registered name, or "<lambda>" when the
+// function was not called through a symbol. Each name gets a call
+// count, inclusive and exclusive wall time, and inclusive and exclusive
+// allocations. A tail call ends its caller's call and begins its own.
+//
+// With profiling off, the evaluator's only cost is a test of
+// profile_current per call. Under --vm, what compiled lambdas do inside
+// the VM is not seen: arithmetic, comparisons and if are opcodes, tail
+// calls between compiled lambdas reuse the frame, and the calls they do
+// make come without a symbol, so as "<lambda>".
+struct profile;
+
+extern __thread struct profile* profile_current;
+
+// Starts a fresh profile on the calling thread, and returns the one in
+// progress, if any, which is suspended until profile_end.
+struct profile* profile_begin(void);
+
+// Prints the current profile's report to out, sorted by exclusive time,
+// frees it, and resumes outer.
+void profile_end(struct profile* outer, FILE* out);
+
+void profile_enter(const char* name);
+void profile_exit(void);
+
+#endif // PROFILE_H
@@ -0,0 +1,398 @@
+#define _POSIX_C_SOURCE 200809L // sysconf
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "reader.h"
+#include "eval.h"
+#include "fasl.h"
+#include "gc.h"
+#include "parser.tab.h"
+#include "scan.h"
+
+yyscan_t lexer_new(FILE* f);
+void lexer_del(yyscan_t scanner);
+
+struct prefetch_file;
+
+// A reader takes its forms from one of: the hand-written scanner of a
+// file mapped into memory or a buffer (scan.h), a flex scanner of f, a
+// file's decoded cache, or the chunks a prefetch thread parses.
+struct reader {
+    char* name;  // for errors; NULL when reading a FILE* we were given
+    struct scan scan;
+    int scanning;
+    char* map;   // what is still mapped of the file scan reads, if any
+    size_t map_len;
+    FILE* f;
+    yyscan_t scanner;
+    struct fasl_writer* cache;  // until the end of f is reached
+    struct lval* cached;
+    struct prefetch_file* ahead;
+    struct lval* chunk;  // the forms of ahead's chunk being read
+    int done;
+};
+
+static struct reader* reader_new(const char* name) {
+    struct reader* r = calloc(1, sizeof(struct reader));
+    r->name = name ? strdup(name) : NULL;
+    return r;
+}
+
+struct reader* reader_open(FILE* f) {
+    struct reader* r = reader_new(NULL);
+    r->scanner = lexer_new(f);
+    if (!r->scanner) { r->done = 1; }
+    return r;
+}
+
+struct reader* reader_open_mem(const char* data, size_t len) {
+    struct reader* r = reader_new(NULL);
+    scan_init(&r->scan, data, len);
+    r->scanning = 1;
+    return r;
+}
+
+// Maps the regular file open on fd for r to scan. Returns 0 if it isn't
+// one, or can't be mapped, leaving it to be read through stdio.
+static int reader_map(struct reader* r, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) { return 0; }
+    size_t len = st.st_size;
+    if (len) {
+        void* map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) { return 0; }
+        posix_madvise(map, len, POSIX_MADV_SEQUENTIAL);
+        r->map = map;
+        r->map_len = len;
+    }
+    scan_init(&r->scan, r->map, len);
+    r->scanning = 1;
+    return 1;
+}
+
+// Unmaps the pages scan has read past, once there are MAP_RELEASE bytes
+// of them, so that a large file isn't kept in memory as a whole. The
+// forms read from it are copies, so nothing points into them.
+#define MAP_RELEASE (8 * 1024 * 1024)
+
+static void reader_release_map(struct reader* r) {
+    size_t read = r->scan.p - r->map;
+    if (read < MAP_RELEASE) { return; }
+    read &= ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+    munmap(r->map, read);
+    r->map += read;
+    r->map_len -= read;
+}
+
+struct reader* reader_open_file(const char* path) {
+    if (strcmp(path, "-") == 0) {
+        struct reader* r = reader_open(stdin);
+        r->name = strdup(path);
+        return r;
+    }
+
+    struct fasl_src src;
+    int cacheable = fasl_enabled && fasl_stat(path, &src) && src.size <= FASL_MAX_SOURCE;
+    if (cacheable && !fasl_rebuild) {
+        struct lval* cached = fasl_read(path, &src);
+        if (cached) {
+            struct reader* r = reader_new(path);
+            r->cached = cached;
+            return r;
+        }
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { return NULL; }
+    struct reader* r = reader_new(path);
+    if (reader_map(r, fd)) {
+        close(fd);
+    } else {
+        r->f = fdopen(fd, "r");
+        if (!r->f) { close(fd); r->done = 1; return r; }
+        r->scanner = lexer_new(r->f);
+        if (!r->scanner) { r->done = 1; return r; }
+    }
+    if (cacheable) { r->cache = fasl_begin(path, &src); }
+    return r;
+}
+
+static struct lval* prefetch_next(struct reader* r);
+
+struct lval* reader_next(struct reader* r) {
+    if (r->done) { return NULL; }
+    if (r->ahead) { return prefetch_next(r); }
+
+    if (r->cached) {
+        if (r->cached->count) { return lval_pop(r->cached, 0); }
+        r->done = 1;
+        return NULL;
+    }
+
+    struct lval* x = NULL;
+    int failed;
+    if (r->scanning) {
+        x = scan_form(&r->scan);
+        failed = x && lval_type_of(x) == LVAL_ERR;
+        if (r->map) { reader_release_map(r); }
+    } else {
+        failed = yyparse(r->scanner, &x) != 0;
+    }
+    if (failed) {
+        r->done = 1;
+        if (r->cache) { fasl_abort(r->cache); r->cache = NULL; }
+        char* where = x ? x->err : "end of input";
+        struct lval* err = r->name
+            ? lval_err("Syntax error in loaded file '%s' at %s.", r->name, where)
+            : lval_err("Syntax error at %s.", where);
+        if (x) { lval_del(x); }
+        return err;
+    }
+    if (!x) {
+        r->done = 1;
+        if (r->cache) { fasl_commit(r->cache); r->cache = NULL; }
+        return NULL;
+    }
+    if (r->cache) { fasl_add(r->cache, x); }
+    return x;
+}
+
+static void prefetch_release(struct reader* r);
+
+void reader_close(struct reader* r) {
+    if (r->ahead) { prefetch_release(r); }
+    if (r->chunk) { lval_del(r->chunk); }
+    if (r->cached) { lval_del(r->cached); }
+    // A cache of a file not read to the end would be incomplete.
+    if (r->cache) { fasl_abort(r->cache); }
+    if (r->scanner) { lexer_del(r->scanner); }
+    if (r->f) { fclose(r->f); }
+    if (r->map_len) { munmap(r->map, r->map_len); }
+    free(r->name);
+    free(r);
+}
+
+/* Prefetch */
+
+// Forms are handed over in chunks, each with the GC batch its objects
+// were tracked on, and a thread stops to wait once it is
+// PREFETCH_AHEAD chunks ahead of the reader.
+#define PREFETCH_CHUNK 256
+#define PREFETCH_AHEAD 16
+
+struct prefetch_chunk {
+    struct lval* forms;
+    struct gc_batch batch;
+    struct prefetch_chunk* next;
+};
+
+struct prefetch_file {
+    char* path;
+    struct prefetch* p;
+    struct prefetch_chunk* head;
+    struct prefetch_chunk* tail;
+    int nchunks;
+    int finished;  // the last chunk is queued
+    int closed;    // the reader is gone; stop parsing
+};
+
+// One lock guards every file's queue, and cond is broadcast on any
+// change to one.
+struct prefetch {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct prefetch_file* files;
+    int nfiles;
+    int next;  // the next file for a thread to take
+    pthread_t* threads;
+    int nthreads;
+};
+
+static struct prefetch_chunk* prefetch_chunk_new(void) {
+    struct prefetch_chunk* c = malloc(sizeof(struct prefetch_chunk));
+    gc_batch_begin(&c->batch);
+    c->forms = lval_sexpr();
+    lval_resize(c->forms, PREFETCH_CHUNK);
+    c->next = NULL;
+    return c;
+}
+
+// On the parsing thread: queues c, waiting for room first. Returns 0,
+// having freed c, if the file's reader has been closed.
+static int prefetch_push(struct prefetch_file* pf, struct prefetch_chunk* c, int last) {
+    struct prefetch* p = pf->p;
+    pthread_mutex_lock(&p->lock);
+    while (pf->nchunks >= PREFETCH_AHEAD && !pf->closed) {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    int closed = pf->closed;
+    if (!closed) {
+        if (pf->tail) { pf->tail->next = c; } else { pf->head = c; }
+        pf->tail = c;
+        pf->nchunks++;
+        pf->finished = last;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    if (closed) {
+        lval_del(c->forms);
+        free(c);
+    }
+    gc_batch_end();
+    return !closed;
+}
+
+static void prefetch_parse(struct prefetch_file* pf) {
+    struct prefetch_chunk* c = prefetch_chunk_new();
+    struct reader* r = reader_open_file(pf->path);
+    if (!r) {
+        lval_add(c->forms, lval_err("Could not load file '%s'", pf->path));
+        prefetch_push(pf, c, 1);
+        return;
+    }
+
+    // A decoded cache is one batch, so it goes over whole.
+    if (r->cached) {
+        lval_del(c->forms);
+        c->forms = r->cached;
+        r->cached = NULL;
+    } else {
+        struct lval* x;
+        while ((x = reader_next(r))) {
+            lval_add(c->forms, x);
+            if (c->forms->count == PREFETCH_CHUNK) {
+                if (!prefetch_push(pf, c, 0)) { reader_close(r); return; }
+                c = prefetch_chunk_new();
+            }
+        }
+    }
+    reader_close(r);
+    prefetch_push(pf, c, 1);
+}
+
+static void* prefetch_thread(void* arg) {
+    struct prefetch* p = arg;
+    pthread_mutex_lock(&p->lock);
+    while (p->next < p->nfiles) {
+        struct prefetch_file* pf = &p->files[p->next++];
+        int closed = pf->closed;
+        pthread_mutex_unlock(&p->lock);
+        if (!closed) { prefetch_parse(pf); }
+        pthread_mutex_lock(&p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+struct prefetch* prefetch_open(char** paths, int n) {
+    struct prefetch* p = malloc(sizeof(struct prefetch));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    p->files = calloc(n, sizeof(struct prefetch_file));
+    for (int i = 0; i < n; i++) {
+        p->files[i].path = strdup(paths[i]);
+        p->files[i].p = p;
+    }
+    p->nfiles = n;
+    p->next = 0;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    p->nthreads = cpus < 1 ? 1 : cpus < n ? cpus : n;
+    p->threads = malloc(sizeof(pthread_t) * p->nthreads);
+    for (int i = 0; i < p->nthreads; i++) {
+        if (pthread_create(&p->threads[i], NULL, prefetch_thread, p) != 0) {
+            p->nthreads = i;
+            break;
+        }
+    }
+    return p;
+}
+
+struct reader* prefetch_reader(struct prefetch* p, int i) {
+    char* path = p->files[i].path;
+    if (p->nthreads == 0) {
+        // Without a thread, each file is parsed as it is read.
+        struct reader* r = reader_open_file(path);
+        if (!r) {
+            r = reader_new(path);
+            r->cached = lval_add(lval_sexpr(), lval_err("Could not load file '%s'", path));
+        }
+        return r;
+    }
+    struct reader* r = reader_new(path);
+    r->ahead = &p->files[i];
+    return r;
+}
+
+static struct lval* prefetch_next(struct reader* r) {
+    struct prefetch_file* pf = r->ahead;
+    struct prefetch* p = pf->p;
+    while (1) {
+        if (r->chunk) {
+            if (r->chunk->count) { return lval_pop(r->chunk, 0); }
+            lval_del(r->chunk);
+            r->chunk = NULL;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        while (!pf->head && !pf->finished) { pthread_cond_wait(&p->cond, &p->lock); }
+        struct prefetch_chunk* c = pf->head;
+        if (c) {
+            pf->head = c->next;
+            if (!pf->head) { pf->tail = NULL; }
+            pf->nchunks--;
+            pthread_cond_broadcast(&p->cond);
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        if (!c) {
+            r->done = 1;
+            return NULL;
+        }
+        gc_adopt(&c->batch);
+        r->chunk = c->forms;
+        free(c);
+    }
+}
+
+// Frees what was parsed but not read, and tells the thread to stop.
+static void prefetch_release(struct reader* r) {
+    struct prefetch_file* pf = r->ahead;
+    struct prefetch* p = pf->p;
+    pthread_mutex_lock(&p->lock);
+    struct prefetch_chunk* c = pf->head;
+    pf->head = pf->tail = NULL;
+    pf->nchunks = 0;
+    pf->closed = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    while (c) {
+        struct prefetch_chunk* next = c->next;
+        gc_adopt(&c->batch);
+        lval_del(c->forms);
+        free(c);
+        c = next;
+    }
+}
+
+void prefetch_close(struct prefetch* p) {
+    // Files not read yet are not parsed any further.
+    for (int i = 0; i < p->nfiles; i++) {
+        struct reader r = { 0 };
+        r.ahead = &p->files[i];
+        prefetch_release(&r);
+    }
+    for (int i = 0; i < p->nthreads; i++) { pthread_join(p->threads[i], NULL); }
+
+    for (int i = 0; i < p->nfiles; i++) { free(p->files[i].path); }
+    free(p->files);
+    free(p->threads);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
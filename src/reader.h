@@ -0,0 +1,48 @@
+#ifndef READER_H
+#define READER_H
+
+#include "types.h"
+
+// Reads top-level forms one at a time, so that each can be evaluated
+// (and freed) before the next is parsed, and a file of any size is read
+// in constant memory. Each reader has a scanner and parser of its own,
+// so readers can be used in any order, and on any thread that has begun
+// a GC batch (see gc.h).
+struct reader;
+
+// Reads f, leaving it open, with the flex scanner and bison parser, a
+// form at a time as f is read.
+struct reader* reader_open(FILE* f);
+
+// Reads the len bytes at data, which must last until the reader is
+// closed.
+struct reader* reader_open_mem(const char* data, size_t len);
+
+// Reads the file at path, or standard input for "-", from its compiled
+// cache (see fasl.h) when that is valid, or else parsing it and writing
+// a fresh cache as it goes. NULL if the file can't be opened. A regular
+// file is mapped into memory and read as reader_open_mem does; standard
+// input, and anything else that can't be mapped, as reader_open does.
+struct reader* reader_open_file(const char* path);
+
+// The next form, or NULL at the end of the input. A syntax error gives
+// an error, saying where, and ends the input.
+struct lval* reader_next(struct reader* r);
+
+void reader_close(struct reader* r);
+
+// Parses several files ahead of their evaluation, on a pool of threads.
+// The files are handed to the threads in order, and each thread stays at
+// most a bounded number of forms ahead of whoever reads its file, so the
+// files can be read in order, one after another, in constant memory.
+struct prefetch;
+
+struct prefetch* prefetch_open(char** paths, int n);
+
+// A reader of the ith file. Read the files in order and close each
+// reader before moving on; a file closed early stops being parsed.
+struct reader* prefetch_reader(struct prefetch* p, int i);
+
+void prefetch_close(struct prefetch* p);
+
+#endif // READER_H
@@ -0,0 +1,225 @@
+#define _XOPEN_SOURCE 700 // setitimer
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "sample.h"
+
+#define SAMPLE_INTERVAL_US 1000
+// Frames past this depth are left off the shadow stack, and their
+// samples end in "...".
+#define SAMPLE_MAX_DEPTH 1024
+// Room for the samples taken between drains, in frames.
+#define SAMPLE_BUF (64 * 1024)
+
+__thread struct sampler* sample_current = NULL;
+
+struct sample_frame {
+    const char* name;
+    int line;
+};
+
+struct sample_count {
+    char* stack;
+    long count;
+};
+
+// The signal handler only appends to buf, as a frame holding the depth
+// (with a NULL name) followed by the frames; the sampled thread itself
+// drains it into counts, with the signal blocked, once it is half full.
+// Both run on the sampled thread, so the signal fences are all the
+// ordering needed.
+struct sampler {
+    struct sample_frame frames[SAMPLE_MAX_DEPTH];
+    int depth;
+
+    struct sample_frame* buf;
+    int used;
+    long dropped;
+
+    struct sample_count* counts;  // open-addressed by stack
+    int ncounts;
+    int cap;
+};
+
+// The sampler the signal handler feeds, if any.
+static struct sampler* active = NULL;
+static pthread_t owner;
+static int handler_installed = 0;
+
+static void sample_signal(int sig) {
+    struct sampler* s = __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+    if (!s) { return; }
+    int saved = errno;
+    if (sample_current != s) {
+        pthread_kill(owner, SIGPROF);
+        errno = saved;
+        return;
+    }
+
+    int depth = s->depth;
+    int n = depth < SAMPLE_MAX_DEPTH ? depth : SAMPLE_MAX_DEPTH;
+    if (s->used + n + 1 > SAMPLE_BUF) {
+        s->dropped++;
+    } else {
+        struct sample_frame* r = s->buf + s->used;
+        r[0].name = NULL;
+        r[0].line = depth;
+        memcpy(r + 1, s->frames, sizeof(struct sample_frame) * n);
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        s->used += n + 1;
+    }
+    errno = saved;
+}
+
+static unsigned long hash_string(const char* s) {
+    unsigned long h = 14695981039346656037UL;
+    for (; *s; s++) { h = (h ^ (unsigned char)*s) * 1099511628211UL; }
+    return h;
+}
+
+static void count_stack(struct sampler* s, char* stack) {
+    if (s->ncounts * 2 >= s->cap) {
+        struct sample_count* old = s->counts;
+        int n = s->cap;
+        s->cap = n ? n * 2 : 256;
+        s->counts = calloc(s->cap, sizeof(struct sample_count));
+        s->ncounts = 0;
+        for (int i = 0; i < n; i++) {
+            if (!old[i].stack) { continue; }
+            int j = hash_string(old[i].stack) & (s->cap - 1);
+            while (s->counts[j].stack) { j = (j + 1) & (s->cap - 1); }
+            s->counts[j] = old[i];
+            s->ncounts++;
+        }
+        free(old);
+    }
+
+    int i = hash_string(stack) & (s->cap - 1);
+    while (s->counts[i].stack && strcmp(s->counts[i].stack, stack) != 0) { i = (i + 1) & (s->cap - 1); }
+    if (s->counts[i].stack) {
+        free(stack);
+    } else {
+        s->counts[i].stack = stack;
+        s->ncounts++;
+    }
+    s->counts[i].count++;
+}
+
+// Folds the samples in buf into counts.
+static void sample_drain(struct sampler* s) {
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    size_t cap = 256;
+    char* line = malloc(cap);
+    for (int i = 0; i < s->used; ) {
+        int depth = s->buf[i].line;
+        int n = depth < SAMPLE_MAX_DEPTH ? depth : SAMPLE_MAX_DEPTH;
+        struct sample_frame* f = s->buf + i + 1;
+        i += n + 1;
+
+        size_t len = 0;
+        for (int j = 0; j <= n; j++) {
+            char part[128];
+            if (j < n && f[j].line) {
+                snprintf(part, sizeof(part), "%s:%d", f[j].name, f[j].line);
+            } else if (j < n) {
+                snprintf(part, sizeof(part), "%s", f[j].name);
+            } else if (n == 0) {
+                strcpy(part, "<top-level>");
+            } else if (depth > n) {
+                strcpy(part, "...");
+            } else {
+                break;
+            }
+            size_t k = strlen(part);
+            if (len + k + 2 > cap) {
+                while (len + k + 2 > cap) { cap *= 2; }
+                line = realloc(line, cap);
+            }
+            if (len) { line[len++] = ';'; }
+            memcpy(line + len, part, k + 1);
+            len += k;
+        }
+        count_stack(s, strdup(line));
+    }
+    free(line);
+    s->used = 0;
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+int sample_begin(void) {
+    struct sampler* s = calloc(1, sizeof(struct sampler));
+    s->buf = malloc(sizeof(struct sample_frame) * SAMPLE_BUF);
+
+    struct sampler* none = NULL;
+    if (!__atomic_compare_exchange_n(&active, &none, s, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(s->buf);
+        free(s);
+        return 0;
+    }
+    owner = pthread_self();
+    sample_current = s;
+
+    // The handler stays installed: a signal forwarded to this thread
+    // may still arrive after sampling ends, and must not kill it.
+    if (!handler_installed) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = sample_signal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGPROF, &sa, NULL);
+        handler_installed = 1;
+    }
+    struct itimerval t = { { 0, SAMPLE_INTERVAL_US }, { 0, SAMPLE_INTERVAL_US } };
+    setitimer(ITIMER_PROF, &t, NULL);
+    return 1;
+}
+
+int sample_end(const char* path) {
+    struct sampler* s = sample_current;
+    struct itimerval t = { { 0, 0 }, { 0, 0 } };
+    setitimer(ITIMER_PROF, &t, NULL);
+    __atomic_store_n(&active, NULL, __ATOMIC_RELEASE);
+    sample_current = NULL;
+    sample_drain(s);
+
+    int ok = 1;
+    FILE* f = fopen(path, "w");
+    if (f) {
+        for (int i = 0; i < s->cap; i++) {
+            if (s->counts[i].stack) { fprintf(f, "%s %li\n", s->counts[i].stack, s->counts[i].count); }
+        }
+        ok = fclose(f) == 0;
+    } else {
+        ok = 0;
+    }
+    if (s->dropped) { fprintf(stderr, "%li samples dropped.\n", s->dropped); }
+
+    for (int i = 0; i < s->cap; i++) { free(s->counts[i].stack); }
+    free(s->counts);
+    free(s->buf);
+    free(s);
+    return ok;
+}
+
+void sample_enter(const char* name, int line) {
+    struct sampler* s = sample_current;
+    if (s->depth < SAMPLE_MAX_DEPTH) {
+        s->frames[s->depth].name = name;
+        s->frames[s->depth].line = line;
+    }
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    s->depth++;
+    if (s->used > SAMPLE_BUF / 2) { sample_drain(s); }
+}
+
+void sample_exit(void) {
+    sample_current->depth--;
+}
@@ -0,0 +1,32 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+#include "types.h"
+
+// Sampling profiler (--sample-profile=FILE, and the sample-profile
+// builtin). While a thread is sampled, the evaluator keeps a shadow
+// stack of the Lisp calls in progress on it, each a function name (as
+// profile.h names them) and the source line of the call. A CPU-time
+// timer signal copies that stack; when sampling ends, the samples are
+// written to a file in the folded format that flamegraph tools read,
+// one "outer:line;...;inner:line count" line per distinct stack.
+//
+// Only one thread in the process is sampled at a time. A sample that
+// lands on another thread, such as a pmap worker, is charged to the
+// sampled thread's stack.
+struct sampler;
+
+extern __thread struct sampler* sample_current;
+
+// Starts sampling the calling thread, or returns 0 if some thread
+// already is.
+int sample_begin(void);
+
+// Stops sampling and writes the folded stacks to path. Returns 0 if the
+// file can't be written.
+int sample_end(const char* path);
+
+void sample_enter(const char* name, int line);
+void sample_exit(void);
+
+#endif // SAMPLE_H
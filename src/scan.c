@@ -0,0 +1,212 @@
+#include "scan.h"
+
+// Lists nested deeper than this are an error, as they are for the
+// bison parser, whose stack stops at the same depth.
+#define SCAN_MAX_DEPTH 10000
+
+enum { C_SPACE = 1, C_DIGIT = 2, C_SYM_START = 4, C_SYM = 8 };
+
+// Byte classes, as lexer.l defines them.
+static const unsigned char classes[256] = {
+    [' '] = C_SPACE, ['\t'] = C_SPACE, ['\r'] = C_SPACE,
+    ['0' ... '9'] = C_DIGIT | C_SYM,
+    ['a' ... 'z'] = C_SYM_START | C_SYM,
+    ['A' ... 'Z'] = C_SYM_START | C_SYM,
+    ['_'] = C_SYM_START | C_SYM, ['+'] = C_SYM_START | C_SYM,
+    ['-'] = C_SYM_START | C_SYM, ['*'] = C_SYM_START | C_SYM,
+    ['/'] = C_SYM_START | C_SYM, ['\\'] = C_SYM_START | C_SYM,
+    ['='] = C_SYM_START | C_SYM, ['<'] = C_SYM_START | C_SYM,
+    ['>'] = C_SYM_START | C_SYM, ['!'] = C_SYM_START | C_SYM,
+    ['&'] = C_SYM_START | C_SYM, ['%'] = C_SYM_START | C_SYM,
+    ['?'] = C_SYM_START | C_SYM,
+};
+
+static inline int class_of(char c) {
+    return classes[(unsigned char)c];
+}
+
+void scan_init(struct scan* s, const char* data, size_t len) {
+    s->p = data;
+    s->end = data + len;
+    s->line = 1;
+}
+
+// Skips spaces and comments, but not newlines, which end forms.
+static void skip_blank(struct scan* s) {
+    while (s->p < s->end) {
+        if (class_of(*s->p) & C_SPACE) {
+            s->p++;
+        } else if (*s->p == ';') {
+            const char* nl = memchr(s->p, '\n', s->end - s->p);
+            s->p = nl ? nl : s->end;
+        } else {
+            break;
+        }
+    }
+}
+
+// The closing quote of the string literal starting at p, or NULL if it
+// has none. Sets *escapes to whether there are escapes in it.
+static const char* string_end(struct scan* s, const char* p, int* escapes) {
+    const char* q = p + 1;
+    *escapes = 0;
+    while (1) {
+        const char* quote = memchr(q, '"', s->end - q);
+        if (!quote) { return NULL; }
+        const char* bs = memchr(q, '\\', quote - q);
+        if (!bs) { return quote; }
+        // As in lexer.l, a backslash can't escape a newline.
+        if (bs[1] == '\n') { return NULL; }
+        *escapes = 1;
+        q = bs + 2;
+    }
+}
+
+// The length of the token at s->p, for an error to show.
+static int token_len(struct scan* s) {
+    if (s->p == s->end) { return 0; }
+    int c = class_of(*s->p);
+    int run = c & C_DIGIT ? C_DIGIT : c & C_SYM_START ? C_SYM : 0;
+    if (run) {
+        const char* q = s->p + 1;
+        while (q < s->end && (class_of(*q) & run)) { q++; }
+        return q - s->p;
+    }
+    if (*s->p == '"') {
+        int escapes;
+        const char* q = string_end(s, s->p, &escapes);
+        if (q) { return q + 1 - s->p; }
+    }
+    return 1;
+}
+
+static struct lval* scan_error(struct scan* s, const char* what) {
+    int n = token_len(s);
+    // The bison reader has counted the lines in a token by the time it
+    // sees it.
+    int line = s->line;
+    for (int i = 0; i < n; i++) { line += s->p[i] == '\n'; }
+    return lval_err("line %d near '%.*s': %s", line, n, s->p, what);
+}
+
+static struct lval* scan_number(struct scan* s) {
+    // Too large a number reads as LONG_MAX, as atol gives.
+    unsigned long x = 0;
+    int over = 0;
+    for (; s->p < s->end && (class_of(*s->p) & C_DIGIT); s->p++) {
+        unsigned d = *s->p - '0';
+        if (x > (LONG_MAX - d) / 10) { over = 1; }
+        x = x * 10 + d;
+    }
+    return lval_num(over ? LONG_MAX : (long)x);
+}
+
+static struct lval* scan_string(struct scan* s) {
+    int escapes;
+    const char* end = string_end(s, s->p, &escapes);
+    if (!end) { return scan_error(s, "syntax error"); }
+    const char* p = s->p + 1;
+    for (const char* nl = p; (nl = memchr(nl, '\n', end - nl)); nl++) { s->line++; }
+    s->p = end + 1;
+    if (!escapes) { return lval_str_n(p, end - p); }
+
+    long n = end - p;
+    for (const char* q = p; q < end; q++) {
+        if (*q == '\\') { n--; q++; }
+    }
+    struct lval* v = lval_str_n(NULL, n);
+    char* out = v->str;
+    for (const char* q = p; q < end; q++) {
+        if (*q != '\\') {
+            *out++ = *q;
+            continue;
+        }
+        switch (*++q) {
+            case 'n': *out++ = '\n'; break;
+            case 't': *out++ = '\t'; break;
+            default:  *out++ = *q; break;
+        }
+    }
+    return v;
+}
+
+static struct lval* scan_expr(struct scan* s, int depth);
+
+static struct lval* scan_list(struct scan* s, int depth) {
+    if (depth == SCAN_MAX_DEPTH) { return scan_error(s, "memory exhausted"); }
+    char close = *s->p == '(' ? ')' : '}';
+    s->p++;
+    struct lval* x = lval_sexpr();
+    while (1) {
+        skip_blank(s);
+        if (s->p < s->end && *s->p == close) { break; }
+        if (s->p == s->end || *s->p == ')' || *s->p == '}' || *s->p == '\n') {
+            lval_del(x);
+            return scan_error(s, "syntax error");
+        }
+        struct lval* y = scan_expr(s, depth + 1);
+        if (lval_type_of(y) == LVAL_ERR) {
+            lval_del(x);
+            return y;
+        }
+        lval_add(x, y);
+    }
+    s->p++;
+    x->type = close == ')' ? LVAL_SEXPR : LVAL_QEXPR;
+    x->line = s->line;
+    return x;
+}
+
+static struct lval* scan_expr(struct scan* s, int depth) {
+    skip_blank(s);
+    if (s->p == s->end) { return scan_error(s, "syntax error"); }
+
+    int c = class_of(*s->p);
+    if (c & C_DIGIT) { return scan_number(s); }
+    if (c & C_SYM_START) {
+        const char* p = s->p;
+        while (++s->p < s->end && (class_of(*s->p) & C_SYM)) {}
+        return lval_sym_n(p, s->p - p);
+    }
+    switch (*s->p) {
+        case '"': return scan_string(s);
+        case '(':
+        case '{':
+            return scan_list(s, depth);
+        case '\'': {
+            if (depth == SCAN_MAX_DEPTH) { return scan_error(s, "memory exhausted"); }
+            s->p++;
+            struct lval* x = scan_expr(s, depth + 1);
+            if (lval_type_of(x) == LVAL_ERR) { return x; }
+            struct lval* q = lval_add(lval_sexpr(), lval_sym("quote"));
+            q = lval_add(q, x);
+            q->line = s->line;
+            return q;
+        }
+        default: return scan_error(s, "syntax error");
+    }
+}
+
+struct lval* scan_form(struct scan* s) {
+    while (1) {
+        skip_blank(s);
+        if (s->p == s->end) { return NULL; }
+        if (*s->p != '\n') { break; }
+        s->p++;
+        s->line++;
+    }
+
+    struct lval* x = scan_expr(s, 0);
+    if (lval_type_of(x) == LVAL_ERR) { return x; }
+    skip_blank(s);
+    if (s->p < s->end) {
+        // One form to a line.
+        if (*s->p != '\n') {
+            lval_del(x);
+            return scan_error(s, "syntax error");
+        }
+        s->p++;
+        s->line++;
+    }
+    return x;
+}
@@ -0,0 +1,25 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include "types.h"
+
+// A hand-written reader of source text in memory, such as a file that
+// reader.c has mapped. It reads the language parser.y does, a form at
+// a time, straight from the source bytes: symbols are interned and
+// strings copied from them without a token in between, and only
+// strings with escapes in them are copied twice.
+struct scan {
+    const char* p;
+    const char* end;
+    int line;
+};
+
+void scan_init(struct scan* s, const char* data, size_t len);
+
+// The next top-level form, or NULL at the end of the input. A syntax
+// error gives an error saying where, in the words the parser.y reader
+// uses, after which the input should not be read further.
+struct lval* scan_form(struct scan* s);
+
+#endif // SCAN_H
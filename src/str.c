@@ -0,0 +1,157 @@
+#include <pthread.h>
+#include <string.h>
+#include "str.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define STR_X86
+#include <immintrin.h>
+#endif
+
+/* Scalar */
+
+static long find_scalar(const char* s, long n, const char* p, long m) {
+    const char* end = s + n - m + 1;
+    for (const char* x = s; x < end; x++) {
+        x = memchr(x, p[0], end - x);
+        if (!x) { break; }
+        if (memcmp(x + 1, p + 1, m - 1) == 0) { return x - s; }
+    }
+    return -1;
+}
+
+static long find_all_scalar(const char* s, long n, const char* p, long m, long* at, long max) {
+    long k = 0;
+    for (long i = 0, j; k < max && (j = find_scalar(s + i, n - i, p, m)) >= 0; i = j + m) {
+        j += i;
+        at[k++] = j;
+    }
+    return k;
+}
+
+#ifndef STR_X86
+
+static const struct str_kernels str_scalar = { "scalar", find_scalar, find_all_scalar };
+
+#else
+
+/* The vector versions compare a block of positions at once against the
+   needle's first byte, and the block m - 1 bytes on against its last
+   byte. Only positions that match both, which are rare in most text,
+   are checked in full. */
+
+static long find_sse2(const char* s, long n, const char* p, long m) {
+    __m128i first = _mm_set1_epi8(p[0]);
+    __m128i last = _mm_set1_epi8(p[m - 1]);
+    long i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(s + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, last)));
+        for (; mask; mask &= mask - 1) {
+            long j = i + __builtin_ctz(mask);
+            if (m <= 2 || memcmp(s + j + 1, p + 1, m - 2) == 0) { return j; }
+        }
+    }
+    long r = find_scalar(s + i, n - i, p, m);
+    return r < 0 ? -1 : i + r;
+}
+
+// find_all goes on through a block after a match, rather than starting
+// a new search, as separators in split are usually close together.
+static long find_all_sse2(const char* s, long n, const char* p, long m, long* at, long max) {
+    __m128i first = _mm_set1_epi8(p[0]);
+    __m128i last = _mm_set1_epi8(p[m - 1]);
+    long k = 0;
+    long next = 0;  // where the next match may start
+    long i = 0;
+    for (; i + m - 1 + 16 <= n && k < max; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(s + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, last)));
+        for (; mask && k < max; mask &= mask - 1) {
+            long j = i + __builtin_ctz(mask);
+            if (j < next || (m > 2 && memcmp(s + j + 1, p + 1, m - 2) != 0)) { continue; }
+            at[k++] = j;
+            next = j + m;
+        }
+    }
+    if (next > i) { i = next; }
+    if (k < max && i < n) {
+        long r = find_all_scalar(s + i, n - i, p, m, at + k, max - k);
+        for (long j = k; j < k + r; j++) { at[j] += i; }
+        k += r;
+    }
+    return k;
+}
+
+static const struct str_kernels str_sse2 = { "sse2", find_sse2, find_all_sse2 };
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static long find_avx2(const char* s, long n, const char* p, long m) {
+    __m256i first = _mm256_set1_epi8(p[0]);
+    __m256i last = _mm256_set1_epi8(p[m - 1]);
+    long i = 0;
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(s + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(s + i + m - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                              _mm256_cmpeq_epi8(b, last)));
+        for (; mask; mask &= mask - 1) {
+            long j = i + __builtin_ctz(mask);
+            if (m <= 2 || memcmp(s + j + 1, p + 1, m - 2) == 0) { return j; }
+        }
+    }
+    long r = find_sse2(s + i, n - i, p, m);
+    return r < 0 ? -1 : i + r;
+}
+
+AVX2 static long find_all_avx2(const char* s, long n, const char* p, long m, long* at, long max) {
+    __m256i first = _mm256_set1_epi8(p[0]);
+    __m256i last = _mm256_set1_epi8(p[m - 1]);
+    long k = 0;
+    long next = 0;
+    long i = 0;
+    for (; i + m - 1 + 32 <= n && k < max; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(s + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(s + i + m - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                              _mm256_cmpeq_epi8(b, last)));
+        for (; mask && k < max; mask &= mask - 1) {
+            long j = i + __builtin_ctz(mask);
+            if (j < next || (m > 2 && memcmp(s + j + 1, p + 1, m - 2) != 0)) { continue; }
+            at[k++] = j;
+            next = j + m;
+        }
+    }
+    if (next > i) { i = next; }
+    if (k < max && i < n) {
+        long r = find_all_sse2(s + i, n - i, p, m, at + k, max - k);
+        for (long j = k; j < k + r; j++) { at[j] += i; }
+        k += r;
+    }
+    return k;
+}
+
+static const struct str_kernels str_avx2 = { "avx2", find_avx2, find_all_avx2 };
+
+#endif // STR_X86
+
+static const struct str_kernels* kernels = NULL;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void kernels_init(void) {
+#ifdef STR_X86
+    __builtin_cpu_init();
+    kernels = __builtin_cpu_supports("avx2") ? &str_avx2 : &str_sse2;
+#else
+    kernels = &str_scalar;
+#endif
+}
+
+const struct str_kernels* str_kernels(void) {
+    pthread_once(&kernels_once, kernels_init);
+    return kernels;
+}
@@ -0,0 +1,20 @@
+#ifndef STR_H
+#define STR_H
+
+// Byte-string search, behind str-find and str-split. Like vec.h, there
+// is a scalar version and, on x86-64, SSE2 and AVX2 versions; the first
+// call to str_kernels picks the best set the CPU supports.
+
+struct str_kernels {
+    const char* isa;
+    // The index of the first occurrence of the m bytes at p in the n
+    // bytes at s, or -1. m > 0.
+    long (*find)(const char* s, long n, const char* p, long m);
+    // Writes the indexes of the first max non-overlapping occurrences
+    // of p in s to at, and returns how many there were.
+    long (*find_all)(const char* s, long n, const char* p, long m, long* at, long max);
+};
+
+const struct str_kernels* str_kernels(void);
+
+#endif // STR_H
@@ -1,16 +1,102 @@
+#include <pthread.h>
 #include "types.h"
 #include "eval.h" 
+#include "gc.h"
+#include "map.h"
+#include "memo.h"
+#include "out.h"
+#include "pool.h"
+#include "vm.h"
+
+// Shared by every thread that makes symbols, such as those parsing
+// ahead of evaluation.
+static char** sym_table = NULL;
+static int sym_count = 0;
+static int sym_cap = 0;
+static pthread_mutex_t sym_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Mixed at the end, since the table takes the low bits, which alone
+// collide for names that differ only in their last few characters,
+// such as x1, x2 and so on, and the probes run on and on.
+static unsigned long str_hash(const char* s, size_t n) {
+    unsigned long h = 5381;
+    for (size_t i = 0; i < n; i++) { h = h * 33 + (unsigned char)s[i]; }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    return h;
+}
+
+static unsigned long ptr_hash(const void* p) {
+    unsigned long h = (unsigned long)p;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    return h;
+}
+
+static void sym_table_grow(void) {
+    int old_cap = sym_cap;
+    char** old = sym_table;
+    sym_cap = old_cap ? old_cap * 2 : 256;
+    sym_table = calloc(sym_cap, sizeof(char*));
+    for (int i = 0; i < old_cap; i++) {
+        if (!old[i]) { continue; }
+        unsigned long j = str_hash(old[i], strlen(old[i])) & (sym_cap - 1);
+        while (sym_table[j]) { j = (j + 1) & (sym_cap - 1); }
+        sym_table[j] = old[i];
+    }
+    free(old);
+}
+
+char* sym_intern(const char* s) {
+    return sym_intern_n(s, strlen(s));
+}
+
+// The symbol of the n bytes at s, which need not be NUL-terminated.
+char* sym_intern_n(const char* s, size_t n) {
+    unsigned long h = str_hash(s, n);
+    pthread_mutex_lock(&sym_lock);
+    if ((sym_count + 1) * 4 > sym_cap * 3) { sym_table_grow(); }
+    unsigned long i = h & (sym_cap - 1);
+    while (sym_table[i]) {
+        if (strncmp(sym_table[i], s, n) == 0 && sym_table[i][n] == '\0') { break; }
+        i = (i + 1) & (sym_cap - 1);
+    }
+    if (!sym_table[i]) {
+        sym_table[i] = malloc(n + 1);
+        memcpy(sym_table[i], s, n);
+        sym_table[i][n] = '\0';
+        sym_count++;
+    }
+    char* sym = sym_table[i];
+    pthread_mutex_unlock(&sym_lock);
+    return sym;
+}
+
+static struct lval* lval_alloc_size(lval_type t, size_t size) {
+    struct lval* v = pool_alloc(size);
+    v->type = t;
+    v->refs = 1;
+    gc_track(v);
+    return v;
+}
+
+static struct lval* lval_alloc(lval_type t) {
+    return lval_alloc_size(t, sizeof(struct lval));
+}
 
 struct lval* lval_num(long x) {
-    struct lval* v = malloc(sizeof(struct lval));
-    v->type = LVAL_NUM;
+    if (x >= LVAL_FIXNUM_MIN && x <= LVAL_FIXNUM_MAX) {
+        return (struct lval*)(((uintptr_t)x << 1) | 1);
+    }
+    struct lval* v = lval_alloc(LVAL_NUM);
     v->num = x;
     return v;
 }
 
 struct lval* lval_err(char* fmt, ...) {
-    struct lval* v = malloc(sizeof(struct lval));
-    v->type = LVAL_ERR;
+    struct lval* v = lval_alloc(LVAL_ERR);
     va_list va;
     va_start(va, fmt);
     v->err = malloc(512);
@@ -21,31 +107,65 @@ struct lval* lval_err(char* fmt, ...) {
 }
 
 struct lval* lval_sym(char* s) {
-    struct lval* v = malloc(sizeof(struct lval));
-    v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
-    strcpy(v->sym, s);
+    struct lval* v = lval_alloc(LVAL_SYM);
+    v->sym = sym_intern(s);
+    v->ic = NULL;
+    return v;
+}
+
+struct lval* lval_sym_n(const char* s, size_t n) {
+    struct lval* v = lval_alloc(LVAL_SYM);
+    v->sym = sym_intern_n(s, n);
+    v->ic = NULL;
     return v;
 }
 
 struct lval* lval_str(char* s) {
-    struct lval* v = malloc(sizeof(struct lval));
-    v->type = LVAL_STR;
-    v->str = malloc(strlen(s) + 1);
-    strcpy(v->str, s);
+    return lval_str_n(s, strlen(s));
+}
+
+// A string of the n bytes at s, or of n bytes for the caller to fill in
+// if s is NULL.
+struct lval* lval_str_n(const char* s, long n) {
+    struct lval* v = lval_alloc_size(LVAL_STR, sizeof(struct lval) + n + 1);
+    v->str = (char*)(v + 1);
+    v->slen = n;
+    v->sbase = NULL;
+    if (s) { memcpy(v->str, s, n); }
+    v->str[n] = '\0';
+    return v;
+}
+
+// The n bytes of s from at, sharing s's storage. Pieces shorter than
+// STR_SLICE_MIN are copied instead: that costs the same one allocation,
+// and doesn't keep a large string alive for a small piece of it.
+struct lval* lval_str_slice(struct lval* s, long at, long n) {
+    if (n == s->slen) { return lval_copy(s); }
+    if (n < STR_SLICE_MIN) { return lval_str_n(s->str + at, n); }
+    struct lval* v = lval_alloc(LVAL_STR);
+    v->str = s->str + at;
+    v->slen = n;
+    v->sbase = lval_copy(s->sbase ? s->sbase : s);
     return v;
 }
 
+// v, or a copy of it that owns its bytes, and so is NUL-terminated, if
+// v is a slice. Consumes v.
+struct lval* lval_str_owned(struct lval* v) {
+    if (!v->sbase) { return v; }
+    struct lval* x = lval_str_n(v->str, v->slen);
+    lval_del(v);
+    return x;
+}
+
 struct lval* lval_builtin(lbuiltin func) {
-    struct lval* v = malloc(sizeof(struct lval));
-    v->type = LVAL_FUN;
+    struct lval* v = lval_alloc(LVAL_FUN);
     v->builtin = func;
     return v;
 }
 
 struct lval* lval_lambda(struct lval* formals, struct lval* body) {
-    struct lval* v = malloc(sizeof(struct lval));
-    v->type = LVAL_FUN;
+    struct lval* v = lval_alloc(LVAL_FUN);
     v->builtin = NULL;
     v->env = lenv_new();
     v->formals = formals;
@@ -54,60 +174,303 @@ struct lval* lval_lambda(struct lval* formals, struct lval* body) {
 }
 
 struct lval* lval_sexpr(void) {
-    struct lval* v = malloc(sizeof(struct lval));
-    v->type = LVAL_SEXPR;
+    struct lval* v = lval_alloc(LVAL_SEXPR);
     v->count = 0;
+    v->line = 0;
+    v->buf = NULL;
     v->cell = NULL;
+    v->code = NULL;
     return v;
 }
 
 struct lval* lval_qexpr(void) {
-    struct lval* v = malloc(sizeof(struct lval));
-    v->type = LVAL_QEXPR;
+    struct lval* v = lval_alloc(LVAL_QEXPR);
     v->count = 0;
+    v->line = 0;
+    v->buf = NULL;
     v->cell = NULL;
+    v->code = NULL;
     return v;
 }
 
-void lval_del(struct lval* v) {
+// A vector of len uninitialised elements.
+struct lval* lval_vec(long len) {
+    struct lval* v = lval_alloc(LVAL_VEC);
+    v->len = len;
+    v->data = len ? pool_alloc(sizeof(int64_t) * len) : NULL;
+    return v;
+}
+
+struct lval* lval_map(void) {
+    struct lval* v = lval_alloc(LVAL_MAP);
+    v->tab = NULL;
+    v->nentries = 0;
+    v->nkeys = 0;
+    return v;
+}
+
+struct lval* lval_table(void) {
+    struct lval* v = lval_alloc(LVAL_TABLE);
+    v->map = map_new();
+    return v;
+}
+
+// An empty cache of f's results. Consumes f.
+struct lval* lval_memo(struct lval* f, int limit) {
+    struct lval* v = lval_alloc(LVAL_MEMO);
+    v->memo = memo_new(f, limit);
+    return v;
+}
+
+// A buffer of cap empty slots. Nothing is claimed yet; set lo = hi to
+// the slot where the first element will go. Small buffers keep their
+// items in the same pool block, right after the lval.
+static struct lval* lval_buf(int cap, int at) {
+    size_t inline_size = sizeof(struct lval) + sizeof(struct lval*) * cap;
+    struct lval* b;
+    if (inline_size <= POOL_MAX_SIZE) {
+        b = lval_alloc_size(LVAL_BUF, inline_size);
+        b->items = (struct lval**)(b + 1);
+    } else {
+        b = lval_alloc(LVAL_BUF);
+        b->items = pool_alloc(sizeof(struct lval*) * cap);
+    }
+    b->cap = cap;
+    b->lo = at;
+    b->hi = at;
+    return b;
+}
+
+static void lenv_free(struct lenv* e) {
+    pool_free(e->syms, sizeof(char*) * e->cap);
+    pool_free(e->vals, sizeof(struct lval*) * e->cap);
+    pool_free(e, sizeof(struct lenv));
+}
+
+// Frees v and the storage only it owns, without releasing the values
+// it references. lval_del releases those first; the collector frees
+// garbage cycles with this directly.
+void lval_free(struct lval* v) {
+    size_t size = sizeof(struct lval);
     switch (v->type) {
-        case LVAL_NUM: break;
         case LVAL_ERR: free(v->err); break;
-        case LVAL_SYM: free(v->sym); break;
-        case LVAL_STR: free(v->str); break;
+        case LVAL_STR:
+            if (!v->sbase) { size += v->slen + 1; }
+            break;
+        case LVAL_FUN:
+            if (!v->builtin) { lenv_free(v->env); }
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (v->code) { vm_free(v->code); }
+            break;
+        case LVAL_VEC:
+            if (v->data) { pool_free(v->data, sizeof(int64_t) * v->len); }
+            break;
+        case LVAL_TABLE: map_free(v->map); break;
+        case LVAL_MEMO: memo_free(v->memo); break;
+        case LVAL_BUF:
+            if (v->items == (struct lval**)(v + 1)) {
+                size += sizeof(struct lval*) * v->cap;
+            } else {
+                pool_free(v->items, sizeof(struct lval*) * v->cap);
+            }
+            break;
+        default: break;
+    }
+    gc_untrack(v);
+    pool_free(v, size);
+}
+
+void lval_del(struct lval* v) {
+    if (lval_is_fixnum(v) || --v->refs > 0) { return; }
+    switch (v->type) {
+        case LVAL_SYM:
+            if (v->ic) { lval_del(v->ic); }
+            break;
+        case LVAL_STR:
+            if (v->sbase) { lval_del(v->sbase); }
+            break;
         case LVAL_FUN:
             if (!v->builtin) {
-                lenv_del(v->env);
+                for (int i = 0; i < v->env->cap; i++) {
+                    if (v->env->syms[i]) { lval_del(v->env->vals[i]); }
+                }
                 lval_del(v->formals);
                 lval_del(v->body);
             }
             break;
         case LVAL_SEXPR:
         case LVAL_QEXPR:
-            for (int i = 0; i < v->count; i++) {
-                lval_del(v->cell[i]);
+            if (v->buf) { lval_del(v->buf); }
+            if (v->code) { vm_release(v->code); }
+            break;
+        case LVAL_MAP:
+            if (v->tab) { lval_del(v->tab); }
+            break;
+        case LVAL_TABLE: map_release(v->map); break;
+        case LVAL_MEMO: memo_release(v->memo); break;
+        case LVAL_BUF:
+            for (int i = v->lo; i < v->hi; i++) {
+                lval_del(v->items[i]);
             }
-            free(v->cell);
             break;
+        default: break;
+    }
+    lval_free(v);
+}
+
+// True when v's cells are its own to mutate: no other list shares the
+// buffer, and the buffer holds nothing outside v's view.
+static int lval_cells_owned(struct lval* v) {
+    if (!v->buf) { return 1; }
+    struct lval* b = v->buf;
+    return b->refs == 1 && v->cell == b->items + b->lo && b->lo + v->count == b->hi;
+}
+
+// Moves the cells of a list into a fresh buffer of cap slots, shared
+// with nobody. Elements are shared with the old buffer if that stays
+// alive, and moved out of it otherwise.
+static void lval_rebuffer(struct lval* v, int cap, int at) {
+    struct lval* b = cap ? lval_buf(cap, at) : NULL;
+    if (v->count) {
+        memcpy(b->items + at, v->cell, sizeof(struct lval*) * v->count);
+    }
+    if (b) { b->hi = at + v->count; }
+    if (v->buf) {
+        if (v->buf->refs == 1) {
+            // Release what lies outside the view; the view itself moves.
+            struct lval* old = v->buf;
+            int first = v->cell - old->items;
+            for (int i = old->lo; i < first; i++) { lval_del(old->items[i]); }
+            for (int i = first + v->count; i < old->hi; i++) { lval_del(old->items[i]); }
+            old->hi = old->lo;
+        } else {
+            for (int i = 0; i < v->count; i++) { lval_copy(v->cell[i]); }
+        }
+        lval_del(v->buf);
     }
-    free(v);
+    v->buf = b;
+    v->cell = b ? b->items + at : NULL;
+}
+
+// Moves the cells to the front of a fresh buffer of cap slots.
+void lval_resize(struct lval* v, int cap) {
+    lval_rebuffer(v, cap, 0);
 }
 
 struct lval* lval_add(struct lval* v, struct lval* x) {
+    if (!v->buf || v->buf->hi == v->buf->cap) {
+        lval_resize(v, v->count < 2 ? 2 : v->count * 2);
+    }
+    v->buf->items[v->buf->hi++] = x;
     v->count++;
-    v->cell = realloc(v->cell, sizeof(struct lval*) * v->count);
-    v->cell[v->count - 1] = x;
     return v;
 }
 
+// A new list of the same type viewing count cells of v from start.
+// Shares v's buffer; consumes v.
+struct lval* lval_slice(struct lval* v, int start, int count) {
+    struct lval* x = lval_alloc(v->type);
+    x->count = count;
+    x->line = v->line;
+    x->buf = count ? lval_copy(v->buf) : NULL;
+    x->cell = count ? v->cell + start : NULL;
+    x->code = NULL;
+    lval_del(v);
+    return x;
+}
+
+// A new list of x followed by the cells of q. Claims the slot before q
+// in place when q starts at the front of its buffer's claimed range;
+// otherwise copies q into a buffer with room at the front for further
+// conses. Consumes x and q.
+struct lval* lval_cons(struct lval* x, struct lval* q) {
+    int n = q->count;
+    struct lval* r = lval_qexpr();
+    r->count = n;
+    r->cell = q->cell;
+    r->buf = q->buf ? lval_copy(q->buf) : NULL;
+    lval_del(q);
+
+    struct lval* b = r->buf;
+    if (!b || b->lo == 0 || r->cell != b->items + b->lo) {
+        lval_rebuffer(r, n * 2 + 2, n + 2);
+        b = r->buf;
+    }
+    b->items[--b->lo] = x;
+    r->cell = b->items + b->lo;
+    r->count++;
+    return r;
+}
+
+// x followed by the cells of y. Appends in place when x ends at the
+// back of its buffer's claimed range and there is room; otherwise
+// copies x into a buffer with room for y and further appends. Consumes
+// x and y; the result has x's type.
+struct lval* lval_join(struct lval* x, struct lval* y) {
+    if (y->count == 0) { lval_del(y); return x; }
+
+    if (x->refs > 1) { x = lval_slice(x, 0, x->count); }
+
+    struct lval* b = x->buf;
+    int at_back = b && x->cell + x->count == b->items + b->hi;
+    if (!at_back || b->cap - b->hi < y->count) {
+        lval_resize(x, (x->count + y->count) * 2);
+        b = x->buf;
+    }
+
+    for (int i = 0; i < y->count; i++) {
+        b->items[b->hi++] = lval_copy(y->cell[i]);
+    }
+    x->count += y->count;
+    lval_del(y);
+    return x;
+}
+
 struct lval* lval_copy(struct lval* v) {
-    struct lval* x = malloc(sizeof(struct lval));
-    x->type = v->type;
+    if (!lval_is_fixnum(v)) { v->refs++; }
+    return v;
+}
+
+// Returns a value equal to v that the caller may mutate in place. Takes
+// over the caller's reference to v. The copy is shallow: children are
+// shared, and are unshared in turn only when they are mutated. A list
+// also gets a cell buffer of its own.
+struct lval* lval_unshare(struct lval* v) {
+    if (lval_is_fixnum(v)) { return v; }
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+        if (v->refs > 1) {
+            struct lval* x = lval_alloc(v->type);
+            x->count = v->count;
+            x->line = v->line;
+            x->buf = NULL;
+            x->cell = NULL;
+            x->code = NULL;
+            if (v->count) {
+                x->buf = lval_buf(v->count, 0);
+                x->cell = x->buf->items;
+                for (int i = 0; i < v->count; i++) { x->cell[i] = lval_copy(v->cell[i]); }
+                x->buf->hi = v->count;
+            }
+            v->refs--;
+            return x;
+        }
+        if (!lval_cells_owned(v)) { lval_rebuffer(v, v->count, 0); }
+        return v;
+    }
+    if (v->refs == 1 || v->type == LVAL_MEMO) { return v; }
+    if (v->type == LVAL_STR) {
+        struct lval* x = lval_str_n(v->str, v->slen);
+        lval_del(v);
+        return x;
+    }
+
+    struct lval* x = lval_alloc(v->type);
     switch (v->type) {
         case LVAL_NUM: x->num = v->num; break;
         case LVAL_ERR: x->err = malloc(strlen(v->err) + 1); strcpy(x->err, v->err); break;
-        case LVAL_SYM: x->sym = malloc(strlen(v->sym) + 1); strcpy(x->sym, v->sym); break;
-        case LVAL_STR: x->str = malloc(strlen(v->str) + 1); strcpy(x->str, v->str); break;
+        case LVAL_SYM: x->sym = v->sym; x->ic = NULL; break;
         case LVAL_FUN:
             if (v->builtin) {
                 x->builtin = v->builtin;
@@ -118,73 +481,115 @@ struct lval* lval_copy(struct lval* v) {
                 x->body = lval_copy(v->body);
             }
             break;
-        case LVAL_SEXPR:
-        case LVAL_QEXPR:
-            x->count = v->count;
-            x->cell = malloc(sizeof(struct lval*) * x->count);
-            for (int i = 0; i < x->count; i++) {
-                x->cell[i] = lval_copy(v->cell[i]);
-            }
+        case LVAL_VEC:
+            x->len = v->len;
+            x->data = v->len ? pool_alloc(sizeof(int64_t) * v->len) : NULL;
+            if (v->len) { memcpy(x->data, v->data, sizeof(int64_t) * v->len); }
             break;
+        case LVAL_MAP:
+            // A new view of the same table; map_put and map_del copy it
+            // only if they must.
+            x->tab = v->tab ? lval_copy(v->tab) : NULL;
+            x->nentries = v->nentries;
+            x->nkeys = v->nkeys;
+            break;
+        default: break;
     }
+    lval_del(v);
     return x;
 }
 
-void lval_print_expr_contents(struct lval* v, char open, char close) {
-    putchar(open);
+static void lval_write_expr(struct outbuf* b, struct lval* v, char open, char close) {
+    out_char(b, open);
     for (int i = 0; i < v->count; i++) {
-        lval_print(v->cell[i]);
-        if (i != (v->count - 1)) {
-            putchar(' ');
-        }
+        if (i) { out_char(b, ' '); }
+        lval_write(b, v->cell[i]);
     }
-    putchar(close);
+    out_char(b, close);
 }
 
-void lval_print_str(struct lval* v) {
-    char* escaped = malloc(strlen(v->str) * 2 + 3);
-    char* p = escaped;
-    *p++ = '"';
-    for (int i = 0; v->str[i] != '\0'; i++) {
+// Copies the runs between escapes in one go.
+static void lval_write_str(struct outbuf* b, struct lval* v) {
+    out_reserve(b, v->slen + 2);
+    out_char(b, '"');
+    long run = 0;
+    for (long i = 0; i < v->slen; i++) {
+        const char* esc;
         switch (v->str[i]) {
-            case '\n': *p++ = '\\'; *p++ = 'n'; break;
-            case '\t': *p++ = '\\'; *p++ = 't'; break;
-            case '\\': *p++ = '\\'; *p++ = '\\'; break;
-            case '"':  *p++ = '\\'; *p++ = '"'; break;
-            default:   *p++ = v->str[i]; break;
+            case '\n': esc = "\\n"; break;
+            case '\t': esc = "\\t"; break;
+            case '\\': esc = "\\\\"; break;
+            case '"':  esc = "\\\""; break;
+            default: continue;
         }
+        out_bytes(b, v->str + run, i - run);
+        out_bytes(b, esc, 2);
+        run = i + 1;
     }
-    *p++ = '"';
-    *p++ = '\0';
-    printf("%s", escaped);
-    free(escaped);
+    out_bytes(b, v->str + run, v->slen - run);
+    out_char(b, '"');
 }
 
-void lval_print(struct lval* v) {
-    switch (v->type) {
-        case LVAL_NUM:   printf("%li", v->num); break;
-        case LVAL_ERR:   printf("Error: %s", v->err); break;
-        case LVAL_SYM:   printf("%s", v->sym); break;
-        case LVAL_STR:   lval_print_str(v); break;
+void lval_write(struct outbuf* b, struct lval* v) {
+    switch (lval_type_of(v)) {
+        case LVAL_NUM:   out_long(b, lval_num_of(v)); break;
+        case LVAL_ERR:   out_cstr(b, "Error: "); out_cstr(b, v->err); break;
+        case LVAL_SYM:   out_cstr(b, v->sym); break;
+        case LVAL_STR:   lval_write_str(b, v); break;
         case LVAL_FUN:
             if (v->builtin) {
-                printf("<builtin>");
+                out_cstr(b, "<builtin>");
             } else {
-                printf("(lambda ");
-                lval_print(v->formals);
-                putchar(' ');
-                lval_print(v->body);
-                putchar(')');
+                out_cstr(b, "(lambda ");
+                lval_write(b, v->formals);
+                out_char(b, ' ');
+                lval_write(b, v->body);
+                out_char(b, ')');
             }
             break;
-        case LVAL_SEXPR: lval_print_expr_contents(v, '(', ')'); break;
-        case LVAL_QEXPR: lval_print_expr_contents(v, '{', '}'); break;
+        case LVAL_SEXPR: lval_write_expr(b, v, '(', ')'); break;
+        case LVAL_QEXPR: lval_write_expr(b, v, '{', '}'); break;
+        case LVAL_VEC:
+            out_char(b, '[');
+            for (long i = 0; i < v->len; i++) {
+                if (i) { out_char(b, ' '); }
+                out_long(b, v->data[i]);
+            }
+            out_char(b, ']');
+            break;
+        case LVAL_MAP:
+            // As the expression that makes it.
+            out_cstr(b, "(map {");
+            for (int i = 0, n = 0; i < v->nentries; i++) {
+                struct map_entry* x = &map_entries(v)[i];
+                if (!x->key) { continue; }
+                if (n++) { out_char(b, ' '); }
+                lval_write(b, x->key);
+                out_char(b, ' ');
+                lval_write(b, x->val);
+            }
+            out_cstr(b, "})");
+            break;
+        case LVAL_MEMO: out_cstr(b, "<memo>"); break;
+        case LVAL_BUF: case LVAL_TABLE: break;
     }
 }
 
+void lval_print(struct lval* v) {
+    struct outbuf b;
+    out_init(&b);
+    lval_write(&b, v);
+    out_write(b.data, b.len);
+    out_free(&b);
+}
+
 void lval_println(struct lval* v) {
-    lval_print(v);
-    putchar('\n');
+    struct outbuf b;
+    out_init(&b);
+    lval_write(&b, v);
+    out_char(&b, '\n');
+    out_write(b.data, b.len);
+    out_free(&b);
 }
 
 char* ltype_name(lval_type t) {
@@ -196,75 +601,146 @@ char* ltype_name(lval_type t) {
         case LVAL_STR: return "String";
         case LVAL_SEXPR: return "S-Expression";
         case LVAL_QEXPR: return "Q-Expression";
+        case LVAL_VEC: return "Vector";
+        case LVAL_MAP: return "Map";
+        case LVAL_MEMO: return "Memo";
         default: return "Unknown";
     }
 }
 
 struct lenv* lenv_new(void) {
-    struct lenv* e = malloc(sizeof(struct lenv));
+    struct lenv* e = pool_alloc(sizeof(struct lenv));
     e->par = NULL;
     e->count = 0;
+    e->cap = 0;
     e->syms = NULL;
     e->vals = NULL;
+    e->version = 0;
     return e;
 }
 
 void lenv_del(struct lenv* e) {
-    for (int i = 0; i < e->count; i++) {
-        free(e->syms[i]);
-        lval_del(e->vals[i]);
+    for (int i = 0; i < e->cap; i++) {
+        if (e->syms[i]) { lval_del(e->vals[i]); }
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
+    lenv_free(e);
 }
 
-struct lval* lenv_get(struct lenv* e, struct lval* k) {
-    for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
-        }
+// Returns the slot holding sym, or the empty slot where it would go.
+// Callers must ensure cap > 0.
+static int lenv_slot(struct lenv* e, char* sym) {
+    unsigned long i = ptr_hash(sym) & (e->cap - 1);
+    while (e->syms[i] && e->syms[i] != sym) {
+        i = (i + 1) & (e->cap - 1);
     }
-    if (e->par) {
-        return lenv_get(e->par, k);
+    return i;
+}
+
+static void lenv_grow(struct lenv* e) {
+    int old_cap = e->cap;
+    char** old_syms = e->syms;
+    struct lval** old_vals = e->vals;
+
+    e->cap = old_cap ? old_cap * 2 : 8;
+    e->syms = pool_alloc(sizeof(char*) * e->cap);
+    e->vals = pool_alloc(sizeof(struct lval*) * e->cap);
+    memset(e->syms, 0, sizeof(char*) * e->cap);
+    for (int i = 0; i < old_cap; i++) {
+        if (!old_syms[i]) { continue; }
+        int j = lenv_slot(e, old_syms[i]);
+        e->syms[j] = old_syms[i];
+        e->vals[j] = old_vals[i];
+    }
+    pool_free(old_syms, sizeof(char*) * old_cap);
+    pool_free(old_vals, sizeof(struct lval*) * old_cap);
+}
+
+struct lval* lenv_get(struct lenv* e, struct lval* k) {
+    for (; e; e = e->par) {
+        if (e->count == 0) { continue; }
+        int i = lenv_slot(e, k->sym);
+        if (e->syms[i]) { return lval_copy(e->vals[i]); }
     }
     return lval_err("Unbound Symbol '%s'", k->sym);
 }
 
+// e's own binding of sym, not a copy, or NULL. Parents are not searched.
+struct lval* lenv_find(struct lenv* e, char* sym) {
+    if (e->count == 0) { return NULL; }
+    int i = lenv_slot(e, sym);
+    return e->syms[i] ? e->vals[i] : NULL;
+}
+
+// lenv_get for symbols evaluated from the AST. Local envs are still
+// searched each time, but a global binding is remembered in k itself,
+// so repeat lookups of builtins and defined functions skip the global
+// table until the global env's version moves on. Symbols that are
+// about to be freed are not worth caching in.
+struct lval* lenv_lookup(struct lenv* e, struct lval* k) {
+    for (; e->par; e = e->par) {
+        if (e->count == 0) { continue; }
+        int i = lenv_slot(e, k->sym);
+        if (e->syms[i]) { return lval_copy(e->vals[i]); }
+    }
+    if (k->ic && k->ic_env == e && k->ic_version == e->version) {
+        return lval_copy(k->ic);
+    }
+    if (e->count == 0) { return lval_err("Unbound Symbol '%s'", k->sym); }
+    int i = lenv_slot(e, k->sym);
+    if (!e->syms[i]) { return lval_err("Unbound Symbol '%s'", k->sym); }
+
+    if (k->refs > 1) {
+        if (k->ic) { lval_del(k->ic); }
+        k->ic = lval_copy(e->vals[i]);
+        k->ic_env = e;
+        k->ic_version = e->version;
+    }
+    return lval_copy(e->vals[i]);
+}
+
 void lenv_put(struct lenv* e, struct lval* k, struct lval* v) {
-    for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
-        }
+    if ((e->count + 1) * 4 > e->cap * 3) { lenv_grow(e); }
+
+    int i = lenv_slot(e, k->sym);
+    if (e->syms[i]) {
+        // Only root envs count, since that is where globals live. A
+        // lambda's env is also parentless while its arguments are being
+        // bound, which at worst bumps the version needlessly.
+        if (!e->par) { e->version++; }
+        lval_del(e->vals[i]);
+        e->vals[i] = lval_copy(v);
+        return;
     }
 
+    e->syms[i] = k->sym;
+    e->vals[i] = lval_copy(v);
     e->count++;
-    e->vals = realloc(e->vals, sizeof(struct lval*) * e->count);
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
+}
 
-    e->vals[e->count - 1] = lval_copy(v);
-    e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-    strcpy(e->syms[e->count - 1], k->sym);
+struct lenv* lenv_root(struct lenv* e) {
+    while (e->par) { e = e->par; }
+    return e;
 }
 
 void lenv_def(struct lenv* e, struct lval* k, struct lval* v) {
-    while (e->par) { e = e->par; }
-    lenv_put(e, k, v);
+    lenv_put(lenv_root(e), k, v);
 }
 
 struct lenv* lenv_copy(struct lenv* e) {
-    struct lenv* n = malloc(sizeof(struct lenv));
+    struct lenv* n = pool_alloc(sizeof(struct lenv));
     n->par = e->par;
     n->count = e->count;
-    n->syms = malloc(sizeof(char*) * n->count);
-    n->vals = malloc(sizeof(struct lval*) * n->count);
-    for (int i = 0; i < e->count; i++) {
-        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
-        n->vals[i] = lval_copy(e->vals[i]);
+    n->cap = e->cap;
+    n->syms = NULL;
+    n->vals = NULL;
+    n->version = 0;
+    if (e->cap) {
+        n->syms = pool_alloc(sizeof(char*) * n->cap);
+        n->vals = pool_alloc(sizeof(struct lval*) * n->cap);
+        memcpy(n->syms, e->syms, sizeof(char*) * n->cap);
+        for (int i = 0; i < e->cap; i++) {
+            if (e->syms[i]) { n->vals[i] = lval_copy(e->vals[i]); }
+        }
     }
     return n;
 }
-
@@ -5,6 +5,10 @@
 
 struct lval;
 struct lenv;
+struct lcode;
+struct memo;
+struct map;
+struct outbuf;
 typedef struct lval* (*lbuiltin)(struct lenv*, struct lval*);
 
 typedef enum {
@@ -14,46 +18,172 @@ typedef enum {
     LVAL_STR,
     LVAL_FUN,
     LVAL_SEXPR,
-    LVAL_QEXPR
+    LVAL_QEXPR,
+    LVAL_VEC,   // packed int64 vector
+    LVAL_MAP,   // hash map
+    LVAL_MEMO,  // internal: the cache of a memoized function
+    LVAL_BUF,   // internal: cell storage shared between lists
+    LVAL_TABLE  // internal: entry storage shared between maps
 } lval_type;
 
+// lvals are reference counted and copy-on-write: lval_copy shares the
+// value, lval_del drops a reference, and anything that mutates a value
+// in place must first take a private copy with lval_unshare.
+//
+// Numbers that fit in 63 bits are not allocated at all: the lval
+// pointer itself holds the value, tagged by its low bit. Use
+// lval_type_of and lval_num_of rather than ->type and ->num on any
+// value that may be a number. Heap lvals keep only the payload their
+// type needs.
 struct lval {
-    lval_type type;
+    unsigned char type;
+    int refs;
 
-    long num;
-    char* err;
-    char* sym;
-    char* str;
+    // Heap list and scratch count owned by the collector (gc.c).
+    int gc_refs;
+    struct lval* gc_prev;
+    struct lval* gc_next;
 
-    lbuiltin builtin;
-    struct lenv* env;
-    struct lval* formals;
-    struct lval* body;
-
-    int count;
-    struct lval** cell;
+    union {
+        long num; // numbers too large for a fixnum
+        char* err;
+        // LVAL_STR: slen bytes at str, with no NULs among them. A string
+        // either owns them, NUL-terminated right after the lval, or is a
+        // slice of the owning string sbase and points into it.
+        struct {
+            char* str;
+            long slen;
+            struct lval* sbase;
+        };
+        // A symbol in the AST caches the global binding it last resolved
+        // to (see lenv_lookup), valid while root env ic_env is at version
+        // ic_version. The cache holds a reference to the value.
+        struct {
+            char* sym;
+            struct lval* ic;
+            struct lenv* ic_env;
+            unsigned long ic_version;
+        };
+        struct {
+            lbuiltin builtin;
+            struct lenv* env;
+            struct lval* formals;
+            struct lval* body;
+        };
+        // S/Q-expressions are views of count cells starting at cell,
+        // inside a cell buffer that other lists may share. tail, init
+        // and slice make new views of the same buffer. A lambda's body
+        // may carry its compiled bytecode (vm.c); such a body is private
+        // to the lambda and never mutated. line is the source line a
+        // list was parsed from, or 0.
+        struct {
+            int count;
+            int line;
+            struct lval* buf;
+            struct lval** cell;
+            struct lcode* code;
+        };
+        // LVAL_BUF owns the elements in items[lo, hi). A list ending at
+        // hi (or starting at lo) may claim free slots past that edge in
+        // place, so appends and conses don't copy the shared part.
+        struct {
+            int cap;
+            int lo;
+            int hi;
+            struct lval** items;
+        };
+        // LVAL_VEC: len packed integers, operated on by the kernels in
+        // vec.c.
+        struct {
+            long len;
+            int64_t* data;
+        };
+        // LVAL_MAP: a view of the first nentries entries of the
+        // LVAL_TABLE tab, or NULL if it has had none, nkeys of them live
+        // (map.h).
+        struct {
+            struct lval* tab;
+            int nentries;
+            int nkeys;
+        };
+        // LVAL_TABLE: the entries and their index.
+        struct map* map;
+        // LVAL_MEMO: a memoized function's cache (memo.c). It is
+        // mutated in place, so copies share it, as lval_unshare does.
+        struct memo* memo;
+    };
 };
 
+#define LVAL_FIXNUM_MIN (LONG_MIN / 2)
+#define LVAL_FIXNUM_MAX (LONG_MAX / 2)
+
+// Slices of strings shorter than this are copied (see lval_str_slice).
+#define STR_SLICE_MIN 32
+
+static inline int lval_is_fixnum(const struct lval* v) {
+    return ((uintptr_t)v & 1) != 0;
+}
+
+static inline lval_type lval_type_of(const struct lval* v) {
+    return lval_is_fixnum(v) ? LVAL_NUM : (lval_type)v->type;
+}
+
+static inline long lval_num_of(const struct lval* v) {
+    return lval_is_fixnum(v) ? (long)((intptr_t)v >> 1) : v->num;
+}
+
+// Symbols are interned: every LVAL_SYM with the same name shares one
+// char* from the symbol table, so names compare by pointer.
+// Environments are open-addressed hash tables keyed on that pointer;
+// an empty slot has a NULL sym.
+//
+// Scoping is lexical, with flat closures: a lambda's env holds the
+// variables it captured when it was made, then its arguments, and its
+// parent is always the global env. Chains are never deeper than that.
 struct lenv {
     struct lenv* par;
     int count;
+    int cap;
     char** syms;
     struct lval** vals;
+    // Bumped whenever a binding in a root env is overwritten, so that
+    // caches of resolved globals can tell when they may be stale.
+    unsigned long version;
 };
 
+char* sym_intern(const char* s);
+char* sym_intern_n(const char* s, size_t n);
+
 struct lval* lval_num(long x);
 struct lval* lval_err(char* fmt, ...);
 struct lval* lval_sym(char* s);
+struct lval* lval_sym_n(const char* s, size_t n);
 struct lval* lval_str(char* s);
+struct lval* lval_str_n(const char* s, long n);
+struct lval* lval_str_slice(struct lval* s, long at, long n);
+struct lval* lval_str_owned(struct lval* v);
 struct lval* lval_builtin(lbuiltin func);
 struct lval* lval_lambda(struct lval* formals, struct lval* body);
 struct lval* lval_sexpr(void);
 struct lval* lval_qexpr(void);
+struct lval* lval_vec(long len);
+struct lval* lval_map(void);
+struct lval* lval_table(void);
+struct lval* lval_memo(struct lval* f, int limit);
 
 void lval_del(struct lval* v);
+void lval_free(struct lval* v);
 struct lval* lval_add(struct lval* v, struct lval* x);
+void lval_resize(struct lval* v, int cap);
+struct lval* lval_slice(struct lval* v, int start, int count);
+struct lval* lval_cons(struct lval* x, struct lval* q);
+struct lval* lval_join(struct lval* x, struct lval* y);
 struct lval* lval_copy(struct lval* v);
+struct lval* lval_unshare(struct lval* v);
 
+// Writes v as the REPL shows it. lval_print and lval_println write it
+// to standard output (out.h).
+void lval_write(struct outbuf* b, struct lval* v);
 void lval_print(struct lval* v);
 void lval_println(struct lval* v);
 void lval_expr_print(struct lval* v, char open, char close);
@@ -62,7 +192,10 @@ char* ltype_name(lval_type t);
 struct lenv* lenv_new(void);
 void lenv_del(struct lenv* e);
 struct lval* lenv_get(struct lenv* e, struct lval* k);
+struct lval* lenv_find(struct lenv* e, char* sym);
+struct lval* lenv_lookup(struct lenv* e, struct lval* k);
 void lenv_put(struct lenv* e, struct lval* k, struct lval* v);
+struct lenv* lenv_root(struct lenv* e);
 void lenv_def(struct lenv* e, struct lval* k, struct lval* v);
 struct lenv* lenv_copy(struct lenv* e);
 
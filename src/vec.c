@@ -0,0 +1,236 @@
+#include <pthread.h>
+#include "vec.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define VEC_X86
+#include <immintrin.h>
+#endif
+
+/* Scalar */
+
+static int64_t sum_scalar(const int64_t* x, long n) {
+    uint64_t s = 0;
+    for (long i = 0; i < n; i++) { s += (uint64_t)x[i]; }
+    return (int64_t)s;
+}
+
+static int64_t dot_scalar(const int64_t* x, const int64_t* y, long n) {
+    uint64_t s = 0;
+    for (long i = 0; i < n; i++) { s += (uint64_t)x[i] * (uint64_t)y[i]; }
+    return (int64_t)s;
+}
+
+static int64_t min_scalar(const int64_t* x, long n) {
+    int64_t m = x[0];
+    for (long i = 1; i < n; i++) { if (x[i] < m) { m = x[i]; } }
+    return m;
+}
+
+static int64_t max_scalar(const int64_t* x, long n) {
+    int64_t m = x[0];
+    for (long i = 1; i < n; i++) { if (x[i] > m) { m = x[i]; } }
+    return m;
+}
+
+static void add_scalar(int64_t* dst, const int64_t* x, int64_t k, long n) {
+    for (long i = 0; i < n; i++) { dst[i] = (int64_t)((uint64_t)x[i] + (uint64_t)k); }
+}
+
+static long filter_gt_scalar(int64_t* dst, const int64_t* x, int64_t k, long n) {
+    long m = 0;
+    for (long i = 0; i < n; i++) { if (x[i] > k) { dst[m++] = x[i]; } }
+    return m;
+}
+
+#ifndef VEC_X86
+
+static const struct vec_kernels vec_scalar = {
+    "scalar", sum_scalar, dot_scalar, min_scalar, max_scalar, add_scalar, filter_gt_scalar
+};
+
+#else
+
+/* SSE2: baseline on x86-64. It has no 64-bit compare, so min, max and
+   filter stay scalar. */
+
+// The low 64 bits of a * b, from 32-bit multiplies.
+static inline __m128i mullo64_sse2(__m128i a, __m128i b) {
+    __m128i lo = _mm_mul_epu32(a, b);
+    __m128i cross = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), b),
+                                  _mm_mul_epu32(a, _mm_srli_epi64(b, 32)));
+    return _mm_add_epi64(lo, _mm_slli_epi64(cross, 32));
+}
+
+static int64_t hsum_sse2(__m128i v) {
+    int64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, v);
+    return (int64_t)((uint64_t)lanes[0] + (uint64_t)lanes[1]);
+}
+
+static int64_t sum_sse2(const int64_t* x, long n) {
+    __m128i a0 = _mm_setzero_si128(), a1 = _mm_setzero_si128();
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        a0 = _mm_add_epi64(a0, _mm_loadu_si128((const __m128i*)(x + i)));
+        a1 = _mm_add_epi64(a1, _mm_loadu_si128((const __m128i*)(x + i + 2)));
+    }
+    uint64_t s = (uint64_t)hsum_sse2(_mm_add_epi64(a0, a1));
+    return (int64_t)(s + (uint64_t)sum_scalar(x + i, n - i));
+}
+
+static int64_t dot_sse2(const int64_t* x, const int64_t* y, long n) {
+    __m128i acc = _mm_setzero_si128();
+    long i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i p = mullo64_sse2(_mm_loadu_si128((const __m128i*)(x + i)),
+                                 _mm_loadu_si128((const __m128i*)(y + i)));
+        acc = _mm_add_epi64(acc, p);
+    }
+    uint64_t s = (uint64_t)hsum_sse2(acc);
+    return (int64_t)(s + (uint64_t)dot_scalar(x + i, y + i, n - i));
+}
+
+static void add_sse2(int64_t* dst, const int64_t* x, int64_t k, long n) {
+    __m128i kk = _mm_set1_epi64x(k);
+    long i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(x + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi64(v, kk));
+    }
+    add_scalar(dst + i, x + i, k, n - i);
+}
+
+static const struct vec_kernels vec_sse2 = {
+    "sse2", sum_sse2, dot_sse2, min_scalar, max_scalar, add_sse2, filter_gt_scalar
+};
+
+/* AVX2 */
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i mullo64_avx2(__m256i a, __m256i b) {
+    __m256i lo = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                                     _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+AVX2 static int64_t hsum_avx2(__m256i v) {
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, v);
+    return (int64_t)((uint64_t)lanes[0] + (uint64_t)lanes[1]
+                   + (uint64_t)lanes[2] + (uint64_t)lanes[3]);
+}
+
+AVX2 static int64_t sum_avx2(const int64_t* x, long n) {
+    __m256i a0 = _mm256_setzero_si256(), a1 = _mm256_setzero_si256();
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        a0 = _mm256_add_epi64(a0, _mm256_loadu_si256((const __m256i*)(x + i)));
+        a1 = _mm256_add_epi64(a1, _mm256_loadu_si256((const __m256i*)(x + i + 4)));
+    }
+    uint64_t s = (uint64_t)hsum_avx2(_mm256_add_epi64(a0, a1));
+    return (int64_t)(s + (uint64_t)sum_scalar(x + i, n - i));
+}
+
+AVX2 static int64_t dot_avx2(const int64_t* x, const int64_t* y, long n) {
+    __m256i acc = _mm256_setzero_si256();
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i p = mullo64_avx2(_mm256_loadu_si256((const __m256i*)(x + i)),
+                                 _mm256_loadu_si256((const __m256i*)(y + i)));
+        acc = _mm256_add_epi64(acc, p);
+    }
+    uint64_t s = (uint64_t)hsum_avx2(acc);
+    return (int64_t)(s + (uint64_t)dot_scalar(x + i, y + i, n - i));
+}
+
+AVX2 static int64_t min_avx2(const int64_t* x, long n) {
+    if (n < 4) { return min_scalar(x, n); }
+    __m256i m = _mm256_loadu_si256((const __m256i*)x);
+    long i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(x + i));
+        m = _mm256_blendv_epi8(m, v, _mm256_cmpgt_epi64(m, v));
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, m);
+    int64_t r = min_scalar(lanes, 4);
+    if (i < n) {
+        int64_t t = min_scalar(x + i, n - i);
+        if (t < r) { r = t; }
+    }
+    return r;
+}
+
+AVX2 static int64_t max_avx2(const int64_t* x, long n) {
+    if (n < 4) { return max_scalar(x, n); }
+    __m256i m = _mm256_loadu_si256((const __m256i*)x);
+    long i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(x + i));
+        m = _mm256_blendv_epi8(m, v, _mm256_cmpgt_epi64(v, m));
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, m);
+    int64_t r = max_scalar(lanes, 4);
+    if (i < n) {
+        int64_t t = max_scalar(x + i, n - i);
+        if (t > r) { r = t; }
+    }
+    return r;
+}
+
+AVX2 static void add_avx2(int64_t* dst, const int64_t* x, int64_t k, long n) {
+    __m256i kk = _mm256_set1_epi64x(k);
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(x + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_add_epi64(v, kk));
+    }
+    add_scalar(dst + i, x + i, k, n - i);
+}
+
+// Compares four at a time; whole groups that pass are stored at once,
+// mixed groups element by element.
+AVX2 static long filter_gt_avx2(int64_t* dst, const int64_t* x, int64_t k, long n) {
+    __m256i kk = _mm256_set1_epi64x(k);
+    long m = 0;
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(x + i));
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, kk)));
+        if (mask == 0xf) {
+            _mm256_storeu_si256((__m256i*)(dst + m), v);
+            m += 4;
+        } else {
+            for (int j = 0; j < 4; j++) {
+                if (mask & (1 << j)) { dst[m++] = x[i + j]; }
+            }
+        }
+    }
+    return m + filter_gt_scalar(dst + m, x + i, k, n - i);
+}
+
+static const struct vec_kernels vec_avx2 = {
+    "avx2", sum_avx2, dot_avx2, min_avx2, max_avx2, add_avx2, filter_gt_avx2
+};
+
+#endif // VEC_X86
+
+static const struct vec_kernels* kernels = NULL;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void kernels_init(void) {
+#ifdef VEC_X86
+    __builtin_cpu_init();
+    kernels = __builtin_cpu_supports("avx2") ? &vec_avx2 : &vec_sse2;
+#else
+    kernels = &vec_scalar;
+#endif
+}
+
+const struct vec_kernels* vec_kernels(void) {
+    pthread_once(&kernels_once, kernels_init);
+    return kernels;
+}
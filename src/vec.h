@@ -0,0 +1,25 @@
+#ifndef VEC_H
+#define VEC_H
+
+#include <stdint.h>
+
+// Kernels over packed int64 arrays, behind the LVAL_VEC builtins. Each
+// has a scalar version and, on x86-64, SSE2 and AVX2 versions; the
+// first call to vec_kernels picks the best set the CPU supports.
+// Arithmetic wraps, as it does on the hardware.
+
+struct vec_kernels {
+    const char* isa;
+    int64_t (*sum)(const int64_t* x, long n);
+    int64_t (*dot)(const int64_t* x, const int64_t* y, long n);
+    int64_t (*min)(const int64_t* x, long n); // n > 0
+    int64_t (*max)(const int64_t* x, long n); // n > 0
+    void (*add)(int64_t* dst, const int64_t* x, int64_t k, long n);
+    // Writes the elements of x greater than k to dst, in order, and
+    // returns how many there were.
+    long (*filter_gt)(int64_t* dst, const int64_t* x, int64_t k, long n);
+};
+
+const struct vec_kernels* vec_kernels(void);
+
+#endif // VEC_H
@@ -0,0 +1,651 @@
+#include <pthread.h>
+#include "vm.h"
+#include "eval.h"
+#include "gc.h"
+
+int vm_enabled = 0;
+
+// Operands follow their opcode in the code array.
+enum {
+    OP_CONST,   // k: push consts[k]
+    OP_LOCAL,   // i: push formal i
+    OP_GLOBAL,  // k: push the value of the symbol consts[k]
+    OP_ADD,     // n: pop n operands, push the result
+    OP_SUB,     // n
+    OP_MUL,     // n
+    OP_DIV,     // n
+    OP_MOD,     // n
+    OP_GT,      // pop 2 operands, push 0 or 1
+    OP_LT,
+    OP_GE,
+    OP_LE,
+    OP_EQ,
+    OP_NE,
+    OP_BRANCH,  // else, end: pop a condition, jump to else if it is 0
+    OP_JUMP,    // target
+    OP_CALL,    // n: pop a function and n arguments, push the result
+    OP_TAILCALL,// n: as OP_CALL, then return the result
+    OP_RETURN,  // pop the result
+    OP_COUNT
+};
+
+// The builtins compiled to dedicated opcodes; entry i is OP_ADD + i.
+static const struct {
+    const char* name;
+    lbuiltin func;
+} vm_prims[] = {
+    { "+",  builtin_add }, { "-",  builtin_sub }, { "*",  builtin_mul },
+    { "/",  builtin_div }, { "%",  builtin_mod },
+    { ">",  builtin_gt  }, { "<",  builtin_lt  }, { ">=", builtin_ge },
+    { "<=", builtin_le  }, { "==", builtin_eq  }, { "!=", builtin_ne },
+    { "if", builtin_if  },
+};
+
+#define VM_NPRIMS (int)(sizeof(vm_prims) / sizeof(vm_prims[0]))
+#define VM_PRIM_IF (OP_BRANCH - OP_ADD)
+
+static char* prim_syms[VM_NPRIMS];
+static pthread_once_t prim_syms_once = PTHREAD_ONCE_INIT;
+
+static void prim_syms_init(void) {
+    for (int i = 0; i < VM_NPRIMS; i++) { prim_syms[i] = sym_intern(vm_prims[i].name); }
+}
+
+// A frame's slots hold the formals, then the variables the lambda
+// captured when it was made, then the value stack.
+struct lcode {
+    int nparams;
+    int nlocals;            // formals and captured variables
+    struct lval** names;    // their symbols
+    struct lval** captured; // the captured values
+
+    int* ops;
+    int count;
+    int cap;
+
+    struct lval** consts;
+    int nconsts;
+    int consts_cap;
+
+    int depth;              // stack depth at the end of the code so far
+    int max_depth;
+
+    unsigned prims;         // bit i set when the code inlines vm_prims[i]
+    int prims_ok;           // whether those still name the builtins...
+    int checked;
+    unsigned long version;  // ...as of this global env version
+};
+
+/* Compiler */
+
+static void emit(struct lcode* c, int x) {
+    if (c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 16;
+        c->ops = realloc(c->ops, sizeof(int) * c->cap);
+    }
+    c->ops[c->count++] = x;
+}
+
+static void push(struct lcode* c, int n) {
+    c->depth += n;
+    if (c->depth > c->max_depth) { c->max_depth = c->depth; }
+}
+
+// Takes over v.
+static int add_const(struct lcode* c, struct lval* v) {
+    if (c->nconsts == c->consts_cap) {
+        c->consts_cap = c->consts_cap ? c->consts_cap * 2 : 8;
+        c->consts = realloc(c->consts, sizeof(struct lval*) * c->consts_cap);
+    }
+    c->consts[c->nconsts] = v;
+    return c->nconsts++;
+}
+
+// The slot of the local named by sym, or -1. A repeated formal binds
+// its last argument, as in lval_call.
+static int local_index(struct lcode* c, struct lval* sym) {
+    for (int i = c->nlocals - 1; i >= 0; i--) {
+        if (c->names[i]->sym == sym->sym) { return i; }
+    }
+    return -1;
+}
+
+static int prim_index(struct lcode* c, struct lval* x) {
+    if (lval_type_of(x) != LVAL_SYM || local_index(c, x) >= 0) { return -1; }
+    for (int i = 0; i < VM_NPRIMS; i++) {
+        if (x->sym == prim_syms[i]) { return i; }
+    }
+    return -1;
+}
+
+static void compile_list(struct lcode* c, struct lval* x, int tail);
+
+// tail is set when x's value is the value of the whole body.
+static void compile_expr(struct lcode* c, struct lval* x, int tail) {
+    if (lval_type_of(x) == LVAL_SEXPR) {
+        compile_list(c, x, tail);
+        return;
+    }
+    if (lval_type_of(x) == LVAL_SYM) {
+        int i = local_index(c, x);
+        if (i >= 0) {
+            emit(c, OP_LOCAL); emit(c, i);
+        } else {
+            emit(c, OP_GLOBAL); emit(c, add_const(c, lval_copy(x)));
+        }
+    } else {
+        emit(c, OP_CONST); emit(c, add_const(c, lval_copy(x)));
+    }
+    push(c, 1);
+}
+
+// Compiles the cells of x as an S-Expression, whatever x's type, the
+// way lval_eval_sexpr would evaluate them.
+static void compile_list(struct lcode* c, struct lval* x, int tail) {
+    if (x->count == 0) {
+        emit(c, OP_CONST); emit(c, add_const(c, lval_sexpr()));
+        push(c, 1);
+        return;
+    }
+    if (x->count == 1) {
+        compile_expr(c, x->cell[0], tail);
+        return;
+    }
+
+    int n = x->count - 1;
+    int p = prim_index(c, x->cell[0]);
+
+    if (p == VM_PRIM_IF && n == 3
+        && lval_type_of(x->cell[2]) == LVAL_QEXPR
+        && lval_type_of(x->cell[3]) == LVAL_QEXPR) {
+        c->prims |= 1u << p;
+        compile_expr(c, x->cell[1], 0);
+        emit(c, OP_BRANCH);
+        int branch = c->count;
+        emit(c, 0); emit(c, 0);
+        c->depth--;
+
+        compile_list(c, x->cell[2], tail);
+        emit(c, OP_JUMP);
+        int jump = c->count;
+        emit(c, 0);
+
+        c->ops[branch] = c->count;
+        c->depth--;
+        compile_list(c, x->cell[3], tail);
+        c->ops[branch + 1] = c->ops[jump] = c->count;
+        return;
+    }
+
+    if (p >= 0 && p < VM_PRIM_IF && (OP_ADD + p <= OP_MOD || n == 2)) {
+        c->prims |= 1u << p;
+        for (int i = 1; i <= n; i++) { compile_expr(c, x->cell[i], 0); }
+        emit(c, OP_ADD + p);
+        if (OP_ADD + p <= OP_MOD) { emit(c, n); }
+        c->depth -= n - 1;
+        return;
+    }
+
+    for (int i = 0; i <= n; i++) { compile_expr(c, x->cell[i], 0); }
+    emit(c, tail ? OP_TAILCALL : OP_CALL); emit(c, n);
+    c->depth -= n;
+}
+
+// env holds the variables the lambda captured. Returns NULL for lambdas
+// the VM does not run: those taking '&'.
+struct lcode* vm_compile(struct lval* formals, struct lval* body, struct lenv* env) {
+    pthread_once(&prim_syms_once, prim_syms_init);
+    for (int i = 0; i < formals->count; i++) {
+        if (strcmp(formals->cell[i]->sym, "&") == 0) { return NULL; }
+    }
+
+    struct lcode* c = calloc(1, sizeof(struct lcode));
+    c->nparams = formals->count;
+    c->nlocals = formals->count + env->count;
+    c->names = calloc(c->nlocals + 1, sizeof(struct lval*));
+    c->captured = calloc(env->count + 1, sizeof(struct lval*));
+    for (int i = 0; i < c->nparams; i++) { c->names[i] = lval_copy(formals->cell[i]); }
+    for (int i = 0, j = c->nparams; i < env->cap; i++) {
+        if (!env->syms[i]) { continue; }
+        c->captured[j - c->nparams] = lval_copy(env->vals[i]);
+        c->names[j++] = lval_sym(env->syms[i]);
+    }
+
+    compile_list(c, body, 1);
+    emit(c, OP_RETURN);
+    return c;
+}
+
+void vm_children(struct lcode* c, void (*visit)(struct lval*, void*), void* ctx) {
+    for (int i = 0; i < c->nlocals; i++) { visit(c->names[i], ctx); }
+    for (int i = c->nparams; i < c->nlocals; i++) {
+        struct lval* x = c->captured[i - c->nparams];
+        if (!lval_is_fixnum(x)) { visit(x, ctx); }
+    }
+    for (int i = 0; i < c->nconsts; i++) {
+        if (!lval_is_fixnum(c->consts[i])) { visit(c->consts[i], ctx); }
+    }
+}
+
+static void release(struct lval* x, void* ctx) {
+    lval_del(x);
+}
+
+void vm_release(struct lcode* c) {
+    vm_children(c, release, NULL);
+}
+
+void vm_free(struct lcode* c) {
+    free(c->names);
+    free(c->captured);
+    free(c->consts);
+    free(c->ops);
+    free(c);
+}
+
+/* Interpreter */
+
+static int vm_check_prims(struct lenv* e, struct lcode* c) {
+    e = lenv_root(e);
+    c->prims_ok = 1;
+    for (int i = 0; i < VM_NPRIMS && c->prims_ok; i++) {
+        if (!(c->prims & (1u << i))) { continue; }
+        struct lval* k = lval_sym((char*)vm_prims[i].name);
+        struct lval* v = lenv_get(e, k);
+        c->prims_ok = lval_type_of(v) == LVAL_FUN && v->builtin == vm_prims[i].func;
+        lval_del(k); lval_del(v);
+    }
+    c->checked = 1;
+    c->version = e->version;
+    return c->prims_ok;
+}
+
+// Whether lval_call may hand a call of f on argc arguments to vm_call:
+// f must be compiled, and the call must bind all of its formals at once
+// (f's env holding only what it captured).
+int vm_can_call(struct lenv* e, struct lval* f, int argc) {
+    struct lcode* c = f->body->code;
+    if (!c || argc != c->nparams || f->env->count != c->nlocals - c->nparams) { return 0; }
+    if (!c->checked || c->version != lenv_root(e)->version) { return vm_check_prims(e, c); }
+    return c->prims_ok;
+}
+
+// Frames keep this many slots on the C stack and go to the heap for
+// more.
+#define VM_FRAME_SLOTS 16
+
+struct vm_frame {
+    struct lval* fn;       // the lambda running, which owns code
+    struct lcode* code;
+    struct lenv* globals;
+    struct lenv* env;      // the locals as an env, made for builtins that want one
+    struct lval** locals;  // the locals, followed by the value stack
+    int nslots;
+    struct vm_tail* tail;
+    struct lval* small[VM_FRAME_SLOTS];
+};
+
+// Makes room in fr for n slots, keeping the first keep.
+static void vm_frame_reserve(struct vm_frame* fr, int n, int keep) {
+    if (n <= fr->nslots) { return; }
+    struct lval** slots = malloc(sizeof(struct lval*) * n);
+    memcpy(slots, fr->locals, sizeof(struct lval*) * keep);
+    if (fr->locals != fr->small) { free(fr->locals); }
+    fr->locals = slots;
+    fr->nslots = n;
+}
+
+// Starts running f in fr, on the arguments in args.
+static void vm_frame_enter(struct vm_frame* fr, struct lval* f, struct lval** args) {
+    struct lcode* c = f->body->code;
+    fr->fn = f;
+    fr->code = c;
+    for (int i = 0; i < c->nparams; i++) { fr->locals[i] = args[i]; }
+    for (int i = c->nparams; i < c->nlocals; i++) {
+        fr->locals[i] = lval_copy(c->captured[i - c->nparams]);
+    }
+}
+
+static void vm_frame_leave(struct vm_frame* fr) {
+    for (int i = 0; i < fr->code->nlocals; i++) { lval_del(fr->locals[i]); }
+    if (fr->env) { lenv_del(fr->env); }
+    fr->env = NULL;
+    lval_del(fr->fn);
+}
+
+// Builtins that evaluate code or assign (eval, if, '=', \\ and those
+// that call or evaluate what they are given) need the locals in a real
+// env, where they look them up by name. The rest never touch their env.
+static int vm_needs_env(lbuiltin f) {
+    return f == builtin_eval || f == builtin_if || f == builtin_put
+        || f == builtin_lambda || f == builtin_load
+        || f == builtin_pmap || f == builtin_preduce || f == builtin_memo_call
+        || f == builtin_profile || f == builtin_sample_profile;
+}
+
+static struct lenv* vm_frame_env(struct vm_frame* fr) {
+    if (!fr->env) {
+        fr->env = lenv_new();
+        fr->env->par = fr->globals;
+        for (int i = 0; i < fr->code->nlocals; i++) {
+            lenv_put(fr->env, fr->code->names[i], fr->locals[i]);
+        }
+    }
+    return fr->env;
+}
+
+// Re-reads the locals from the frame's env after a builtin that may
+// have assigned to them, such as '=' or eval.
+static void vm_frame_sync(struct vm_frame* fr) {
+    for (int i = 0; i < fr->code->nlocals; i++) {
+        struct lval* v = lenv_get(fr->env, fr->code->names[i]);
+        lval_del(fr->locals[i]);
+        fr->locals[i] = v;
+    }
+}
+
+// Consumes the n operands of an inlined builtin_op and returns what
+// builtin_op would, having had lval_eval_sexpr check them for errors.
+static struct lval* vm_arith(int op, struct lval** args, int n) {
+    const char* name = vm_prims[op - OP_ADD].name;
+    struct lval* r = NULL;
+
+    for (int i = 0; i < n && !r; i++) {
+        if (lval_type_of(args[i]) == LVAL_ERR) { r = lval_copy(args[i]); }
+    }
+    for (int i = 0; i < n && !r; i++) {
+        if (lval_type_of(args[i]) != LVAL_NUM) {
+            r = lval_err("Function \'%s\' passed incorrect type for argument %i. Got %s, Expected %s.",
+                name, i, ltype_name(lval_type_of(args[i])), ltype_name(LVAL_NUM));
+        }
+    }
+
+    if (!r) {
+        long x = lval_num_of(args[0]);
+        if (op == OP_SUB && n == 1) { x = -x; }
+        for (int i = 1; i < n && !r; i++) {
+            long y = lval_num_of(args[i]);
+            switch (op) {
+                case OP_ADD: x += y; break;
+                case OP_SUB: x -= y; break;
+                case OP_MUL: x *= y; break;
+                case OP_DIV:
+                    if (y == 0) { r = lval_err("Division By Zero."); } else { x /= y; }
+                    break;
+                case OP_MOD:
+                    if (y == 0) { r = lval_err("Division By Zero (Modulo)."); } else { x %= y; }
+                    break;
+            }
+        }
+        if (!r) { r = lval_num(x); }
+    }
+
+    for (int i = 0; i < n; i++) { lval_del(args[i]); }
+    return r;
+}
+
+// As vm_arith, for builtin_ord and builtin_cmp.
+static struct lval* vm_compare(int op, struct lval* x, struct lval* y) {
+    const char* name = vm_prims[op - OP_ADD].name;
+    struct lval* r;
+
+    if (lval_type_of(x) == LVAL_ERR) {
+        r = lval_copy(x);
+    } else if (lval_type_of(y) == LVAL_ERR) {
+        r = lval_copy(y);
+    } else if (op == OP_EQ) {
+        r = lval_num(lval_eq(x, y));
+    } else if (op == OP_NE) {
+        r = lval_num(!lval_eq(x, y));
+    } else if (lval_type_of(x) != LVAL_NUM || lval_type_of(y) != LVAL_NUM) {
+        int i = lval_type_of(x) != LVAL_NUM ? 0 : 1;
+        r = lval_err("Function \'%s\' passed incorrect type for argument %i. Got %s, Expected %s.",
+            name, i, ltype_name(lval_type_of(i ? y : x)), ltype_name(LVAL_NUM));
+    } else {
+        long a = lval_num_of(x);
+        long b = lval_num_of(y);
+        switch (op) {
+            case OP_GT: r = lval_num(a > b);  break;
+            case OP_LT: r = lval_num(a < b);  break;
+            case OP_GE: r = lval_num(a >= b); break;
+            default:    r = lval_num(a <= b); break;
+        }
+    }
+
+    lval_del(x); lval_del(y);
+    return r;
+}
+
+// Consumes f = v[0] and its n arguments, and returns what
+// lval_eval_sexpr would for them.
+static struct lval* vm_apply(struct vm_frame* fr, struct lval** v, int n) {
+    for (int i = 0; i <= n; i++) {
+        if (lval_type_of(v[i]) == LVAL_ERR) {
+            struct lval* err = lval_copy(v[i]);
+            for (int j = 0; j <= n; j++) { lval_del(v[j]); }
+            return err;
+        }
+    }
+
+    struct lval* f = v[0];
+    if (lval_type_of(f) != LVAL_FUN) {
+        struct lval* err = lval_err(
+            "S-Expression starts with incorrect type. "
+            "Got %s, Expected %s.",
+            ltype_name(lval_type_of(f)), ltype_name(LVAL_FUN));
+        for (int j = 0; j <= n; j++) { lval_del(v[j]); }
+        return err;
+    }
+
+    struct lval* a = lval_sexpr();
+    lval_resize(a, n);
+    for (int i = 1; i <= n; i++) { lval_add(a, v[i]); }
+
+    // A lambda sees only its own locals and the globals, as do builtins
+    // that don't use their env.
+    if (!f->builtin || !vm_needs_env(f->builtin)) { return lval_call(fr->globals, f, a); }
+    struct lval* r = lval_call(vm_frame_env(fr), f, a);
+    vm_frame_sync(fr);
+    return r;
+}
+
+enum { VM_TAIL_APPLY, VM_TAIL_REUSE, VM_TAIL_HAND_BACK };
+
+// How to make the tail call of v[0] on the n arguments after it: in fr
+// itself when v[0] is a compiled lambda, by handing it back when it
+// would evaluate more Lisp, and otherwise (builtins, errors) directly.
+static int vm_tail_kind(struct vm_frame* fr, struct lval** v, int n) {
+    for (int i = 0; i <= n; i++) {
+        if (lval_type_of(v[i]) == LVAL_ERR) { return VM_TAIL_APPLY; }
+    }
+    struct lval* f = v[0];
+    if (lval_type_of(f) != LVAL_FUN) { return VM_TAIL_APPLY; }
+    if (f->builtin) {
+        return f->builtin == builtin_if || f->builtin == builtin_eval
+            ? VM_TAIL_HAND_BACK : VM_TAIL_APPLY;
+    }
+    return vm_can_call(fr->globals, f, n) ? VM_TAIL_REUSE : VM_TAIL_HAND_BACK;
+}
+
+// Turns fr into the frame of the tail call of v[0].
+static void vm_tail_call(struct vm_frame* fr, struct lval** v, int n) {
+    struct lcode* c = v[0]->body->code;
+    long at = v - fr->locals;
+    vm_frame_reserve(fr, c->nlocals + c->max_depth, at + n + 1);
+    v = fr->locals + at;
+
+    // The callee's arguments sit above the caller's locals, so these
+    // can go first and the arguments move down over them.
+    vm_frame_leave(fr);
+    vm_frame_enter(fr, v[0], v + 1);
+}
+
+static void vm_hand_back(struct vm_frame* fr, struct lval** v, int n) {
+    struct lval* a = lval_sexpr();
+    lval_resize(a, n);
+    for (int i = 1; i <= n; i++) { lval_add(a, v[i]); }
+
+    fr->tail->env = vm_frame_env(fr);
+    fr->tail->f = v[0];
+    fr->tail->v = a;
+}
+
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO
+#endif
+
+#ifdef VM_COMPUTED_GOTO
+#define VM_CASE(op) L_##op
+#define VM_DISPATCH() goto *labels[*pc++]
+#else
+#define VM_CASE(op) case op
+#define VM_DISPATCH() goto dispatch
+#endif
+
+static struct lval* vm_run(struct vm_frame* fr, struct lval** sp) {
+    struct lcode* c = fr->code;
+    int* pc = c->ops;
+
+#ifdef VM_COMPUTED_GOTO
+    static void* labels[OP_COUNT] = {
+        &&L_OP_CONST, &&L_OP_LOCAL, &&L_OP_GLOBAL,
+        &&L_OP_ADD, &&L_OP_SUB, &&L_OP_MUL, &&L_OP_DIV, &&L_OP_MOD,
+        &&L_OP_GT, &&L_OP_LT, &&L_OP_GE, &&L_OP_LE, &&L_OP_EQ, &&L_OP_NE,
+        &&L_OP_BRANCH, &&L_OP_JUMP, &&L_OP_CALL, &&L_OP_TAILCALL, &&L_OP_RETURN,
+    };
+    VM_DISPATCH();
+    {
+#else
+dispatch:
+    switch (*pc++) {
+#endif
+
+    VM_CASE(OP_CONST):
+        *sp++ = lval_copy(c->consts[*pc++]);
+        VM_DISPATCH();
+
+    VM_CASE(OP_LOCAL):
+        *sp++ = lval_copy(fr->locals[*pc++]);
+        VM_DISPATCH();
+
+    VM_CASE(OP_GLOBAL):
+        *sp++ = lenv_lookup(fr->env ? fr->env : fr->globals, c->consts[*pc++]);
+        VM_DISPATCH();
+
+    VM_CASE(OP_ADD):
+    VM_CASE(OP_SUB): {
+        int op = pc[-1];
+        int n = *pc++;
+        sp -= n;
+        if (n == 2 && lval_is_fixnum(sp[0]) && lval_is_fixnum(sp[1])) {
+            // Fixnums are at most half the range of long; no overflow.
+            long x = lval_num_of(sp[0]);
+            long y = lval_num_of(sp[1]);
+            *sp++ = lval_num(op == OP_ADD ? x + y : x - y);
+            VM_DISPATCH();
+        }
+        *sp = vm_arith(op, sp, n);
+        sp++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(OP_MUL):
+    VM_CASE(OP_DIV):
+    VM_CASE(OP_MOD): {
+        int op = pc[-1];
+        int n = *pc++;
+        sp -= n;
+        *sp = vm_arith(op, sp, n);
+        sp++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(OP_GT):
+    VM_CASE(OP_LT):
+    VM_CASE(OP_GE):
+    VM_CASE(OP_LE):
+    VM_CASE(OP_EQ):
+    VM_CASE(OP_NE): {
+        int op = pc[-1];
+        sp -= 2;
+        *sp = vm_compare(op, sp[0], sp[1]);
+        sp++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(OP_BRANCH): {
+        struct lval* x = *--sp;
+        if (lval_type_of(x) == LVAL_NUM) {
+            pc = lval_num_of(x) ? pc + 2 : c->ops + pc[0];
+            lval_del(x);
+            VM_DISPATCH();
+        }
+        // builtin_if would not run; the whole if is an error.
+        if (lval_type_of(x) == LVAL_ERR) {
+            *sp++ = x;
+        } else {
+            *sp++ = lval_err("Function \'%s\' passed incorrect type for argument %i. Got %s, Expected %s.",
+                "if", 0, ltype_name(lval_type_of(x)), ltype_name(LVAL_NUM));
+            lval_del(x);
+        }
+        pc = c->ops + pc[1];
+        VM_DISPATCH();
+    }
+
+    VM_CASE(OP_JUMP):
+        pc = c->ops + pc[0];
+        VM_DISPATCH();
+
+    VM_CASE(OP_CALL): {
+        int n = *pc++;
+        sp -= n + 1;
+        *sp = vm_apply(fr, sp, n);
+        sp++;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(OP_TAILCALL): {
+        int n = *pc++;
+        sp -= n + 1;
+        switch (vm_tail_kind(fr, sp, n)) {
+            case VM_TAIL_APPLY: return vm_apply(fr, sp, n);
+            case VM_TAIL_HAND_BACK: vm_hand_back(fr, sp, n); return NULL;
+        }
+        vm_tail_call(fr, sp, n);
+        gc_maybe_collect();
+        c = fr->code;
+        pc = c->ops;
+        sp = fr->locals + c->nlocals;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(OP_RETURN):
+        return *--sp;
+    }
+
+    return lval_err("Invalid bytecode.");
+}
+
+// Consumes f and a.
+struct lval* vm_call(struct lenv* e, struct lval* f, struct lval* a, struct vm_tail* tail) {
+    struct lcode* c = f->body->code;
+    struct vm_frame fr;
+    fr.globals = lenv_root(e);
+    fr.env = NULL;
+    fr.locals = fr.small;
+    fr.nslots = VM_FRAME_SLOTS;
+    fr.tail = tail;
+
+    vm_frame_reserve(&fr, c->nlocals + c->max_depth, 0);
+    for (int i = 0; i < c->nparams; i++) { lval_copy(a->cell[i]); } // now the frame's
+    vm_frame_enter(&fr, f, a->cell);
+    lval_del(a);
+
+    struct lval* r = vm_run(&fr, fr.locals + c->nlocals);
+
+    // A handed back tail call takes over the env.
+    if (!r) { fr.env = NULL; }
+    vm_frame_leave(&fr);
+    if (fr.locals != fr.small) { free(fr.locals); }
+    return r;
+}
@@ -0,0 +1,48 @@
+#ifndef VM_H
+#define VM_H
+
+#include "types.h"
+
+// Bytecode compiler and stack VM for lambdas. With vm_enabled set,
+// builtin_lambda compiles each lambda body once, and lval_call runs the
+// bytecode instead of re-walking the body whenever a call supplies all
+// of the lambda's arguments at once. Arithmetic, comparisons, if and
+// references to the lambda's formals and captured variables, which
+// live in numbered frame slots, have dedicated opcodes; every
+// other call goes back through lval_call. A call in tail position to a
+// compiled lambda reuses the caller's VM frame; one to anything that
+// evaluates more Lisp (a lambda the VM cannot run, eval, if) is handed
+// back to the evaluator loop instead of nesting.
+//
+// The dedicated opcodes assume + - * / % < > <= >= == != and if still
+// name the global builtins. A compiled lambda falls back to the
+// tree-walker once any of them has been redefined globally; rebinding
+// one as a local in a calling lambda is not detected.
+
+extern int vm_enabled;
+
+struct lcode* vm_compile(struct lval* formals, struct lval* body, struct lenv* env);
+// Compiled code holds references to values (its constants, and the
+// symbols and values of the locals), which vm_children reports to the
+// collector and vm_release drops. vm_free frees the code itself, as
+// lval_free does an lval.
+void vm_children(struct lcode* c, void (*visit)(struct lval*, void*), void* ctx);
+void vm_release(struct lcode* c);
+void vm_free(struct lcode* c);
+
+// A tail call that vm_call leaves to its caller: apply f to the
+// arguments v in env, an env of the finished frame's locals whose
+// parent is the global env. The caller owns all three.
+struct vm_tail {
+    struct lenv* env;
+    struct lval* f;
+    struct lval* v;
+};
+
+int vm_can_call(struct lenv* e, struct lval* f, int argc);
+
+// Returns NULL, having filled in tail, when the lambda ends in a tail
+// call that it does not make itself.
+struct lval* vm_call(struct lenv* e, struct lval* f, struct lval* a, struct vm_tail* tail);
+
+#endif // VM_H